@@ -0,0 +1,77 @@
+﻿#include <algorithm>
+#include "ClipShareBloomFilter.h"
+
+namespace
+{
+    // splitmix64 finalizer
+    std::uint64_t mix(std::uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+}
+
+ClipShareBloomFilter::ClipShareBloomFilter(std::size_t capacity)
+    : capacity(std::max<std::size_t>(1, capacity))
+    , current((this->capacity * BitsPerId + 63) / 64)
+    , previous(current.size())
+{
+}
+
+std::uint64_t ClipShareBloomFilter::key(std::uint64_t origin, std::uint64_t sequence)
+{
+    return mix(origin ^ mix(sequence));
+}
+
+bool ClipShareBloomFilter::test(const std::vector<std::uint64_t>& bits, std::uint64_t key) const
+{
+    // double hashing, Kirsch and Mitzenmacher
+    auto size = bits.size() * 64;
+    auto h1 = key;
+    auto h2 = mix(key) | 1;
+    for (int i = 0; i < Hashes; ++i)
+    {
+        auto bit = (h1 + i * h2) % size;
+        if ((bits[bit / 64] & (std::uint64_t{ 1 } << (bit % 64))) == 0)
+            return false;
+    }
+    return true;
+}
+
+bool ClipShareBloomFilter::contains(std::uint64_t key) const
+{
+    return test(current, key) || test(previous, key);
+}
+
+void ClipShareBloomFilter::insert(std::uint64_t key)
+{
+    if (inserted >= capacity)
+    {
+        // the buffers are reused, rotating never allocates
+        current.swap(previous);
+        std::fill(current.begin(), current.end(), 0);
+        inserted = 0;
+    }
+
+    auto size = current.size() * 64;
+    auto h1 = key;
+    auto h2 = mix(key) | 1;
+    for (int i = 0; i < Hashes; ++i)
+    {
+        auto bit = (h1 + i * h2) % size;
+        current[bit / 64] |= std::uint64_t{ 1 } << (bit % 64);
+    }
+    ++inserted;
+}
+
+bool ClipShareBloomFilter::testAndInsert(std::uint64_t key)
+{
+    if (contains(key))
+        return false;
+    insert(key);
+    return true;
+}
@@ -0,0 +1,35 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// Set of recently seen clip ids with a small false positive rate and no per clip allocation.
+/// Two generations of capacity ids each: inserts go to the current one, lookups check both,
+/// and once the current one is full the older one is cleared and takes its place.
+/// An id is remembered for at least capacity and at most 2 * capacity inserts.
+/// </summary>
+class ClipShareBloomFilter
+{
+public:
+    static constexpr int Hashes{ 12 };
+    static constexpr int BitsPerId{ 20 };   // about 0.01% false positives per generation at capacity
+
+    explicit ClipShareBloomFilter(std::size_t capacity = 4096);
+
+    static std::uint64_t key(std::uint64_t origin, std::uint64_t sequence);
+
+    bool contains(std::uint64_t key) const;
+    void insert(std::uint64_t key);
+    // true if it was not there yet
+    bool testAndInsert(std::uint64_t key);
+
+private:
+    bool test(const std::vector<std::uint64_t>& bits, std::uint64_t key) const;
+
+    std::size_t capacity;
+    std::size_t inserted{ 0 };      // into current
+    std::vector<std::uint64_t> current;
+    std::vector<std::uint64_t> previous;
+};
@@ -0,0 +1,68 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// <summary>
+/// Header of one chunk on a multiplexed peer connection, 12 bytes big endian:
+/// stream id (4), flags (1), priority (1), reserved (2), payload length (4).
+/// A message is the payload of its stream's chunks from Begin to End,
+/// chunks of different streams interleave freely.
+/// Qt free, the hub parses the same headers.
+/// </summary>
+struct ClipShareChunkHeader
+{
+    static constexpr std::size_t Size{ 12 };
+
+    // single chunk messages between the two ends of a connection, see ClipShareControlPackage
+    static constexpr std::uint32_t ControlStream{ 0 };
+
+    enum Flags : std::uint8_t
+    {
+        Begin = 0x01,
+        End = 0x02,
+        Cancel = 0x04,      // the receiver drops whatever it has of the stream
+    };
+
+    std::uint32_t stream{ 0 };
+    std::uint8_t flags{ 0 };
+    std::uint8_t priority{ 0 };     // lower goes first
+    std::uint16_t reserved{ 0 };
+    std::uint32_t length{ 0 };
+
+    void write(std::uint8_t* out) const
+    {
+        putUint32(out, stream);
+        out[4] = flags;
+        out[5] = priority;
+        out[6] = static_cast<std::uint8_t>(reserved >> 8);
+        out[7] = static_cast<std::uint8_t>(reserved);
+        putUint32(out + 8, length);
+    }
+
+    static ClipShareChunkHeader read(const std::uint8_t* in)
+    {
+        ClipShareChunkHeader header;
+        header.stream = getUint32(in);
+        header.flags = in[4];
+        header.priority = in[5];
+        header.reserved = static_cast<std::uint16_t>(in[6] << 8 | in[7]);
+        header.length = getUint32(in + 8);
+        return header;
+    }
+
+private:
+    static void putUint32(std::uint8_t* out, std::uint32_t value)
+    {
+        out[0] = static_cast<std::uint8_t>(value >> 24);
+        out[1] = static_cast<std::uint8_t>(value >> 16);
+        out[2] = static_cast<std::uint8_t>(value >> 8);
+        out[3] = static_cast<std::uint8_t>(value);
+    }
+
+    static std::uint32_t getUint32(const std::uint8_t* in)
+    {
+        return static_cast<std::uint32_t>(in[0]) << 24 | static_cast<std::uint32_t>(in[1]) << 16
+            | static_cast<std::uint32_t>(in[2]) << 8 | in[3];
+    }
+};
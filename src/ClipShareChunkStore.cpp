@@ -0,0 +1,73 @@
+﻿#include "ClipShareChunkStore.h"
+
+QByteArray ClipShareChunkStore::key(const ClipShareChunk& chunk)
+{
+    return QByteArray(reinterpret_cast<const char*>(chunk.hash.data()), static_cast<int>(chunk.hash.size()));
+}
+
+void ClipShareChunkStore::add(const QString& path, const std::vector<ClipShareChunk>& recipe)
+{
+    remove(path);
+    std::lock_guard<std::mutex> lock{ mutex };
+    std::vector<QByteArray> keys;
+    keys.reserve(recipe.size());
+    qint64 offset = 0;
+    for (auto& chunk : recipe)
+    {
+        keys.push_back(key(chunk));
+        chunks.insert(keys.back(), Location{ path, offset, chunk.length });
+        offset += chunk.length;
+    }
+    files.emplace_back(path, std::move(keys));
+
+    while (chunks.size() > MaxChunks && files.size() > 1)
+    {
+        forget(files.front().first, files.front().second);
+        files.pop_front();
+    }
+}
+
+bool ClipShareChunkStore::find(const ClipShareChunk& chunk, Location& location) const
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto it = chunks.constFind(key(chunk));
+    if (it == chunks.constEnd())
+        return false;
+    location = *it;
+    return true;
+}
+
+void ClipShareChunkStore::remove(const QString& path)
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto below = path + QLatin1Char('/');
+    for (auto it = files.begin(); it != files.end();)
+    {
+        if (it->first == path || it->first.startsWith(below))
+        {
+            forget(it->first, it->second);
+            it = files.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+int ClipShareChunkStore::size() const
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    return chunks.size();
+}
+
+void ClipShareChunkStore::forget(const QString& path, const std::vector<QByteArray>& keys)
+{
+    // a chunk recorded again for a newer file stays
+    for (auto& key : keys)
+    {
+        auto it = chunks.find(key);
+        if (it != chunks.end() && it->path == path)
+            chunks.erase(it);
+    }
+}
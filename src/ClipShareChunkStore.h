@@ -0,0 +1,46 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "ClipShareChunker.h"
+
+/// <summary>
+/// Where the chunks of files this node has on disk can be found, by their hash.
+/// Files are recorded with their recipe once they are complete: those it offered and those it fetched.
+/// Nothing is copied, a location may be stale by the time it is used, so readers verify the hash.
+/// Beyond MaxChunks the files recorded first are forgotten first.
+/// Only files fetched through ClipShareFileTransfer are chunked; clips carried in the package
+/// itself are sent whole, or as a ClipShareDelta for text.
+/// </summary>
+class ClipShareChunkStore
+{
+public:
+    static constexpr int MaxChunks{ 1 << 18 };  // about 16 GiB of files at the average chunk size
+
+    struct Location
+    {
+        QString path;
+        qint64 offset;
+        qint64 length;
+    };
+
+    static QByteArray key(const ClipShareChunk&);
+
+    // replaces what was recorded for path
+    void add(const QString& path, const std::vector<ClipShareChunk>& recipe);
+    bool find(const ClipShareChunk&, Location&) const;
+    // path and everything below it
+    void remove(const QString& path);
+    int size() const;
+
+private:
+    void forget(const QString& path, const std::vector<QByteArray>& keys);
+
+    mutable std::mutex mutex;
+    QHash<QByteArray, Location> chunks;
+    std::deque<std::pair<QString, std::vector<QByteArray>>> files;     // oldest first
+};
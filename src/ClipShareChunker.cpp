@@ -0,0 +1,55 @@
+﻿#include <algorithm>
+#include "ClipShareChunker.h"
+
+namespace
+{
+    // the high bits of the hash saw the most bytes
+    constexpr std::uint64_t MaskSmall{ ((1ull << 18) - 1) << 46 };  // 2 bits more than the average size
+    constexpr std::uint64_t MaskLarge{ ((1ull << 14) - 1) << 50 };  // 2 bits less
+
+    struct GearTable
+    {
+        std::uint64_t values[256];
+
+        // fixed seed, both ends must cut at the same places
+        GearTable()
+        {
+            std::uint64_t state = 0x636c697073686172ull;
+            for (auto& value : values)
+            {
+                // splitmix64
+                auto x = (state += 0x9e3779b97f4a7c15ull);
+                x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+                x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+                value = x ^ (x >> 31);
+            }
+        }
+    };
+
+    const GearTable gear;
+}
+
+std::size_t ClipShareChunker::boundary(const std::uint8_t* data, std::size_t size)
+{
+    if (size <= MinSize)
+        return size;
+
+    auto end = std::min(size, MaxSize);
+    auto normal = std::min(end, AverageSize);
+    std::uint64_t hash = 0;
+    // nothing before MinSize can be a cut point, hashing starts 64 bytes ahead of it
+    auto i = MinSize - 64;
+    for (; i < normal; ++i)
+    {
+        hash = (hash << 1) + gear.values[data[i]];
+        if (i >= MinSize && (hash & MaskSmall) == 0)
+            return i + 1;
+    }
+    for (; i < end; ++i)
+    {
+        hash = (hash << 1) + gear.values[data[i]];
+        if ((hash & MaskLarge) == 0)
+            return i + 1;
+    }
+    return end;
+}
@@ -0,0 +1,32 @@
+﻿#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/// <summary>
+/// A content defined chunk of a file, in the order of the file. Sent as is in recipes.
+/// </summary>
+struct ClipShareChunk
+{
+    std::array<std::uint8_t, 20> hash;  // SHA-1 of the contents
+    std::uint32_t length;
+};
+
+/// <summary>
+/// FastCDC style content defined chunking with a gear hash.
+/// Cut points depend on the last 64 bytes only, so an insertion or deletion in a file moves
+/// the boundaries next to it and leaves every other chunk as it was. Below the average size
+/// a stricter mask makes cuts unlikely, above it a looser one makes them likely, which keeps
+/// the sizes close to AverageSize.
+/// </summary>
+class ClipShareChunker
+{
+public:
+    static constexpr std::size_t MinSize{ 16 * 1024 };
+    static constexpr std::size_t AverageSize{ 64 * 1024 };
+    static constexpr std::size_t MaxSize{ 256 * 1024 };
+
+    // length of the first chunk of data, size itself if it holds less than MaxSize and no cut point
+    static std::size_t boundary(const std::uint8_t* data, std::size_t size);
+};
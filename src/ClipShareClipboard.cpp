@@ -0,0 +1,164 @@
+﻿#include <QGuiApplication>
+#include <QClipboard>
+#include <QMimeData>
+#include <QBuffer>
+#include <QImage>
+#include <cmath>
+#include "ClipShareClipboard.h"
+
+namespace
+{
+    // QMimeData keeps images as a QImage variant, its bytes are empty
+    const QString QtImageFormat{ "application/x-qt-image" };
+    const QString PngFormat{ "image/png" };
+}
+
+ClipShareSnapshot ClipShareSnapshot::capture(const QMimeData* mimeData)
+{
+    ClipShareSnapshot snapshot;
+    for (auto& format : mimeData->formats())
+    {
+        if (format == QtImageFormat)
+            continue;
+        snapshot.formats.push_back(format);
+        snapshot.data.push_back(mimeData->data(format));
+    }
+
+    if (mimeData->hasImage() && !snapshot.formats.contains(PngFormat))
+    {
+        QByteArray png;
+        QBuffer buffer(&png);
+        buffer.open(QIODevice::WriteOnly);
+        qvariant_cast<QImage>(mimeData->imageData()).save(&buffer, "png");
+        snapshot.formats.push_back(PngFormat);
+        snapshot.data.push_back(png);
+    }
+    return snapshot;
+}
+
+QMimeData* ClipShareSnapshot::toMimeData() const
+{
+    auto mime = new QMimeData;
+    for (int i = 0; i < formats.size() && i < data.size(); ++i)
+    {
+        mime->setData(formats[i], data[i]);
+        if (formats[i] == PngFormat)
+            mime->setImageData(QImage::fromData(data[i], "png"));
+    }
+    return mime;
+}
+
+ClipShareSystemClipboard::ClipShareSystemClipboard(QObject* parent)
+    : ClipShareClipboard(parent)
+{
+    connect(QGuiApplication::clipboard(), &QClipboard::dataChanged, this, &ClipShareClipboard::dataChanged);
+}
+
+const QMimeData* ClipShareSystemClipboard::mimeData() const
+{
+    return QGuiApplication::clipboard()->mimeData();
+}
+
+void ClipShareSystemClipboard::setMimeData(QMimeData* mimeData)
+{
+    QGuiApplication::clipboard()->setMimeData(mimeData);
+}
+
+bool ClipShareSystemClipboard::ownsClipboard() const
+{
+    return QGuiApplication::clipboard()->ownsClipboard();
+}
+
+ClipShareVirtualClipboard::ClipShareVirtualClipboard(QObject* parent)
+    : ClipShareClipboard(parent)
+    , content{ new QMimeData }
+{
+    playTimer.setTimerType(Qt::PreciseTimer);
+    connect(&playTimer, &QTimer::timeout, this, &ClipShareVirtualClipboard::tick);
+}
+
+ClipShareVirtualClipboard::~ClipShareVirtualClipboard()
+{
+    delete content;
+}
+
+const QMimeData* ClipShareVirtualClipboard::mimeData() const
+{
+    return content;
+}
+
+void ClipShareVirtualClipboard::setMimeData(QMimeData* mimeData)
+{
+    delete content;
+    content = mimeData;
+    ownContent = true;
+    emit dataChanged();
+}
+
+bool ClipShareVirtualClipboard::ownsClipboard() const
+{
+    return ownContent;
+}
+
+void ClipShareVirtualClipboard::inject(const ClipShareSnapshot& snapshot)
+{
+    delete content;
+    content = snapshot.toMimeData();
+    ownContent = false;
+    ++injected;
+    emit dataChanged();
+}
+
+void ClipShareVirtualClipboard::play(const QVector<ClipShareSnapshot>& snapshots, double rate, qint64 limit, double speed)
+{
+    playlist = snapshots;
+    playRate = rate;
+    playLimit = rate > 0 ? limit : snapshots.size();
+    playSpeed = speed > 0 ? speed : 1;
+    injected = 0;
+    if (playlist.isEmpty())
+    {
+        emit finished();
+        return;
+    }
+
+    playClock.start();
+    // 1ms ticks catch up on everything due, so rates above 1000/s still hold
+    playTimer.start(1);
+}
+
+void ClipShareVirtualClipboard::stop()
+{
+    playTimer.stop();
+}
+
+qint64 ClipShareVirtualClipboard::injectedCount() const
+{
+    return injected;
+}
+
+void ClipShareVirtualClipboard::tick()
+{
+    auto elapsed = playClock.nsecsElapsed() / 1e6;
+
+    qint64 due = 0;
+    if (playRate > 0)
+        due = static_cast<qint64>(std::floor(elapsed * playRate / 1000.0)) + 1;
+    else
+    {
+        due = injected;
+        while (due < playlist.size() && playlist[due].elapsed / playSpeed <= elapsed)
+            ++due;
+    }
+    if (playLimit > 0)
+        due = qMin(due, playLimit);
+
+    while (injected < due)
+        inject(playlist[injected % playlist.size()]);
+
+    if (playLimit > 0 && injected >= playLimit)
+    {
+        playTimer.stop();
+        emit finished();
+    }
+}
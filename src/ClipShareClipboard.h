@@ -0,0 +1,101 @@
+﻿#pragma once
+
+#include <QObject>
+#include <QStringList>
+#include <QByteArrayList>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QVector>
+
+class QMimeData;
+
+/// <summary>
+/// The formats of one clipboard content, as the dataChanged handler reads them
+/// </summary>
+struct ClipShareSnapshot
+{
+    qint64 elapsed{ 0 };        // ms since the first snapshot of a recording
+    QStringList formats;
+    QByteArrayList data;
+
+    static ClipShareSnapshot capture(const QMimeData*);
+    QMimeData* toMimeData() const;
+};
+
+/// <summary>
+/// Where the service reads local clips and puts received ones.
+/// </summary>
+class ClipShareClipboard : public QObject
+{
+    Q_OBJECT
+
+public:
+    using QObject::QObject;
+
+    virtual const QMimeData* mimeData() const = 0;
+    // takes ownership
+    virtual void setMimeData(QMimeData*) = 0;
+    virtual bool ownsClipboard() const = 0;
+
+signals:
+    void dataChanged();
+};
+
+/// <summary>
+/// The desktop clipboard, QGuiApplication::clipboard()
+/// </summary>
+class ClipShareSystemClipboard : public ClipShareClipboard
+{
+    Q_OBJECT
+
+public:
+    ClipShareSystemClipboard(QObject* parent = Q_NULLPTR);
+
+    const QMimeData* mimeData() const override;
+    void setMimeData(QMimeData*) override;
+    bool ownsClipboard() const override;
+};
+
+/// <summary>
+/// In memory clipboard, for benchmarks and machines without a display.
+/// Replays snapshots as change events at a fixed rate, or at their recorded pace.
+/// </summary>
+class ClipShareVirtualClipboard : public ClipShareClipboard
+{
+    Q_OBJECT
+
+public:
+    ClipShareVirtualClipboard(QObject* parent = Q_NULLPTR);
+    ~ClipShareVirtualClipboard();
+
+    const QMimeData* mimeData() const override;
+    void setMimeData(QMimeData*) override;
+    bool ownsClipboard() const override;
+
+    // replace the content as if another application copied it, emits dataChanged
+    void inject(const ClipShareSnapshot&);
+
+    // rate > 0: changes per second, cycling through the snapshots until limit changes (0 = forever)
+    // rate <= 0: each snapshot at its recorded elapsed time divided by speed
+    void play(const QVector<ClipShareSnapshot>& snapshots, double rate, qint64 limit = 0, double speed = 1);
+    void stop();
+
+    qint64 injectedCount() const;
+
+signals:
+    void finished();
+
+private:
+    void tick();
+
+    QMimeData* content;
+    bool ownContent{ false };       // set by setMimeData rather than injected
+
+    QVector<ClipShareSnapshot> playlist;
+    double playRate{ 0 };
+    double playSpeed{ 1 };
+    qint64 playLimit{ 0 };
+    qint64 injected{ 0 };
+    QElapsedTimer playClock;
+    QTimer playTimer{ this };
+};
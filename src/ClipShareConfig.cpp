@@ -0,0 +1,15 @@
+﻿#include <QFile>
+#include "ClipShareLog.h"
+#include "ClipShareConfig.h"
+
+ClipShareConfig ClipShareConfig::load(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+    {
+        ClipShareLog::config().warn("[Config] Cannot open {}, use defaults.", path);
+        return {};
+    }
+    auto data = file.readAll();
+    return nlohmann::json::parse(data.constData(), data.constData() + data.size()).get<ClipShareConfig>();
+}
@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <QStringList>
+#include "Adapter.h"
+
+struct ClipShareConfig
+{
+    int heartbeatPort{ 41688 };
+    int heartbeatInterval{ 20000 };
+    int heartbeatSuvivalTimeout{ 60000 };
+    QString heartbeatMulticastGroupHost{ "239.99.115.102" };
+    double heartbeatRateLimit{ 5 };     // heartbeats per second accepted from one address
+    int heartbeatRateBurst{ 20 };
+    int heartbeatMaxSources{ 4096 };    // addresses tracked for the rate limit, a new one replaces the least recently seen once it is idle
+
+    int packagePort{ 41688 };
+    int packageMaxFrameBytes{ 64 << 20 };           // larger announced frames close the connection
+    int packageMaxBufferedBytes{ 65 << 20 };        // incomplete frame bytes held for one connection
+    int packageMaxTotalBufferedBytes{ 256 << 20 };  // incomplete frame bytes held for all connections
+    int packageMaxConnections{ 256 };
+    int packageIdleTimeout{ 600000 };   // ms without a byte before a connection is closed, 0 disables it
+    int packageStallTimeout{ 60000 };   // ms a started frame may take to complete, 0 disables it
+
+    QStringList acceptFormats;          // formats peers send us, most wanted first, "text/*" patterns, empty for a default list, ["*"] for all
+
+    int fastPathThreshold{ 1200 };      // clips whose datagram fits go over UDP, 0 disables it
+    int fastPathRetries{ 3 };           // unicast retries before falling back to the stream connection
+    int fastPathRetryInterval{ 200 };   // ms, also between the polls of a multicast
+
+    int multicastMinPeers{ 3 };         // larger clips are multicast with NACKs from this many peers on, 0 disables it
+    int multicastRate{ 20480 };         // KiB/s the fragments are paced at
+
+    int overlayFanout{ 4 };             // without multicast, clips go down a tree of this many children per peer, 0 disables it
+    int overlayMinPeers{ 16 };          // connected peers the tree needs, fewer are written to directly
+    int overlayRepairTimeout{ 2000 };   // ms after our part of a tree clip is written until members that did not report it get it directly
+
+    int gossipFanout{ 0 };              // peers each new clip id is pushed to, replaces the other paths, 0 disables it
+    int gossipInterval{ 1000 };         // ms between pushes of the latest clip id to one random peer
+
+    int deltaMinSize{ 4096 };           // text formats this large go to a peer as a delta against the last clip it acknowledged, 0 disables it
+
+    int localRingSize{ 8 << 20 };       // bytes of shared memory per same-host peer, 0 sends to it over TCP loopback
+    QString localHostId;                // instances with the same id share memory, defaults to the machine id
+
+    int filePort{ 0 };                  // serves copied files to anyone on the network who has the clip's token, 0 sends only their URLs
+    QString fileDirectory;              // where fetched files are kept, defaults to clipshare-files in the temp directory
+    int fileStreams{ 4 };               // parallel connections a receiver fetches one clip's files over
+    bool fileDedup{ true };             // fetch only the chunks of large files that are not on disk already
+    qint64 fileMaxBytes{ 16LL << 30 };  // larger offers are not fetched, 0 for no limit
+    int fileKeepTime{ 3600000 };        // ms fetched files stay for pasting and as a chunk source, the latest clip's always stay
+
+    QString hubAddress;     // "address:port" of a clipshare_hub to relay through as well, empty disables it
+
+    int metricsPort{ 0 };   // loopback /metrics endpoint, 0 disables it
+
+    QString recordFile;     // record local clipboard changes for clipshare_replay, empty disables it
+
+    QString logLevels{ "info" };    // "info" or per module "info,heartbeat=warn,mime=trace"
+    int logPayloadLimit{ 64 };      // bytes of a payload written to hex dumps
+    bool logAsync{ true };          // write logs from the spdlog thread pool instead of the event loop
+
+    // defaults for the missing keys, throws nlohmann::json::exception on malformed files
+    static ClipShareConfig load(const QString& path);
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipShareConfig, heartbeatPort, heartbeatInterval, heartbeatSuvivalTimeout, heartbeatMulticastGroupHost, heartbeatRateLimit, heartbeatRateBurst, heartbeatMaxSources, packagePort, packageMaxFrameBytes, packageMaxBufferedBytes, packageMaxTotalBufferedBytes, packageMaxConnections, packageIdleTimeout, packageStallTimeout, acceptFormats, fastPathThreshold, fastPathRetries, fastPathRetryInterval, multicastMinPeers, multicastRate, overlayFanout, overlayMinPeers, overlayRepairTimeout, gossipFanout, gossipInterval, deltaMinSize, localRingSize, localHostId, filePort, fileDirectory, fileStreams, fileDedup, fileMaxBytes, fileKeepTime, hubAddress, metricsPort, recordFile, logLevels, logPayloadLimit, logAsync);
+};
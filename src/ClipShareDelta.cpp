@@ -0,0 +1,183 @@
+﻿#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "ClipShareDelta.h"
+
+namespace
+{
+    // an op is varint(length << 1 | copy), a copy then has varint(offset), a literal its bytes
+    void appendVarint(QByteArray& out, std::uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.append(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.append(static_cast<char>(value));
+    }
+
+    bool readVarint(const QByteArray& in, int& position, std::uint64_t& value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64 && position < in.size(); shift += 7)
+        {
+            auto byte = static_cast<std::uint8_t>(in[position++]);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // rsync's weak checksum, a is the sum of the window, b the sum of its prefix sums
+    struct RollingChecksum
+    {
+        std::uint32_t a{ 0 };
+        std::uint32_t b{ 0 };
+        std::uint32_t size{ 0 };
+
+        RollingChecksum(const std::uint8_t* data, std::uint32_t size)
+            : size{ size }
+        {
+            for (std::uint32_t i = 0; i < size; ++i)
+            {
+                a += data[i];
+                b += (size - i) * data[i];
+            }
+        }
+
+        void roll(std::uint8_t out, std::uint8_t in)
+        {
+            a += in - out;
+            b += a - size * out;
+        }
+
+        std::uint32_t value() const
+        {
+            return (a & 0xffff) | (b << 16);
+        }
+    };
+}
+
+QByteArray ClipShareDelta::encode(const QByteArray& base, const QByteArray& target)
+{
+    auto baseData = reinterpret_cast<const std::uint8_t*>(base.constData());
+    auto targetData = reinterpret_cast<const std::uint8_t*>(target.constData());
+    auto blockSize = std::max(MinBlockSize, base.size() / MaxBlocks);
+    auto blocks = base.size() / blockSize;
+    if (blocks == 0 || target.size() < blockSize)
+        return {};
+
+    // chained hash table of the base blocks, a power of two of buckets about twice their number
+    std::uint32_t buckets = 1;
+    while (buckets < static_cast<std::uint32_t>(blocks) * 2)
+        buckets <<= 1;
+    std::vector<int> heads(buckets, -1);
+    std::vector<int> next(static_cast<std::size_t>(blocks), -1);
+    for (int block = blocks - 1; block >= 0; --block)
+    {
+        auto bucket = RollingChecksum{ baseData + block * blockSize, static_cast<std::uint32_t>(blockSize) }.value() & (buckets - 1);
+        next[block] = heads[bucket];
+        heads[bucket] = block;
+    }
+
+    QByteArray delta;
+    appendVarint(delta, static_cast<std::uint64_t>(target.size()));
+    auto limit = target.size() / 2;
+    auto emitLiteral = [&](int from, int to)
+        {
+            if (to <= from)
+                return;
+            appendVarint(delta, static_cast<std::uint64_t>(to - from) << 1);
+            delta.append(target.constData() + from, to - from);
+        };
+
+    int literal = 0;
+    int position = 0;
+    RollingChecksum checksum{ targetData, static_cast<std::uint32_t>(blockSize) };
+    while (delta.size() < limit)
+    {
+        // bounded, a text of repeated lines puts many blocks in one chain
+        int match = -1;
+        int tries = 8;
+        for (auto block = heads[checksum.value() & (buckets - 1)]; block >= 0 && tries-- > 0; block = next[block])
+        {
+            if (std::memcmp(baseData + block * blockSize, targetData + position, static_cast<std::size_t>(blockSize)) == 0)
+            {
+                match = block * blockSize;
+                break;
+            }
+        }
+
+        if (match < 0)
+        {
+            if (position + blockSize >= target.size())
+                break;
+            checksum.roll(targetData[position], targetData[position + blockSize]);
+            ++position;
+            continue;
+        }
+
+        // grown over the block boundaries, the literal before it shrinks to the edit itself
+        int start = position;
+        while (start > literal && match > 0 && baseData[match - 1] == targetData[start - 1])
+        {
+            --start;
+            --match;
+        }
+        int end = position + blockSize;
+        int baseEnd = match + (end - start);
+        while (end < target.size() && baseEnd < base.size() && baseData[baseEnd] == targetData[end])
+        {
+            ++end;
+            ++baseEnd;
+        }
+
+        emitLiteral(literal, start);
+        appendVarint(delta, static_cast<std::uint64_t>(end - start) << 1 | 1);
+        appendVarint(delta, static_cast<std::uint64_t>(match));
+        literal = position = end;
+        if (position + blockSize > target.size())
+            break;
+        checksum = RollingChecksum{ targetData + position, static_cast<std::uint32_t>(blockSize) };
+    }
+    emitLiteral(literal, target.size());
+    return delta.size() < limit ? delta : QByteArray{};
+}
+
+bool ClipShareDelta::apply(const QByteArray& base, const QByteArray& delta, QByteArray& target, int maxSize)
+{
+    int position = 0;
+    std::uint64_t size = 0;
+    if (!readVarint(delta, position, size) || size > static_cast<std::uint64_t>(maxSize))
+        return false;
+
+    target.clear();
+    target.reserve(static_cast<int>(size));
+    while (position < delta.size())
+    {
+        std::uint64_t op = 0;
+        if (!readVarint(delta, position, op))
+            return false;
+        auto length = op >> 1;
+        if (length > size - static_cast<std::uint64_t>(target.size()))
+            return false;
+
+        if ((op & 1) != 0)
+        {
+            std::uint64_t offset = 0;
+            if (!readVarint(delta, position, offset) || offset > static_cast<std::uint64_t>(base.size()) || length > static_cast<std::uint64_t>(base.size()) - offset)
+                return false;
+            target.append(base.constData() + offset, static_cast<int>(length));
+        }
+        else
+        {
+            if (length > static_cast<std::uint64_t>(delta.size() - position))
+                return false;
+            target.append(delta.constData() + position, static_cast<int>(length));
+            position += static_cast<int>(length);
+        }
+    }
+    return static_cast<std::uint64_t>(target.size()) == size;
+}
@@ -0,0 +1,22 @@
+﻿#pragma once
+
+#include <QByteArray>
+
+/// <summary>
+/// rsync style delta of a text against an older version the receiver holds.
+/// The base is cut into blocks indexed by a rolling checksum; the target is scanned byte by byte,
+/// and wherever the checksum of the window matches a block whose bytes are equal, the match is
+/// extended in both directions and sent as a copy from the base. Everything else is sent literally,
+/// so the delta grows with the edit, not with the text.
+/// </summary>
+class ClipShareDelta
+{
+public:
+    static constexpr int MinBlockSize{ 64 };
+    static constexpr int MaxBlocks{ 1 << 16 };  // larger bases get larger blocks
+
+    // empty if the delta would not be less than half the target
+    static QByteArray encode(const QByteArray& base, const QByteArray& target);
+    // false on a malformed delta or one that builds more than maxSize bytes
+    static bool apply(const QByteArray& base, const QByteArray& delta, QByteArray& target, int maxSize);
+};
@@ -0,0 +1,944 @@
+﻿#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QRandomGenerator>
+#include <QRegularExpression>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+#include <ghc/filesystem.hpp>
+#include "ClipShareFileTransfer.h"
+#include "ClipShareLog.h"
+#include "ClipShareMetrics.h"
+
+#ifdef Q_OS_UNIX
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#endif
+
+namespace fs = ghc::filesystem;
+
+namespace
+{
+    constexpr std::uint64_t MaxManifestBytes{ 256 << 20 };
+
+#ifdef Q_OS_UNIX
+#ifdef MSG_NOSIGNAL
+    constexpr int SendFlags{ MSG_NOSIGNAL };
+#else
+    constexpr int SendFlags{ 0 };
+#endif
+    constexpr std::size_t CopyBufferSize{ 256 * 1024 };
+    constexpr std::size_t SpliceSize{ 1 << 20 };
+    constexpr std::size_t ChunkBufferSize{ 4 << 20 };
+
+    ClipShareChunk chunkOf(const std::uint8_t* data, std::size_t length)
+    {
+        ClipShareChunk chunk;
+        auto hash = QCryptographicHash::hash(QByteArray::fromRawData(reinterpret_cast<const char*>(data), static_cast<int>(length)), QCryptographicHash::Sha1);
+        std::memcpy(chunk.hash.data(), hash.constData(), chunk.hash.size());
+        chunk.length = static_cast<std::uint32_t>(length);
+        return chunk;
+    }
+
+    bool preadFully(int file, void* data, std::size_t size, std::uint64_t offset)
+    {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0)
+        {
+            auto n = ::pread(file, bytes, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= static_cast<std::size_t>(n);
+            offset += static_cast<std::uint64_t>(n);
+        }
+        return true;
+    }
+
+    bool pwriteFully(int file, const void* data, std::size_t size, std::uint64_t offset)
+    {
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            auto n = ::pwrite(file, bytes, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= static_cast<std::size_t>(n);
+            offset += static_cast<std::uint64_t>(n);
+        }
+        return true;
+    }
+
+    // the whole file in content defined chunks
+    bool chunkFile(int file, std::vector<ClipShareChunk>& recipe)
+    {
+        std::vector<std::uint8_t> buffer(ChunkBufferSize);
+        std::size_t filled = 0;
+        std::uint64_t position = 0;
+        bool end = false;
+        while (true)
+        {
+            while (!end && filled < buffer.size())
+            {
+                auto n = ::pread(file, buffer.data() + filled, buffer.size() - filled, static_cast<off_t>(position));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    return false;
+                end = n == 0;
+                filled += static_cast<std::size_t>(n);
+                position += static_cast<std::uint64_t>(n);
+            }
+
+            // a chunk that may go on past the buffer is cut after the next read
+            std::size_t start = 0;
+            while (start < filled && (end || filled - start >= ClipShareChunker::MaxSize))
+            {
+                auto length = ClipShareChunker::boundary(buffer.data() + start, filled - start);
+                recipe.push_back(chunkOf(buffer.data() + start, length));
+                start += length;
+            }
+            if (end)
+                return true;
+            std::memmove(buffer.data(), buffer.data() + start, filled - start);
+            filled -= start;
+        }
+    }
+
+    // blocking, a stalled peer times out in either direction
+    void prepareSocket(int fd)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        timeval timeout{ ClipShareFileTransfer::Timeout / 1000, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    int connectTo(const QHostAddress& address, quint16 port)
+    {
+        sockaddr_storage storage{};
+        socklen_t storageSize = 0;
+        if (address.protocol() == QAbstractSocket::IPv4Protocol)
+        {
+            auto in = reinterpret_cast<sockaddr_in*>(&storage);
+            in->sin_family = AF_INET;
+            in->sin_port = htons(port);
+            in->sin_addr.s_addr = htonl(address.toIPv4Address());
+            storageSize = sizeof(sockaddr_in);
+        }
+        else
+        {
+            auto in6 = reinterpret_cast<sockaddr_in6*>(&storage);
+            auto bytes = address.toIPv6Address();
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(port);
+            std::memcpy(in6->sin6_addr.s6_addr, bytes.c, sizeof(bytes.c));
+            storageSize = sizeof(sockaddr_in6);
+        }
+
+        int fd = ::socket(storage.ss_family, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        prepareSocket(fd);
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&storage), storageSize) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    bool readFully(int fd, void* data, std::size_t size)
+    {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0)
+        {
+            auto n = ::read(fd, bytes, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    bool sendFully(int fd, const void* data, std::size_t size)
+    {
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            auto n = ::send(fd, bytes, size, SendFlags);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            bytes += n;
+            size -= static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    // file to socket from offset, in the kernel where sendfile exists
+    bool sendFile(int socket, int file, std::uint64_t offset, std::uint64_t length)
+    {
+#ifdef Q_OS_LINUX
+        auto position = static_cast<off_t>(offset);
+        auto end = offset + length;
+        while (static_cast<std::uint64_t>(position) < end)
+        {
+            auto n = ::sendfile(socket, file, &position, static_cast<std::size_t>(std::min<std::uint64_t>(end - position, 1 << 30)));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+        }
+        return true;
+#else
+        std::vector<char> buffer(CopyBufferSize);
+        std::uint64_t sent = 0;
+        while (sent < length)
+        {
+            auto n = ::pread(file, buffer.data(), static_cast<std::size_t>(std::min<std::uint64_t>(length - sent, buffer.size())), static_cast<off_t>(offset + sent));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0 || !sendFully(socket, buffer.data(), static_cast<std::size_t>(n)))
+                return false;
+            sent += static_cast<std::uint64_t>(n);
+        }
+        return true;
+#endif
+    }
+
+    // socket to file at offset, spliced through a pipe where splice exists; stops once the fetch is superseded
+    bool receiveFile(int socket, int file, std::uint64_t offset, std::uint64_t length, const std::atomic<quint64>& generation, quint64 current)
+    {
+        std::uint64_t received = 0;
+#ifdef Q_OS_LINUX
+        int pipe[2];
+        if (::pipe2(pipe, O_CLOEXEC) != 0)
+            return false;
+        // fewer round trips than the default 64 KiB, fails harmlessly above pipe-max-size
+        fcntl(pipe[1], F_SETPIPE_SZ, static_cast<int>(SpliceSize));
+        auto position = static_cast<loff_t>(offset);
+        bool ok = true;
+        while (ok && received < length && generation == current)
+        {
+            auto n = ::splice(socket, nullptr, pipe[1], nullptr, static_cast<std::size_t>(std::min<std::uint64_t>(length - received, SpliceSize)), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                ok = false;
+                break;
+            }
+            received += static_cast<std::uint64_t>(n);
+            while (n > 0)
+            {
+                auto written = ::splice(pipe[0], nullptr, file, &position, static_cast<std::size_t>(n), SPLICE_F_MOVE);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                {
+                    ok = false;
+                    break;
+                }
+                n -= written;
+            }
+        }
+        ::close(pipe[0]);
+        ::close(pipe[1]);
+        return ok && received == length;
+#else
+        std::vector<char> buffer(CopyBufferSize);
+        while (received < length && generation == current)
+        {
+            auto n = ::read(socket, buffer.data(), static_cast<std::size_t>(std::min<std::uint64_t>(length - received, buffer.size())));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            for (ssize_t written = 0; written < n;)
+            {
+                auto w = ::pwrite(file, buffer.data() + written, static_cast<std::size_t>(n - written), static_cast<off_t>(offset + received + written));
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    return false;
+                written += w;
+            }
+            received += static_cast<std::uint64_t>(n);
+        }
+        return received == length;
+#endif
+    }
+#endif
+}
+
+void ClipShareFileTransfer::Server::incomingConnection(qintptr socketDescriptor)
+{
+    // never wrapped in a QTcpSocket, the raw descriptor goes to the worker
+    auto fd = static_cast<int>(socketDescriptor);
+    auto owner = transfer;
+    transfer->servers.start([owner, fd] { owner->serve(fd); });
+}
+
+ClipShareFileTransfer::ClipShareFileTransfer(const ClipShareConfig& config, QObject* parent)
+    : QObject(parent)
+    , config{ config }
+{
+    // the streams of a few receivers at once
+    servers.setMaxThreadCount(MaxConnections);
+    // one fetch at a time, and a superseded one winding down
+    fetches.setMaxThreadCount(2);
+
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.describe("clipshare_file_transfers_total", "Copied files served to or fetched from peers, by direction and result.");
+    metrics.describe("clipshare_file_bytes_total", "Bytes of copied files served to or fetched from peers, by direction.");
+    metrics.describe("clipshare_file_fetch_microseconds", "Time from asking for a clip's manifest until all its files were in place.");
+    metrics.describe("clipshare_file_dedup_bytes_total", "Bytes of fetched files fetched by recipe, by source: copied from chunks on disk or fetched.");
+}
+
+ClipShareFileTransfer::~ClipShareFileTransfer()
+{
+    ++fetchGeneration;
+    server.close();
+    servers.waitForDone();
+    fetches.waitForDone();
+}
+
+bool ClipShareFileTransfer::listen()
+{
+#ifdef Q_OS_UNIX
+    if (config.filePort <= 0)
+        return false;
+    if (!server.listen(QHostAddress::AnyIPv4, static_cast<quint16>(config.filePort)))
+    {
+        ClipShareLog::transport().warn("[File] Cannot listen on {}: {}, copied files are sent as URLs only", config.filePort, server.errorString());
+        return false;
+    }
+    ClipShareLog::transport().info("[File] Listen on {}.", server.serverPort());
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool ClipShareFileTransfer::listening() const
+{
+    return server.isListening();
+}
+
+quint16 ClipShareFileTransfer::port() const
+{
+    return server.serverPort();
+}
+
+quint64 ClipShareFileTransfer::offer(const QStringList& paths)
+{
+    // enumerated once a receiver asks, a copy nobody fetches costs nothing
+    std::lock_guard<std::mutex> lock{ offerMutex };
+    offerPaths = paths;
+    offerToken = paths.isEmpty() ? 0 : QRandomGenerator::global()->generate64() | 1;
+    manifestBuilt = false;
+    manifest.clear();
+    manifestSources.clear();
+    manifestRecipes.clear();
+    return offerToken;
+}
+
+void ClipShareFileTransfer::cancel()
+{
+    ++fetchGeneration;
+}
+
+void ClipShareFileTransfer::buildManifest(const QStringList& paths, std::vector<ClipShareFileEntry>& manifest, std::vector<std::string>& sources)
+{
+    auto add = [&](std::string path, std::uint64_t size, bool directory, std::string source)
+        {
+            manifest.push_back(ClipShareFileEntry{ std::move(path), size, directory });
+            sources.push_back(std::move(source));
+        };
+
+    for (auto& offered : paths)
+    {
+        std::error_code error;
+        auto root = fs::u8path(offered.toStdString());
+        auto name = root.filename().u8string();
+        // a copied link is what the user picked, it is served as its target; links below it are not
+        if (fs::is_symlink(fs::symlink_status(root, error)))
+            root = fs::canonical(root, error);
+        if (error)
+            continue;
+        if (fs::is_regular_file(root, error))
+        {
+            add(name, fs::file_size(root, error), false, root.u8string());
+            continue;
+        }
+        if (!fs::is_directory(root, error))
+            continue;
+
+        // symlinks in the tree are left out, they may lead anywhere
+        add(name, 0, true, root.u8string());
+        for (fs::recursive_directory_iterator it{ root, fs::directory_options::skip_permission_denied, error }, end
+            ; !error && it != end && manifest.size() < static_cast<std::size_t>(MaxEntries); it.increment(error))
+        {
+            auto path = name + "/" + it->path().lexically_relative(root).generic_u8string();
+            std::error_code entryError;
+            auto status = it->symlink_status(entryError);
+            if (fs::is_directory(status))
+                add(path, 0, true, it->path().u8string());
+            else if (fs::is_regular_file(status))
+                add(path, it->file_size(entryError), false, it->path().u8string());
+        }
+        if (error)
+            ClipShareLog::transport().warn("[File] Listing {} stopped: {}", offered, error.message());
+    }
+}
+
+QString ClipShareFileTransfer::fetchBase() const
+{
+    return config.fileDirectory.isEmpty() ? QDir::temp().filePath(QStringLiteral("clipshare-files")) : config.fileDirectory;
+}
+
+QString ClipShareFileTransfer::fetchDirectory(const ClipSharePackage& package) const
+{
+    return QDir{ fetchBase() }.filePath(QStringLiteral("%1-%2").arg(package.origin, 16, 16, QLatin1Char('0')).arg(package.sequence));
+}
+
+void ClipShareFileTransfer::pruneFetched(const QString& keep)
+{
+    // pasted files may still be open, or be pasted again, so they age out instead of going with the next clip
+    auto oldest = QDateTime::currentDateTime().addMSecs(-static_cast<qint64>(qMax(0, config.fileKeepTime)));
+    static const QRegularExpression name{ QStringLiteral("^[0-9a-f]{16}-[0-9]+$") };
+    for (auto& info : QDir{ fetchBase() }.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks))
+    {
+        if (!name.match(info.fileName()).hasMatch() || info.filePath() == keep || info.lastModified() >= oldest)
+            continue;
+        chunkStore.remove(info.filePath());
+        QDir{ info.filePath() }.removeRecursively();
+    }
+}
+
+void ClipShareFileTransfer::fetch(const QHostAddress& address, const ClipSharePackage& package)
+{
+    auto generation = ++fetchGeneration;
+    auto directory = fetchDirectory(package);
+
+    fetches.start([this, address, package, directory, generation]
+        {
+            auto result = package;
+            auto startedAt = ClipShareTrace::now();
+            auto ok = fetchFiles(address, result, directory, generation);
+            pruneFetched(directory);
+            if (!ok)
+            {
+                result.filePaths.clear();
+                if (fetchGeneration != generation)
+                    return;
+                ClipShareLog::transport().warn("[File] Fetching the files of {:016x} failed, applying the clip without them", package.origin);
+            }
+            else
+            {
+                ClipShareMetrics::instance().observe("clipshare_file_fetch_microseconds", {}, (ClipShareTrace::now() - startedAt) / 1000);
+            }
+
+            QMetaObject::invokeMethod(this, [this, result, generation]
+                {
+                    if (fetchGeneration == generation)
+                        emit fetched(result);
+                }, Qt::QueuedConnection);
+        });
+}
+
+bool ClipShareFileTransfer::safePath(const std::string& path)
+{
+    if (path.empty() || path.front() == '/' || path.find('\\') != std::string::npos || path.find('\0') != std::string::npos)
+        return false;
+    std::size_t start = 0;
+    while (start <= path.size())
+    {
+        auto end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        auto part = path.substr(start, end - start);
+        if (part.empty() || part == "." || part == "..")
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+bool ClipShareFileTransfer::validRequest(const ClipShareFileRequest& request)
+{
+    if (request.magic != ClipShareFileRequest::Magic)
+        return false;
+    // every requested index gets a header, a huge count would have us write them for nothing
+    if (request.kind == ClipShareFileRequest::Files)
+        return request.count > 0 && request.count <= static_cast<std::uint32_t>(BatchFiles);
+    return request.kind == ClipShareFileRequest::Manifest || request.kind == ClipShareFileRequest::Chunks;
+}
+
+void ClipShareFileTransfer::serve(int fd)
+{
+#ifdef Q_OS_UNIX
+    prepareSocket(fd);
+    // until the receiver closes, one request after the other
+    ClipShareFileRequest request;
+    while (readFully(fd, &request, sizeof(request)) && validRequest(request))
+    {
+        if (request.kind == ClipShareFileRequest::Files)
+        {
+            if (!serveFiles(fd, request))
+                break;
+            continue;
+        }
+        if (request.kind == ClipShareFileRequest::Chunks)
+        {
+            if (!serveChunks(fd, request))
+                break;
+            continue;
+        }
+
+        std::string json;
+        QStringList paths;
+        {
+            std::lock_guard<std::mutex> lock{ offerMutex };
+            if (request.token != 0 && request.token == offerToken)
+            {
+                if (manifestBuilt)
+                    json = nlohmann::json(manifest).dump();
+                else
+                    paths = offerPaths;
+            }
+        }
+        if (!paths.isEmpty())
+        {
+            // listed outside the lock, kept only if no newer offer came in meanwhile
+            std::vector<ClipShareFileEntry> entries;
+            std::vector<std::string> sources;
+            buildManifest(paths, entries, sources);
+            std::lock_guard<std::mutex> lock{ offerMutex };
+            if (request.token == offerToken)
+            {
+                if (!manifestBuilt)
+                {
+                    manifest.swap(entries);
+                    manifestSources.swap(sources);
+                    manifestBuilt = true;
+                }
+                json = nlohmann::json(manifest).dump();
+            }
+        }
+        ClipShareFileHeader header;
+        header.status = json.empty() ? ClipShareFileHeader::NotFound : ClipShareFileHeader::Ok;
+        header.length = json.size();
+        if (!sendFully(fd, &header, sizeof(header)) || !sendFully(fd, json.data(), json.size()))
+            break;
+    }
+    ::close(fd);
+#else
+    Q_UNUSED(fd);
+#endif
+}
+
+bool ClipShareFileTransfer::serveFiles(int fd, const ClipShareFileRequest& request)
+{
+#ifdef Q_OS_UNIX
+    auto& metrics = ClipShareMetrics::instance();
+    for (std::uint64_t index = request.index; index < static_cast<std::uint64_t>(request.index) + request.count; ++index)
+    {
+        std::string source;
+        {
+            std::lock_guard<std::mutex> lock{ offerMutex };
+            if (request.token != 0 && request.token == offerToken && index < manifest.size() && !manifest[index].directory)
+                source = manifestSources[index];
+        }
+
+        ClipShareFileHeader header;
+        struct stat info;
+        // a file swapped for a link since the listing is not followed either
+        int file = source.empty() ? -1 : ::open(source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (file < 0 || ::fstat(file, &info) != 0 || !S_ISREG(info.st_mode) || request.offset > static_cast<std::uint64_t>(info.st_size))
+        {
+            header.status = ClipShareFileHeader::NotFound;
+        }
+        else
+        {
+            auto rest = static_cast<std::uint64_t>(info.st_size) - request.offset;
+            header.length = request.length == 0 ? rest : std::min(request.length, rest);
+        }
+
+        auto ok = sendFully(fd, &header, sizeof(header))
+            && (header.status != ClipShareFileHeader::Ok || sendFile(fd, file, request.offset, header.length));
+        if (file >= 0)
+            ::close(file);
+        metrics.increment("clipshare_file_transfers_total", { { "direction", "sent" }, { "result", ok && header.status == ClipShareFileHeader::Ok ? "ok" : "failed" } });
+        if (!ok)
+            return false;
+        metrics.increment("clipshare_file_bytes_total", { { "direction", "sent" } }, static_cast<double>(header.length));
+    }
+    return true;
+#else
+    Q_UNUSED(fd); Q_UNUSED(request);
+    return false;
+#endif
+}
+
+bool ClipShareFileTransfer::serveChunks(int fd, const ClipShareFileRequest& request)
+{
+#ifdef Q_OS_UNIX
+    std::string source;
+    std::vector<ClipShareChunk> recipe;
+    bool cached = false;
+    {
+        std::lock_guard<std::mutex> lock{ offerMutex };
+        if (request.token != 0 && request.token == offerToken && request.index < manifest.size() && !manifest[request.index].directory)
+        {
+            source = manifestSources[request.index];
+            auto it = manifestRecipes.find(request.index);
+            cached = it != manifestRecipes.end();
+            if (cached)
+                recipe = it->second;
+        }
+    }
+
+    // outside the lock, a large file takes a while
+    if (!source.empty() && !cached)
+    {
+        int file = ::open(source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (file < 0 || !chunkFile(file, recipe))
+            recipe.clear();
+        if (file >= 0)
+            ::close(file);
+        if (!recipe.empty())
+        {
+            // a peer sending back an edited copy finds the rest here
+            chunkStore.add(QString::fromStdString(source), recipe);
+            std::lock_guard<std::mutex> lock{ offerMutex };
+            if (request.token == offerToken)
+                manifestRecipes[request.index] = recipe;
+        }
+    }
+
+    ClipShareFileHeader header;
+    header.status = recipe.empty() ? ClipShareFileHeader::NotFound : ClipShareFileHeader::Ok;
+    header.length = recipe.size() * sizeof(ClipShareChunk);
+    return sendFully(fd, &header, sizeof(header)) && sendFully(fd, recipe.data(), static_cast<std::size_t>(header.length));
+#else
+    Q_UNUSED(fd); Q_UNUSED(request);
+    return false;
+#endif
+}
+
+bool ClipShareFileTransfer::fetchFiles(const QHostAddress& address, ClipSharePackage& package, const QString& directory, quint64 generation)
+{
+#ifdef Q_OS_UNIX
+    // the first stream asks for the manifest
+    auto first = connectTo(address, package.filePort);
+    if (first < 0)
+        return false;
+    ClipShareFileRequest request;
+    request.kind = ClipShareFileRequest::Manifest;
+    request.token = package.fileToken;
+    ClipShareFileHeader header;
+    std::string json;
+    bool ok = sendFully(first, &request, sizeof(request)) && readFully(first, &header, sizeof(header))
+        && header.magic == ClipShareFileRequest::Magic && header.status == ClipShareFileHeader::Ok && header.length <= MaxManifestBytes;
+    if (ok)
+    {
+        json.resize(static_cast<std::size_t>(header.length));
+        ok = readFully(first, &json[0], json.size());
+    }
+
+    std::vector<ClipShareFileEntry> entries;
+    try {
+        if (ok)
+            entries = nlohmann::json::parse(json).get<std::vector<ClipShareFileEntry>>();
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        ClipShareLog::transport().warn("[File] Invalid manifest from {}: {}", address.toString(), e.what());
+        ok = false;
+    }
+    // the files are allocated at their full size up front, the sender's sizes must fit the budget
+    std::uint64_t total = 0;
+    auto budget = config.fileMaxBytes > 0 ? static_cast<std::uint64_t>(config.fileMaxBytes) : std::numeric_limits<std::uint64_t>::max();
+    bool fits = true;
+    for (auto& entry : entries)
+    {
+        ok = ok && safePath(entry.path);
+        fits = fits && entry.size <= budget - total;
+        total += fits ? entry.size : 0;
+    }
+    if (ok && !fits)
+        ClipShareLog::transport().warn("[File] The files from {} exceed fileMaxBytes {}, not fetching them", address.toString(), config.fileMaxBytes);
+    ok = ok && fits && !entries.empty() && entries.size() <= static_cast<std::size_t>(MaxEntries);
+    if (!ok)
+    {
+        ::close(first);
+        return false;
+    }
+
+    // hidden until every file is complete, then exposed with one rename
+    QFileInfo final{ directory };
+    auto partial = QDir{ final.path() }.filePath(QStringLiteral(".%1.partial").arg(final.fileName()));
+    QDir{ partial }.removeRecursively();
+    QDir{ directory }.removeRecursively();
+    QDir temporary;
+    ok = temporary.mkpath(partial);
+
+    // the tree first, files at their full size so ranges can land in any order
+    std::vector<Batch> batches;
+    std::vector<std::vector<ClipShareChunk>> recipes(entries.size());
+    qint64 batchBytes = 0;      // of the last batch
+    QStringList topLevel;
+    for (std::size_t i = 0; ok && i < entries.size(); ++i)
+    {
+        auto& entry = entries[i];
+        auto path = QDir{ partial }.filePath(QString::fromStdString(entry.path));
+        if (entry.path.find('/') == std::string::npos)
+            topLevel.push_back(QDir{ directory }.filePath(QString::fromStdString(entry.path)));
+        if (entry.directory)
+        {
+            ok = temporary.mkpath(path);
+            continue;
+        }
+
+        auto index = static_cast<quint32>(i);
+        int file = ::open(QFile::encodeName(path).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = file >= 0 && ::ftruncate(file, static_cast<off_t>(entry.size)) == 0;
+        // a file that cannot be chunked on the sender is fetched whole
+        auto byRecipe = ok && config.fileDedup && static_cast<qint64>(entry.size) >= DedupMinSize
+            && fetchRecipe(first, package.fileToken, index, entry.size, recipes[i]);
+        if (byRecipe)
+            reuseChunks(chunkStore, file, index, recipes[i], batches);
+        if (file >= 0)
+            ::close(file);
+        if (byRecipe)
+            continue;
+
+        if (static_cast<qint64>(entry.size) > RangeSize)
+        {
+            for (std::uint64_t offset = 0; offset < entry.size; offset += RangeSize)
+                batches.push_back(Batch{ index, 1, offset, std::min<std::uint64_t>(RangeSize, entry.size - offset) });
+            continue;
+        }
+        // small files ride along with the previous ones, ranges always have a length
+        auto joins = !batches.empty() && batches.back().length == 0 && batches.back().index + batches.back().count == index
+            && batches.back().count < static_cast<quint32>(BatchFiles) && batchBytes + static_cast<qint64>(entry.size) <= BatchBytes;
+        if (joins)
+        {
+            ++batches.back().count;
+            batchBytes += static_cast<qint64>(entry.size);
+        }
+        else
+        {
+            batches.push_back(Batch{ index, 1, 0, 0 });
+            batchBytes = static_cast<qint64>(entry.size);
+        }
+    }
+    if (!ok)
+    {
+        ::close(first);
+        QDir{ partial }.removeRecursively();
+        return false;
+    }
+
+    // the streams take the next batch until none is left or one of them fails
+    std::atomic<std::size_t> next{ 0 };
+    std::atomic<bool> failed{ false };
+    auto stream = [&](int fd)
+        {
+            while (!failed && fetchGeneration == generation)
+            {
+                auto batch = next++;
+                if (batch >= batches.size())
+                    break;
+                if (!fetchBatch(fd, package.fileToken, batches[batch], entries, partial, generation))
+                    failed = true;
+            }
+            ::close(fd);
+        };
+
+    auto streams = std::max(1, std::min(config.fileStreams, static_cast<int>(batches.size())));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < streams; ++i)
+    {
+        auto fd = connectTo(address, package.filePort);
+        if (fd < 0)
+            break;
+        threads.emplace_back(stream, fd);
+    }
+    stream(first);
+    for (auto& thread : threads)
+        thread.join();
+
+    if (failed || fetchGeneration != generation || !QDir{}.rename(partial, directory))
+    {
+        QDir{ partial }.removeRecursively();
+        return false;
+    }
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        if (!recipes[i].empty())
+            chunkStore.add(QDir{ directory }.filePath(QString::fromStdString(entries[i].path)), recipes[i]);
+    }
+    package.filePaths = topLevel;
+    ClipShareLog::transport().info("[File] Fetched {} entries in {} batches over {} streams from {}", entries.size(), batches.size(), threads.size() + 1, address.toString());
+    return true;
+#else
+    Q_UNUSED(address); Q_UNUSED(package); Q_UNUSED(directory); Q_UNUSED(generation);
+    return false;
+#endif
+}
+
+bool ClipShareFileTransfer::fetchBatch(int fd, quint64 token, const Batch& batch, const std::vector<ClipShareFileEntry>& entries, const QString& directory, quint64 generation)
+{
+#ifdef Q_OS_UNIX
+    ClipShareFileRequest request;
+    request.kind = ClipShareFileRequest::Files;
+    request.token = token;
+    request.index = batch.index;
+    request.count = batch.count;
+    request.offset = batch.offset;
+    request.length = batch.length;
+    if (!sendFully(fd, &request, sizeof(request)))
+        return false;
+
+    auto& metrics = ClipShareMetrics::instance();
+    for (auto index = batch.index; index < batch.index + batch.count; ++index)
+    {
+        auto& entry = entries[index];
+        auto expected = batch.length != 0 ? batch.length : entry.size;
+        ClipShareFileHeader header;
+        if (!readFully(fd, &header, sizeof(header)) || header.magic != ClipShareFileRequest::Magic
+            || header.status != ClipShareFileHeader::Ok || header.length != expected)
+        {
+            metrics.increment("clipshare_file_transfers_total", { { "direction", "received" }, { "result", "failed" } });
+            ClipShareLog::transport().debug("[File] {} changed or vanished on the sender", entry.path);
+            return false;
+        }
+
+        auto path = QDir{ directory }.filePath(QString::fromStdString(entry.path));
+        int file = ::open(QFile::encodeName(path).constData(), O_WRONLY | O_CLOEXEC);
+        auto ok = file >= 0 && receiveFile(fd, file, batch.offset, header.length, fetchGeneration, generation);
+        if (file >= 0)
+            ::close(file);
+        metrics.increment("clipshare_file_transfers_total", { { "direction", "received" }, { "result", ok ? "ok" : "failed" } });
+        if (!ok)
+            return false;
+        metrics.increment("clipshare_file_bytes_total", { { "direction", "received" } }, static_cast<double>(header.length));
+    }
+    return true;
+#else
+    Q_UNUSED(fd); Q_UNUSED(token); Q_UNUSED(batch); Q_UNUSED(entries); Q_UNUSED(directory); Q_UNUSED(generation);
+    return false;
+#endif
+}
+
+bool ClipShareFileTransfer::fetchRecipe(int fd, quint64 token, quint32 index, std::uint64_t size, std::vector<ClipShareChunk>& recipe)
+{
+#ifdef Q_OS_UNIX
+    ClipShareFileRequest request;
+    request.kind = ClipShareFileRequest::Chunks;
+    request.token = token;
+    request.index = index;
+    request.count = 1;
+    ClipShareFileHeader header;
+    if (!sendFully(fd, &request, sizeof(request)) || !readFully(fd, &header, sizeof(header)) || header.magic != ClipShareFileRequest::Magic)
+        return false;
+    // every chunk but the last holds at least MinSize bytes
+    auto limit = (size / ClipShareChunker::MinSize + 1) * sizeof(ClipShareChunk);
+    if (header.status != ClipShareFileHeader::Ok || header.length % sizeof(ClipShareChunk) != 0 || header.length > limit)
+        return false;
+
+    recipe.resize(static_cast<std::size_t>(header.length / sizeof(ClipShareChunk)));
+    if (!readFully(fd, recipe.data(), static_cast<std::size_t>(header.length)))
+        return false;
+    std::uint64_t total = 0;
+    for (auto& chunk : recipe)
+        total += chunk.length;
+    if (total != size)
+        recipe.clear();
+    return !recipe.empty();
+#else
+    Q_UNUSED(fd); Q_UNUSED(token); Q_UNUSED(index); Q_UNUSED(size); Q_UNUSED(recipe);
+    return false;
+#endif
+}
+
+void ClipShareFileTransfer::reuseChunks(ClipShareChunkStore& store, int file, quint32 index, const std::vector<ClipShareChunk>& recipe, std::vector<Batch>& batches)
+{
+#ifdef Q_OS_UNIX
+    std::vector<std::uint8_t> buffer;
+    std::uint64_t offset = 0;
+    std::uint64_t copied = 0;
+    std::uint64_t missingFrom = 0;
+    std::uint64_t missingLength = 0;
+    auto fetchMissing = [&]
+        {
+            for (std::uint64_t done = 0; done < missingLength; done += RangeSize)
+                batches.push_back(Batch{ index, 1, missingFrom + done, std::min<std::uint64_t>(RangeSize, missingLength - done) });
+            missingLength = 0;
+        };
+
+    for (auto& chunk : recipe)
+    {
+        // stale locations are read but fail the hash
+        ClipShareChunkStore::Location location;
+        auto found = store.find(chunk, location) && location.length == chunk.length;
+        if (found)
+        {
+            buffer.resize(chunk.length);
+            int source = ::open(QFile::encodeName(location.path).constData(), O_RDONLY | O_CLOEXEC);
+            found = source >= 0 && preadFully(source, buffer.data(), buffer.size(), static_cast<std::uint64_t>(location.offset))
+                && chunkOf(buffer.data(), buffer.size()).hash == chunk.hash;
+            if (source >= 0)
+                ::close(source);
+            if (!found)
+                store.remove(location.path);
+        }
+        if (found && pwriteFully(file, buffer.data(), buffer.size(), offset))
+        {
+            fetchMissing();
+            copied += chunk.length;
+        }
+        else
+        {
+            if (missingLength == 0)
+                missingFrom = offset;
+            missingLength += chunk.length;
+        }
+        offset += chunk.length;
+    }
+    fetchMissing();
+
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.increment("clipshare_file_dedup_bytes_total", { { "source", "disk" } }, static_cast<double>(copied));
+    metrics.increment("clipshare_file_dedup_bytes_total", { { "source", "network" } }, static_cast<double>(offset - copied));
+#else
+    Q_UNUSED(store); Q_UNUSED(file); Q_UNUSED(index); Q_UNUSED(recipe); Q_UNUSED(batches);
+#endif
+}
@@ -0,0 +1,175 @@
+﻿#pragma once
+
+#include <QHostAddress>
+#include <QObject>
+#include <QStringList>
+#include <QTcpServer>
+#include <QThreadPool>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ClipShareChunkStore.h"
+#include "ClipShareConfig.h"
+#include "ClipSharePackage.h"
+
+/// <summary>
+/// Request on a file connection, a connection carries any number of them one after another
+/// </summary>
+struct ClipShareFileRequest
+{
+    static constexpr std::uint32_t Magic{ 0x63736682 };
+
+    enum
+    {
+        Manifest = 0,   // the offer's ClipShareFileEntry list as JSON
+        Files = 1,      // the contents of entries index .. index + count - 1
+        Chunks = 2      // the ClipShareChunk recipe of the file at index
+    };
+
+    std::uint32_t magic{ Magic };
+    std::uint32_t kind{ Manifest };
+    std::uint64_t token{ 0 };
+    std::uint32_t index{ 0 };
+    std::uint32_t count{ 0 };
+    std::uint64_t offset{ 0 };      // with count 1, a range of a large file
+    std::uint64_t length{ 0 };      // with count 1, 0 up to the end
+};
+
+/// <summary>
+/// Answer to a ClipShareFileRequest, one per requested file or one for the manifest.
+/// length raw bytes follow when status is Ok.
+/// </summary>
+struct ClipShareFileHeader
+{
+    enum
+    {
+        Ok = 0,
+        NotFound = 1    // an older offer or no such index
+    };
+
+    std::uint32_t magic{ ClipShareFileRequest::Magic };
+    std::uint32_t status{ Ok };
+    std::uint64_t length{ 0 };
+};
+
+/// <summary>
+/// A file or directory of an offer, path relative to it with '/' separators
+/// </summary>
+struct ClipShareFileEntry
+{
+    std::string path;
+    std::uint64_t size{ 0 };
+    bool directory{ false };
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipShareFileEntry, path, size, directory);
+};
+
+/// <summary>
+/// Copied files and directories travel outside the package, on connections of their own to filePort of the origin.
+/// The origin offers the files of its latest clip under a random token and lists the trees below them
+/// in a manifest on the first request. A receiver fetches the manifest, then pulls batches of small files
+/// and ranges of large ones over fileStreams connections in parallel into a hidden directory, renamed
+/// into place once complete, before it puts the clip on its clipboard with URLs to the fetched copies.
+/// Files of at least DedupMinSize are fetched by recipe: the chunks found in the chunk store
+/// are copied from files already on disk, only the others are asked for, in ranges.
+/// Connections are served and fetched with blocking sockets on thread pools, on Linux with
+/// sendfile from the file and splice into the file, so the contents never pass through user space.
+/// </summary>
+class ClipShareFileTransfer : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int Timeout{ 30000 };          // ms a file connection may stall
+    static constexpr int MaxConnections{ 32 };
+    static constexpr int MaxEntries{ 1 << 20 };     // of a manifest
+    static constexpr int BatchFiles{ 256 };         // small files asked for in one request
+    static constexpr qint64 BatchBytes{ 4 << 20 };
+    static constexpr qint64 RangeSize{ 32 << 20 };  // larger files are split over the streams in ranges of this
+    static constexpr qint64 DedupMinSize{ 1 << 20 };
+
+    ClipShareFileTransfer(const ClipShareConfig& config, QObject* parent = Q_NULLPTR);
+    ~ClipShareFileTransfer();
+
+    // serve config.filePort, false where it is disabled or not supported
+    bool listen();
+    bool listening() const;
+    quint16 port() const;
+
+    // serve these files until the next offer, the token they are requested with
+    quint64 offer(const QStringList& paths);
+
+    // entries index .. index + count - 1, or a range of the one at index
+    struct Batch
+    {
+        quint32 index;
+        quint32 count;
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+
+    // copies the chunks of recipe that store has into file, the ranges still missing become batches
+    static void reuseChunks(ClipShareChunkStore& store, int file, quint32 index, const std::vector<ClipShareChunk>& recipe, std::vector<Batch>& batches);
+
+    // a manifest path from the network, relative and without any way out of the fetch directory
+    static bool safePath(const std::string& path);
+    // a request serve() answers, Files asks for 1 .. BatchFiles entries
+    static bool validRequest(const ClipShareFileRequest&);
+
+    // fetch the package's files from its origin at address, fetched() follows; a newer fetch cancels it
+    void fetch(const QHostAddress& address, const ClipSharePackage& package);
+    // the running fetch is not applied, a newer clip took its place
+    void cancel();
+
+signals:
+    // filePaths holds the fetched files, or is empty if they could not all be fetched
+    void fetched(const ClipSharePackage&);
+
+private:
+    class Server : public QTcpServer
+    {
+    public:
+        explicit Server(ClipShareFileTransfer* transfer) : QTcpServer(transfer), transfer{ transfer } {}
+
+    protected:
+        void incomingConnection(qintptr socketDescriptor) override;
+
+    private:
+        ClipShareFileTransfer* transfer;
+    };
+
+    void serve(int fd);
+    bool serveFiles(int fd, const ClipShareFileRequest&);
+    bool serveChunks(int fd, const ClipShareFileRequest&);
+    // without offerMutex, a large tree takes a while and offer() must not wait for it
+    static void buildManifest(const QStringList& paths, std::vector<ClipShareFileEntry>& manifest, std::vector<std::string>& sources);
+
+    // into directory, filePaths of package get the top level entries
+    bool fetchFiles(const QHostAddress& address, ClipSharePackage& package, const QString& directory, quint64 generation);
+    bool fetchBatch(int fd, quint64 token, const Batch&, const std::vector<ClipShareFileEntry>&, const QString& directory, quint64 generation);
+    bool fetchRecipe(int fd, quint64 token, quint32 index, std::uint64_t size, std::vector<ClipShareChunk>& recipe);
+    QString fetchBase() const;
+    QString fetchDirectory(const ClipSharePackage&) const;
+    // fetched trees older than fileKeepTime, except keep
+    void pruneFetched(const QString& keep);
+
+    ClipShareConfig config;
+    Server server{ this };
+    QThreadPool servers;
+    QThreadPool fetches;
+
+    std::mutex offerMutex;
+    quint64 offerToken{ 0 };
+    QStringList offerPaths;
+    bool manifestBuilt{ false };
+    std::vector<ClipShareFileEntry> manifest;
+    std::vector<std::string> manifestSources;       // local path of each entry
+    std::map<quint32, std::vector<ClipShareChunk>> manifestRecipes;     // computed once per offered file
+    ClipShareChunkStore chunkStore;
+
+    std::atomic<quint64> fetchGeneration{ 0 };     // of the latest fetch, older ones stop
+};
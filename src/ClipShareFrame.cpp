@@ -0,0 +1,165 @@
+﻿#include "ClipShareFrame.h"
+
+ClipShareFrame::ClipShareFrame(int maxPayload, qint64 createdAt)
+    : maxPayload(maxPayload)
+    , lastReceivedAt(createdAt)
+{
+}
+
+QByteArray ClipShareFrame::encode(const QByteArray& payload, quint32 stream, quint8 priority)
+{
+    ClipShareChunkHeader header;
+    header.stream = stream;
+    header.flags = ClipShareChunkHeader::Begin | ClipShareChunkHeader::End;
+    header.priority = priority;
+    header.length = static_cast<quint32>(payload.size());
+
+    QByteArray frame;
+    frame.reserve(HeaderSize + payload.size());
+    frame.append(encodeHeader(header));
+    frame.append(payload);
+    return frame;
+}
+
+QByteArray ClipShareFrame::encodeHeader(const ClipShareChunkHeader& header)
+{
+    QByteArray bytes(HeaderSize, Qt::Uninitialized);
+    header.write(reinterpret_cast<std::uint8_t*>(bytes.data()));
+    return bytes;
+}
+
+void ClipShareFrame::setChunkHandler(ChunkHandler handler)
+{
+    chunkHandler = std::move(handler);
+}
+
+void ClipShareFrame::append(const QByteArray& data, qint64 receivedAt)
+{
+    if (head == buffer.size())
+        chunkStartedAt = receivedAt;
+    lastReceivedAt = receivedAt;
+    buffer.append(data);
+}
+
+bool ClipShareFrame::next(QByteArray& payload, qint64* firstByteAt, quint32* stream)
+{
+    while (!overflow && buffer.size() - head >= HeaderSize)
+    {
+        auto header = ClipShareChunkHeader::read(reinterpret_cast<const std::uint8_t*>(buffer.constData() + head));
+        if (maxPayload > 0 && header.length > static_cast<quint32>(maxPayload))
+        {
+            overflow = true;
+            break;
+        }
+        if (static_cast<quint64>(buffer.size() - head) < HeaderSize + static_cast<quint64>(header.length))
+            break;
+
+        auto chunk = buffer.constData() + head + HeaderSize;
+        auto length = static_cast<int>(header.length);
+        auto startedAt = chunkStartedAt;
+        head += HeaderSize + length;
+        // the rest of the buffer started with the latest read
+        chunkStartedAt = lastReceivedAt;
+
+        if (chunkHandler && header.stream != ClipShareChunkHeader::ControlStream)
+            chunkHandler(header, chunk);
+
+        if (header.flags & ClipShareChunkHeader::Cancel)
+        {
+            auto it = streams.find(header.stream);
+            if (it != streams.end())
+            {
+                streamBytes -= it->data.size();
+                streams.erase(it);
+                ++cancelled;
+            }
+            continue;
+        }
+
+        // a whole message in one chunk, no need to copy it through a stream
+        if ((header.flags & ClipShareChunkHeader::Begin) && (header.flags & ClipShareChunkHeader::End) && !streams.contains(header.stream))
+        {
+            payload = QByteArray(chunk, length);
+            if (firstByteAt != nullptr)
+                *firstByteAt = startedAt;
+            if (stream != nullptr)
+                *stream = header.stream;
+            return true;
+        }
+
+        auto it = streams.find(header.stream);
+        if (header.flags & ClipShareChunkHeader::Begin)
+        {
+            if (it != streams.end())
+                streamBytes -= it->data.size();
+            it = streams.insert(header.stream, Stream{ QByteArray{}, startedAt });
+            if (streams.size() > MaxOpenStreams)
+            {
+                overflow = true;
+                break;
+            }
+        }
+        // the rest of a stream we never saw begin, or that was cancelled
+        if (it == streams.end())
+            continue;
+
+        it->data.append(chunk, length);
+        streamBytes += length;
+        if (maxPayload > 0 && it->data.size() > maxPayload)
+        {
+            overflow = true;
+            break;
+        }
+
+        if (header.flags & ClipShareChunkHeader::End)
+        {
+            payload = it->data;
+            if (firstByteAt != nullptr)
+                *firstByteAt = it->startedAt;
+            if (stream != nullptr)
+                *stream = header.stream;
+            streamBytes -= it->data.size();
+            streams.erase(it);
+            return true;
+        }
+    }
+
+    // drop the consumed chunks once, not per chunk
+    if (head > 0)
+    {
+        buffer.remove(0, head);
+        head = 0;
+    }
+    return false;
+}
+
+int ClipShareFrame::pendingBytes() const
+{
+    return buffer.size() - head + streamBytes;
+}
+
+bool ClipShareFrame::oversized() const
+{
+    return overflow;
+}
+
+qint64 ClipShareFrame::lastReceived() const
+{
+    return lastReceivedAt;
+}
+
+qint64 ClipShareFrame::pendingSince() const
+{
+    qint64 since = buffer.size() > head ? chunkStartedAt : 0;
+    for (auto& stream : streams)
+    {
+        if (since == 0 || stream.startedAt < since)
+            since = stream.startedAt;
+    }
+    return since;
+}
+
+int ClipShareFrame::cancelledCount() const
+{
+    return cancelled;
+}
@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QMap>
+#include <functional>
+#include "ClipShareChunk.h"
+
+/// <summary>
+/// Reassembles the messages of a multiplexed peer connection.
+/// The stream is a sequence of ClipShareChunkHeader + payload chunks,
+/// messages come out in the order their last chunk arrived.
+/// </summary>
+class ClipShareFrame
+{
+public:
+    static constexpr int HeaderSize{ static_cast<int>(ClipShareChunkHeader::Size) };
+    static constexpr int MaxOpenStreams{ 64 };
+
+    // sees every chunk but the control stream's as soon as it is parsed, before it is reassembled
+    using ChunkHandler = std::function<void(const ClipShareChunkHeader&, const char* data)>;
+
+    // maxPayload 0 accepts any length, createdAt is the ClipShareTrace::now() the stream was opened
+    explicit ClipShareFrame(int maxPayload = 0, qint64 createdAt = 0);
+
+    // a whole message as one chunk
+    static QByteArray encode(const QByteArray& payload, quint32 stream = 1, quint8 priority = 0);
+    static QByteArray encodeHeader(const ClipShareChunkHeader& header);
+
+    void setChunkHandler(ChunkHandler handler);
+
+    // feed the bytes read from the socket, receivedAt is a ClipShareTrace::now() stamp
+    void append(const QByteArray& data, qint64 receivedAt = 0);
+
+    // pop the next complete message, false if none has fully arrived yet
+    // firstByteAt gets the receivedAt of the read that started the message
+    bool next(QByteArray& payload, qint64* firstByteAt = nullptr, quint32* stream = nullptr);
+
+    // bytes held for messages that are not complete yet
+    int pendingBytes() const;
+
+    // a message above maxPayload or too many open streams, the connection has to go
+    bool oversized() const;
+
+    // receivedAt of the latest read, or createdAt before the first one
+    qint64 lastReceived() const;
+    // receivedAt of the read that started the oldest pending message, 0 without one
+    qint64 pendingSince() const;
+
+    // messages cancelled by the sender before they completed
+    int cancelledCount() const;
+
+private:
+    struct Stream
+    {
+        QByteArray data;
+        qint64 startedAt{ 0 };
+    };
+
+    QByteArray buffer;              // chunk bytes not parsed yet, from head on
+    int head{ 0 };
+    QMap<quint32, Stream> streams;
+    int streamBytes{ 0 };
+    int cancelled{ 0 };
+    int maxPayload{ 0 };
+    bool overflow{ false };
+    qint64 chunkStartedAt{ 0 };
+    qint64 lastReceivedAt{ 0 };
+    ChunkHandler chunkHandler;
+};
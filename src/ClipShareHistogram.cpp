@@ -0,0 +1,127 @@
+﻿#include <algorithm>
+#include <cmath>
+#include "ClipShareHistogram.h"
+
+namespace
+{
+    int highestBit(std::uint64_t value)
+    {
+        int bit = 0;
+        while (value >>= 1)
+            ++bit;
+        return bit;
+    }
+}
+
+ClipShareHistogram::ClipShareHistogram()
+    : counts(BucketCount, 0)
+{
+}
+
+int ClipShareHistogram::bucketIndex(std::int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    if (value < SubBucketCount)
+        return static_cast<int>(value);
+
+    auto bit = std::min(highestBit(static_cast<std::uint64_t>(value)), MaxValueBits);
+    auto shift = bit - (SubBucketBits - 1);
+    auto sub = static_cast<int>(std::min<std::int64_t>(value >> shift, SubBucketCount - 1));
+    return SubBucketCount + (shift - 1) * SubBucketHalf + (sub - SubBucketHalf);
+}
+
+std::int64_t ClipShareHistogram::bucketUpperBound(int index)
+{
+    if (index < SubBucketCount)
+        return index;
+
+    auto offset = index - SubBucketCount;
+    auto shift = offset / SubBucketHalf + 1;
+    std::int64_t sub = offset % SubBucketHalf + SubBucketHalf;
+    return ((sub + 1) << shift) - 1;
+}
+
+void ClipShareHistogram::record(std::int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    ++counts[bucketIndex(value)];
+    minValue = total == 0 ? value : std::min(minValue, value);
+    maxValue = total == 0 ? value : std::max(maxValue, value);
+    sum += static_cast<double>(value);
+    ++total;
+}
+
+void ClipShareHistogram::merge(const ClipShareHistogram& other)
+{
+    if (other.total == 0)
+        return;
+    for (int i = 0; i < BucketCount; ++i)
+        counts[i] += other.counts[i];
+    minValue = total == 0 ? other.minValue : std::min(minValue, other.minValue);
+    maxValue = total == 0 ? other.maxValue : std::max(maxValue, other.maxValue);
+    sum += other.sum;
+    total += other.total;
+}
+
+void ClipShareHistogram::reset()
+{
+    std::fill(counts.begin(), counts.end(), 0);
+    total = 0;
+    minValue = 0;
+    maxValue = 0;
+    sum = 0;
+}
+
+std::uint64_t ClipShareHistogram::count() const
+{
+    return total;
+}
+
+std::int64_t ClipShareHistogram::min() const
+{
+    return minValue;
+}
+
+std::int64_t ClipShareHistogram::max() const
+{
+    return maxValue;
+}
+
+double ClipShareHistogram::mean() const
+{
+    return total == 0 ? 0 : sum / total;
+}
+
+std::int64_t ClipShareHistogram::percentile(double percentile) const
+{
+    if (total == 0)
+        return 0;
+
+    auto rank = static_cast<std::uint64_t>(std::ceil(std::min(100.0, std::max(0.0, percentile)) / 100.0 * total));
+    rank = std::max<std::uint64_t>(rank, 1);
+
+    std::uint64_t seen = 0;
+    for (int i = 0; i < BucketCount; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::min(bucketUpperBound(i), maxValue);
+    }
+    return maxValue;
+}
+
+std::vector<std::pair<std::int64_t, std::uint64_t>> ClipShareHistogram::buckets() const
+{
+    std::vector<std::pair<std::int64_t, std::uint64_t>> result;
+    std::uint64_t seen = 0;
+    for (int i = 0; i < BucketCount; ++i)
+    {
+        if (counts[i] == 0)
+            continue;
+        seen += counts[i];
+        result.emplace_back(bucketUpperBound(i), seen);
+    }
+    return result;
+}
@@ -0,0 +1,46 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// HDR style log-linear histogram of non negative values.
+/// Each power of two range is split in 64 sub buckets, so a recorded value
+/// is reported within 1/64 (~1.6%) of its real value, up to 2^40.
+/// </summary>
+class ClipShareHistogram
+{
+public:
+    static constexpr int SubBucketBits{ 7 };
+    static constexpr int SubBucketCount{ 1 << SubBucketBits };
+    static constexpr int SubBucketHalf{ SubBucketCount / 2 };
+    static constexpr int MaxValueBits{ 40 };
+    static constexpr int BucketCount{ SubBucketCount + (MaxValueBits - SubBucketBits + 1) * SubBucketHalf };
+
+    ClipShareHistogram();
+
+    void record(std::int64_t value);
+    void merge(const ClipShareHistogram& other);
+    void reset();
+
+    std::uint64_t count() const;
+    std::int64_t min() const;
+    std::int64_t max() const;
+    double mean() const;
+
+    // highest value equivalent to the given percentile (0 - 100)
+    std::int64_t percentile(double percentile) const;
+
+    // cumulative (upper bound, count) pairs of the non empty buckets, for exporters
+    std::vector<std::pair<std::int64_t, std::uint64_t>> buckets() const;
+
+    static int bucketIndex(std::int64_t value);
+    static std::int64_t bucketUpperBound(int index);
+
+private:
+    std::vector<std::uint64_t> counts;
+    std::uint64_t total{ 0 };
+    std::int64_t minValue{ 0 };
+    std::int64_t maxValue{ 0 };
+    double sum{ 0 };
+};
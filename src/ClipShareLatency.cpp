@@ -0,0 +1,65 @@
+﻿#include <spdlog/fmt/fmt.h>
+#include "ClipShareLatency.h"
+#include "ClipShareMetrics.h"
+
+void ClipShareLatencyTracker::record(std::uint64_t origin, const ClipShareTrace& trace, std::int64_t clockOffset)
+{
+    if (!trace.has(ClipShareTrace::Capture))
+        return;
+
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto& peer = latencies[origin];
+    auto capture = trace.stamps[ClipShareTrace::Capture];
+    for (int stage = ClipShareTrace::Encode; stage < ClipShareTrace::StageCount; ++stage)
+    {
+        if (!trace.has(static_cast<ClipShareTrace::Stage>(stage)))
+            continue;
+
+        // sender stages share the capture clock, receiver stages are moved into it
+        auto at = trace.stamps[stage];
+        if (stage >= ClipShareTrace::FirstByte)
+            at += clockOffset;
+        peer.stages[stage].record((at - capture) / 1000);
+    }
+}
+
+std::map<std::uint64_t, ClipShareLatencyTracker::PeerLatency> ClipShareLatencyTracker::peers() const
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    return latencies;
+}
+
+std::string ClipShareLatencyTracker::summary(std::uint64_t origin) const
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto it = latencies.find(origin);
+    if (it == latencies.end())
+        return {};
+
+    auto& applied = it->second.stages[ClipShareTrace::Applied];
+    return fmt::format("{:.3f}/{:.3f}/{:.3f}ms n={}", applied.percentile(50) / 1000.0
+        , applied.percentile(99) / 1000.0, applied.percentile(99.9) / 1000.0, applied.count());
+}
+
+void ClipShareLatencyTracker::expose(std::string& out) const
+{
+    static const std::string name{ "clipshare_clip_latency_microseconds" };
+
+    std::lock_guard<std::mutex> lock{ mutex };
+    if (latencies.empty())
+        return;
+
+    out += "# HELP " + name + " Time from capture on the origin to each stage.\n";
+    out += "# TYPE " + name + " summary\n";
+    for (auto& peer : latencies)
+    {
+        for (int stage = ClipShareTrace::Encode; stage < ClipShareTrace::StageCount; ++stage)
+        {
+            auto& histogram = peer.second.stages[stage];
+            if (histogram.count() == 0)
+                continue;
+            auto labels = ClipShareMetrics::renderLabels({ { "origin", fmt::format("{:016x}", peer.first) }, { "stage", ClipShareTrace::stageName(stage) } });
+            ClipShareMetrics::appendSummary(out, name, labels, histogram);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+﻿#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include "ClipShareHistogram.h"
+#include "ClipShareTrace.h"
+
+/// <summary>
+/// Per origin histograms of the time (us) from capture to each stage of a clip.
+/// The Applied histogram is the end to end copy-to-paste latency.
+/// Recorded on the event loop, read by the metrics server thread.
+/// </summary>
+class ClipShareLatencyTracker
+{
+public:
+    struct PeerLatency
+    {
+        std::array<ClipShareHistogram, ClipShareTrace::StageCount> stages;
+    };
+
+    // clockOffset = origin clock - local clock, the receiver stages are corrected with it
+    void record(std::uint64_t origin, const ClipShareTrace& trace, std::int64_t clockOffset);
+
+    std::map<std::uint64_t, PeerLatency> peers() const;
+
+    // "p50/p99/p999" of the end to end latency in ms
+    std::string summary(std::uint64_t origin) const;
+
+    // ClipShareMetrics collector, clipshare_clip_latency_microseconds{origin,stage}
+    void expose(std::string& out) const;
+
+private:
+    mutable std::mutex mutex;
+    std::map<std::uint64_t, PeerLatency> latencies;
+};
@@ -0,0 +1,340 @@
+﻿#include <QCryptographicHash>
+#include <QSysInfo>
+#include <cstring>
+#include "ClipShareLocalChannel.h"
+#include "ClipShareLog.h"
+#include "ClipShareMetrics.h"
+#include "ClipSharePackage.h"
+#include "ClipShareTrace.h"
+
+quint32 ClipShareLocalChannel::hostId(const QString& localHostId)
+{
+    auto id = localHostId.isEmpty() ? QSysInfo::machineUniqueId() : localHostId.toUtf8();
+    if (id.isEmpty())
+        return 0;
+    // stable across processes, unlike qHash
+    auto hash = QCryptographicHash::hash(id, QCryptographicHash::Sha1);
+    quint32 result = 0;
+    std::memcpy(&result, hash.constData(), sizeof(result));
+    return result != 0 ? result : 1;
+}
+
+QString ClipShareLocalChannel::serverName(quint64 nodeId)
+{
+    return QStringLiteral("clipshare-%1").arg(nodeId, 16, 16, QLatin1Char('0'));
+}
+
+QString ClipShareLocalChannel::ringKey(quint64 sender, quint64 receiver)
+{
+    return QStringLiteral("clipshare-%1-%2").arg(sender, 16, 16, QLatin1Char('0')).arg(receiver, 16, 16, QLatin1Char('0'));
+}
+
+ClipShareLocalChannel::ClipShareLocalChannel(quint64 nodeId, int ringSize, QObject* parent)
+    : QObject(parent)
+    , nodeId{ nodeId }
+    , ringSize{ ringSize }
+{
+    connect(&server, &QLocalServer::newConnection, this, &ClipShareLocalChannel::acceptConnections);
+
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.describe("clipshare_local_clips_total", "Clips passed through shared memory to same-host peers, by direction.");
+    metrics.describe("clipshare_local_ring_full_total", "Clips sent over TCP because the peer's shared memory ring had no room.");
+    metrics.describe("clipshare_local_links", "Same-host peers whose shared memory ring is attached.");
+}
+
+bool ClipShareLocalChannel::listen()
+{
+    // other users' sessions could not attach our rings anyway, they have no business with the socket either
+    server.setSocketOptions(QLocalServer::UserAccessOption);
+    auto name = serverName(nodeId);
+    QLocalServer::removeServer(name);
+    if (!server.listen(name))
+    {
+        ClipShareLog::transport().warn("[Local] Cannot listen on {}: {}", name, server.errorString());
+        return false;
+    }
+    ClipShareLog::transport().info("[Local] Listen on {}.", server.fullServerName());
+    return true;
+}
+
+bool ClipShareLocalChannel::listening() const
+{
+    return server.isListening();
+}
+
+void ClipShareLocalChannel::connectPeer(quint64 peerNodeId)
+{
+    if (ringSize <= 0 || links.contains(peerNodeId) || failed.contains(peerNodeId))
+        return;
+
+    auto& link = links[peerNodeId];
+    link.socket = new QLocalSocket(this);
+    auto socket = link.socket;
+    connect(socket, &QLocalSocket::connected, this, [=]
+        {
+            auto it = links.find(peerNodeId);
+            if (it == links.end())
+                return;
+
+            // unique per process and peer, a crashed instance cannot leave one behind under the same key
+            ClipShareRingPackage attach;
+            attach.kind = ClipShareRingPackage::Attach;
+            attach.node = nodeId;
+            attach.key = ringKey(nodeId, peerNodeId).toStdString();
+            attach.size = static_cast<std::uint64_t>(ringSize);
+            it->memory = new QSharedMemory(QString::fromStdString(attach.key), this);
+            if (!it->memory->create(ringSize))
+            {
+                ClipShareLog::transport().warn("[Local] Cannot create a ring for {:016x}: {}", peerNodeId, it->memory->errorString());
+                removeLink(peerNodeId, true);
+                return;
+            }
+            socket->write(ClipShareFrame::encode(attach.encode(), ClipShareChunkHeader::ControlStream));
+        });
+    connect(socket, &QLocalSocket::readyRead, this, [=]
+        {
+            readAcks(peerNodeId);
+        });
+    connect(socket, &QLocalSocket::disconnected, this, [=]
+        {
+            auto it = links.find(peerNodeId);
+            if (it != links.end() && it->socket == socket)
+                removeLink(peerNodeId, !it->attached);
+        });
+    connect(socket, QOverload<QLocalSocket::LocalSocketError>::of(&QLocalSocket::error), this, [=]
+        {
+            auto it = links.find(peerNodeId);
+            if (it != links.end() && it->socket == socket && socket->state() == QLocalSocket::UnconnectedState)
+            {
+                ClipShareLog::transport().info("[Local] {:016x} stays on TCP: {}", peerNodeId, socket->errorString());
+                removeLink(peerNodeId, true);
+            }
+        });
+
+    socket->connectToServer(serverName(peerNodeId));
+}
+
+void ClipShareLocalChannel::disconnectPeer(quint64 peerNodeId)
+{
+    failed.remove(peerNodeId);
+    if (links.contains(peerNodeId))
+        removeLink(peerNodeId, false);
+}
+
+void ClipShareLocalChannel::removeLink(quint64 peerNodeId, bool failedLink)
+{
+    auto it = links.find(peerNodeId);
+    if (it == links.end())
+        return;
+
+    if (it->socket != nullptr)
+    {
+        it->socket->disconnect(this);
+        it->socket->abort();
+        it->socket->deleteLater();
+    }
+    // the peer may still be attached, the segment goes away once it detaches too
+    delete it->memory;
+    links.erase(it);
+    if (failedLink)
+        failed.insert(peerNodeId);
+    ClipShareMetrics::instance().set("clipshare_local_links", {}, connectedCount());
+}
+
+int ClipShareLocalChannel::connectedCount() const
+{
+    int count = 0;
+    for (auto& link : links)
+        count += link.attached ? 1 : 0;
+    return count;
+}
+
+bool ClipShareLocalChannel::allocate(const Link& link, qint64 length, qint64& offset)
+{
+    qint64 size = link.memory->size();
+    if (length > size)
+        return false;
+    if (link.inflight.isEmpty())
+    {
+        offset = 0;
+        return true;
+    }
+
+    auto tail = link.inflight.front().offset;
+    if (link.head > tail)
+    {
+        // not wrapped, free after head and before tail
+        if (size - link.head >= length)
+            offset = link.head;
+        else if (tail >= length)
+            offset = 0;
+        else
+            return false;
+        return true;
+    }
+    // wrapped, free between head and tail
+    if (tail - link.head < length)
+        return false;
+    offset = link.head;
+    return true;
+}
+
+bool ClipShareLocalChannel::send(quint64 peerNodeId, const QByteArray& payload)
+{
+    auto it = links.find(peerNodeId);
+    if (it == links.end() || !it->attached || it->socket->state() != QLocalSocket::ConnectedState)
+        return false;
+
+    qint64 offset = 0;
+    if (!allocate(*it, payload.size(), offset))
+    {
+        ClipShareMetrics::instance().increment("clipshare_local_ring_full_total");
+        return false;
+    }
+
+    // the one copy of the clip, the peer decodes it in place
+    std::memcpy(static_cast<char*>(it->memory->data()) + offset, payload.constData(), static_cast<size_t>(payload.size()));
+    ClipShareRingPackage clip;
+    clip.kind = ClipShareRingPackage::Clip;
+    clip.stream = it->nextStream;
+    clip.offset = static_cast<std::uint64_t>(offset);
+    clip.length = static_cast<std::uint64_t>(payload.size());
+    if (++it->nextStream == ClipShareChunkHeader::ControlStream)
+        it->nextStream = 1;
+    it->head = offset + payload.size();
+    it->inflight.push_back(Slot{ clip.stream, offset, payload.size(), false });
+    it->socket->write(ClipShareFrame::encode(clip.encode(), ClipShareChunkHeader::ControlStream));
+    ClipShareMetrics::instance().increment("clipshare_local_clips_total", { { "direction", "sent" } });
+    return true;
+}
+
+void ClipShareLocalChannel::readAcks(quint64 peerNodeId)
+{
+    auto it = links.find(peerNodeId);
+    if (it == links.end())
+        return;
+
+    it->control.append(it->socket->readAll());
+    QByteArray payload;
+    while (it->control.next(payload))
+    {
+        try {
+            auto ack = ClipShareControlPackage::decode(payload);
+            if (ack.command != ClipShareControlPackage::Ack)
+                continue;
+            // stream 0 acknowledges the Attach
+            if (ack.stream == ClipShareChunkHeader::ControlStream)
+            {
+                it->attached = true;
+                ClipShareLog::transport().info("[Local] {:016x} attached a {} byte ring.", peerNodeId, ringSize);
+                ClipShareMetrics::instance().set("clipshare_local_links", {}, connectedCount());
+                continue;
+            }
+            for (auto& slot : it->inflight)
+            {
+                if (slot.stream == ack.stream)
+                    slot.acked = true;
+            }
+            while (!it->inflight.isEmpty() && it->inflight.front().acked)
+                it->inflight.removeFirst();
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            ClipShareLog::transport().debug("[Local] Invalid control message: {}", e.what());
+        }
+    }
+    if (it->control.oversized())
+        removeLink(peerNodeId, true);
+}
+
+void ClipShareLocalChannel::acceptConnections()
+{
+    while (server.hasPendingConnections())
+    {
+        auto socket = server.nextPendingConnection();
+        incoming.insert(socket, Incoming{});
+        connect(socket, &QLocalSocket::readyRead, this, [=]
+            {
+                readClips(socket);
+            });
+        connect(socket, &QLocalSocket::disconnected, this, [=]
+            {
+                auto it = incoming.find(socket);
+                if (it != incoming.end())
+                {
+                    delete it->memory;
+                    incoming.erase(it);
+                }
+                socket->deleteLater();
+            });
+    }
+}
+
+void ClipShareLocalChannel::readClips(QLocalSocket* socket)
+{
+    auto it = incoming.find(socket);
+    if (it == incoming.end())
+        return;
+
+    auto receivedAt = ClipShareTrace::now();
+    it->frame.append(socket->readAll(), receivedAt);
+    QByteArray payload;
+    while (it->frame.next(payload))
+    {
+        ClipShareRingPackage ring;
+        try {
+            ring = ClipShareRingPackage::decode(payload);
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            ClipShareLog::transport().debug("[Local] Invalid control message: {}", e.what());
+            continue;
+        }
+        if (ring.command != ClipShareControlPackage::Ring)
+            continue;
+
+        ClipShareControlPackage ack;
+        ack.command = ClipShareControlPackage::Ack;
+        if (ring.kind == ClipShareRingPackage::Attach)
+        {
+            // a key the peer picked freely could name any segment of this user
+            if (ring.node == 0 || ring.node == nodeId || QString::fromStdString(ring.key) != ringKey(ring.node, nodeId))
+            {
+                ClipShareLog::transport().warn("[Local] {:016x} offered a ring under a foreign key", ring.node);
+                socket->abort();
+                return;
+            }
+            delete it->memory;
+            it->memory = new QSharedMemory(QString::fromStdString(ring.key), this);
+            if (!it->memory->attach(QSharedMemory::ReadOnly) || static_cast<std::uint64_t>(it->memory->size()) < ring.size)
+            {
+                // the sender notices the close and stays on TCP
+                ClipShareLog::transport().warn("[Local] Cannot attach the ring of {:016x}: {}", ring.node, it->memory->errorString());
+                socket->abort();
+                return;
+            }
+            it->peerNodeId = ring.node;
+            ack.stream = ClipShareChunkHeader::ControlStream;
+        }
+        else if (ring.kind == ClipShareRingPackage::Clip)
+        {
+            if (it->memory == nullptr || !it->memory->isAttached() || !ring.fits(static_cast<std::uint64_t>(it->memory->size())))
+            {
+                socket->abort();
+                return;
+            }
+            ClipShareMetrics::instance().increment("clipshare_local_clips_total", { { "direction", "received" } });
+            auto clip = QByteArray::fromRawData(static_cast<const char*>(it->memory->constData()) + ring.offset, static_cast<int>(ring.length));
+            emit clipReceived(it->peerNodeId, clip, receivedAt);
+            ack.stream = ring.stream;
+        }
+        else
+        {
+            continue;
+        }
+        ack.time = ClipShareTrace::now();
+        socket->write(ClipShareFrame::encode(ack.encode(), ClipShareChunkHeader::ControlStream));
+    }
+    if (it->frame.oversized())
+        socket->abort();
+}
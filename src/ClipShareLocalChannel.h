@@ -0,0 +1,95 @@
+﻿#pragma once
+
+#include <QList>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMap>
+#include <QObject>
+#include <QSet>
+#include <QSharedMemory>
+#include "ClipShareFrame.h"
+
+/// <summary>
+/// Same-host fast path between instances on one machine (sessions, containers sharing /tmp).
+/// Peers announcing our host id in their heartbeat are also connected through a local socket
+/// named after their node id. The sender owns one shared memory ring per peer and copies each
+/// encoded package into it once, the local socket only carries a ClipShareRingPackage saying where,
+/// and the receiver decodes straight out of the ring before it acknowledges the clip.
+/// A clip that does not fit the free part of the ring goes over TCP instead.
+/// Only instances of the same user connect, the socket and the rings are private to it.
+/// </summary>
+class ClipShareLocalChannel : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int MaxControlBytes{ 64 * 1024 };
+
+    // hash of localHostId, or of the machine id without one, 0 if neither is known
+    static quint32 hostId(const QString& localHostId);
+    static QString serverName(quint64 nodeId);
+    // of the ring sender keeps for receiver, a receiver attaches no other
+    static QString ringKey(quint64 sender, quint64 receiver);
+
+    ClipShareLocalChannel(quint64 nodeId, int ringSize, QObject* parent = Q_NULLPTR);
+
+    bool listen();
+    bool listening() const;
+
+    // no-op while the link exists or after it failed once, a peer that cannot attach stays on TCP
+    void connectPeer(quint64 peerNodeId);
+    void disconnectPeer(quint64 peerNodeId);
+
+    // links whose ring the peer attached
+    int connectedCount() const;
+
+    // copy payload into the peer's ring and announce it, false if the link is not up or the ring is full
+    bool send(quint64 peerNodeId, const QByteArray& payload);
+
+signals:
+    // payload points into shared memory and is only valid during the call, the clip is acknowledged after it
+    void clipReceived(quint64 peerNodeId, const QByteArray& payload, qint64 receivedAt);
+
+private:
+    // a clip in the ring, until the peer acknowledged it
+    struct Slot
+    {
+        quint32 stream;
+        qint64 offset;
+        qint64 length;
+        bool acked;
+    };
+
+    // outgoing, one per peer
+    struct Link
+    {
+        QLocalSocket* socket{ nullptr };
+        QSharedMemory* memory{ nullptr };
+        ClipShareFrame control{ MaxControlBytes };
+        bool attached{ false };     // the peer acknowledged the Attach
+        qint64 head{ 0 };           // end of the newest slot
+        QList<Slot> inflight;       // oldest first, contiguous in ring order
+        quint32 nextStream{ 1 };
+    };
+
+    // incoming, one per connected peer
+    struct Incoming
+    {
+        ClipShareFrame frame{ MaxControlBytes };
+        quint64 peerNodeId{ 0 };
+        QSharedMemory* memory{ nullptr };
+    };
+
+    void acceptConnections();
+    void readAcks(quint64 peerNodeId);
+    void readClips(QLocalSocket*);
+    void removeLink(quint64 peerNodeId, bool failed);
+    static bool allocate(const Link&, qint64 length, qint64& offset);
+
+    quint64 nodeId;
+    int ringSize;
+    QLocalServer server{ this };
+    QMap<quint64, Link> links;
+    QMap<QLocalSocket*, Incoming> incoming;
+    QSet<quint64> failed;       // peers that never attached, not tried again
+};
@@ -0,0 +1,130 @@
+﻿#include <QStringList>
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include "ClipShareConfig.h"
+#include "ClipShareLog.h"
+#include "ClipShareTrace.h"
+
+namespace
+{
+    const char* moduleNames[ClipShareLog::ModuleCount]{ "application", "config", "transport", "heartbeat", "peer", "clipboard", "mime", "metrics", "recorder" };
+    const char* pattern{ "[%Y-%m-%d %H:%M:%S.%e] [%^%l%$] %v" };
+
+    spdlog::sink_ptr consoleSink()
+    {
+        static auto sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+        return sink;
+    }
+}
+
+int ClipShareLog::payloadLimit{ 64 };
+
+std::array<std::shared_ptr<spdlog::logger>, ClipShareLog::ModuleCount>& ClipShareLog::loggers()
+{
+    static std::array<std::shared_ptr<spdlog::logger>, ModuleCount> loggers = []
+        {
+            std::array<std::shared_ptr<spdlog::logger>, ModuleCount> loggers;
+            for (int i = 0; i < ModuleCount; ++i)
+            {
+                loggers[i] = std::make_shared<spdlog::logger>(moduleNames[i], consoleSink());
+                loggers[i]->set_pattern(pattern);
+            }
+            return loggers;
+        }();
+    return loggers;
+}
+
+void ClipShareLog::init(const ClipShareConfig& config)
+{
+    payloadLimit = config.logPayloadLimit;
+
+    auto& modules = loggers();
+    if (config.logAsync)
+    {
+        // a full queue drops the oldest message instead of blocking the event loop
+        spdlog::init_thread_pool(8192, 1);
+        for (int i = 0; i < ModuleCount; ++i)
+        {
+            modules[i] = std::make_shared<spdlog::async_logger>(moduleNames[i], consoleSink(), spdlog::thread_pool(), spdlog::async_overflow_policy::overrun_oldest);
+            modules[i]->set_pattern(pattern);
+            modules[i]->flush_on(spdlog::level::warn);
+        }
+    }
+
+    if (!setLevels(config.logLevels))
+        get(Config).warn("[Config] Invalid log levels \"{}\"", config.logLevels.toStdString());
+}
+
+void ClipShareLog::shutdown()
+{
+    for (auto& logger : loggers())
+        logger->flush();
+    spdlog::shutdown();
+}
+
+spdlog::logger& ClipShareLog::get(Module module)
+{
+    return *loggers()[module];
+}
+
+bool ClipShareLog::setLevels(const QString& levels)
+{
+    bool valid = true;
+    // without split flags, Qt::SkipEmptyParts needs 5.14 and QString's is deprecated from then on
+    for (auto& item : levels.split(','))
+    {
+        if (item.trimmed().isEmpty())
+            continue;
+        auto pair = item.trimmed().split('=');
+        auto level = spdlog::level::from_str(pair.back().trimmed().toStdString());
+        // from_str maps unknown names to off
+        if (level == spdlog::level::off && pair.back().trimmed() != "off")
+        {
+            valid = false;
+            continue;
+        }
+
+        if (pair.size() == 1 || pair.front().trimmed() == "*")
+        {
+            for (auto& logger : loggers())
+                logger->set_level(level);
+            continue;
+        }
+
+        auto name = pair.front().trimmed();
+        bool found = false;
+        for (int i = 0; i < ModuleCount; ++i)
+        {
+            if (name == moduleNames[i])
+            {
+                loggers()[i]->set_level(level);
+                found = true;
+            }
+        }
+        valid = valid && found;
+    }
+    return valid;
+}
+
+QByteArray ClipShareLog::payload(const QByteArray& data)
+{
+    return data.size() <= payloadLimit ? data : data.left(payloadLimit);
+}
+
+ClipShareLogLimiter::ClipShareLogLimiter(int burst, std::chrono::milliseconds interval)
+    : bucket(1000.0 / interval.count(), burst, ClipShareTrace::now())
+{
+}
+
+long long ClipShareLogLimiter::allow()
+{
+    if (!bucket.take(ClipShareTrace::now()))
+    {
+        ++suppressed;
+        return -1;
+    }
+
+    auto dropped = suppressed;
+    suppressed = 0;
+    return dropped;
+}
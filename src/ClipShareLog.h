@@ -0,0 +1,75 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include "ClipShareRateLimit.h"
+
+struct ClipShareConfig;
+
+/// <summary>
+/// Per module loggers. Until init() they log synchronously at info,
+/// afterwards they are async loggers on the spdlog thread pool,
+/// so the event loop only pays for queueing a message.
+/// </summary>
+class ClipShareLog
+{
+public:
+    enum Module
+    {
+        Application,
+        Config,
+        Transport,
+        Heartbeat,
+        Peer,
+        Clipboard,
+        Mime,
+        Metrics,
+        Recorder,
+        ModuleCount
+    };
+
+    // levels are "info" or "info,heartbeat=warn,mime=trace", see ClipShareConfig::logLevels
+    static void init(const ClipShareConfig& config);
+    static void shutdown();
+
+    static spdlog::logger& get(Module module);
+    static bool setLevels(const QString& levels);
+
+    // first logPayloadLimit bytes of a payload dump
+    static QByteArray payload(const QByteArray& data);
+
+    static spdlog::logger& application() { return get(Application); }
+    static spdlog::logger& config() { return get(Config); }
+    static spdlog::logger& transport() { return get(Transport); }
+    static spdlog::logger& heartbeat() { return get(Heartbeat); }
+    static spdlog::logger& peer() { return get(Peer); }
+    static spdlog::logger& clipboard() { return get(Clipboard); }
+    static spdlog::logger& mime() { return get(Mime); }
+    static spdlog::logger& metrics() { return get(Metrics); }
+    static spdlog::logger& recorder() { return get(Recorder); }
+
+private:
+    static std::array<std::shared_ptr<spdlog::logger>, ModuleCount>& loggers();
+    static int payloadLimit;
+};
+
+/// <summary>
+/// Token bucket for a repeated message: burst messages, then one per interval.
+/// allow() returns how many were dropped since the last allowed one (>= 0),
+/// or -1 when this one has to be dropped too.
+/// </summary>
+class ClipShareLogLimiter
+{
+public:
+    ClipShareLogLimiter(int burst = 5, std::chrono::milliseconds interval = std::chrono::seconds{ 10 });
+
+    long long allow();
+
+private:
+    ClipShareTokenBucket bucket;
+    long long suppressed{ 0 };
+};
@@ -0,0 +1,154 @@
+﻿#include <spdlog/fmt/fmt.h>
+#include "ClipShareMetrics.h"
+
+namespace
+{
+    const char* typeName(int type)
+    {
+        static const char* names[]{ "counter", "gauge", "summary" };
+        return names[type];
+    }
+
+    std::string escape(const std::string& value)
+    {
+        std::string escaped;
+        escaped.reserve(value.size());
+        for (auto c : value)
+        {
+            if (c == '\\' || c == '"')
+                escaped.push_back('\\');
+            if (c == '\n')
+            {
+                escaped.append("\\n");
+                continue;
+            }
+            escaped.push_back(c);
+        }
+        return escaped;
+    }
+
+    std::string joinLabels(const std::string& labels, const std::string& extra)
+    {
+        if (labels.empty())
+            return extra;
+        return extra.empty() ? labels : labels + "," + extra;
+    }
+}
+
+ClipShareMetrics& ClipShareMetrics::instance()
+{
+    static ClipShareMetrics metrics;
+    return metrics;
+}
+
+void ClipShareMetrics::describe(const std::string& name, const std::string& help)
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    families[name].help = help;
+}
+
+ClipShareMetrics::Family& ClipShareMetrics::family(const std::string& name, Type type)
+{
+    auto& family = families[name];
+    family.type = type;
+    return family;
+}
+
+void ClipShareMetrics::increment(const std::string& name, const Labels& labels, double value)
+{
+    auto key = renderLabels(labels);
+    std::lock_guard<std::mutex> lock{ mutex };
+    family(name, Counter).values[key] += value;
+}
+
+void ClipShareMetrics::set(const std::string& name, const Labels& labels, double value)
+{
+    auto key = renderLabels(labels);
+    std::lock_guard<std::mutex> lock{ mutex };
+    family(name, Gauge).values[key] = value;
+}
+
+void ClipShareMetrics::observe(const std::string& name, const Labels& labels, std::int64_t value)
+{
+    auto key = renderLabels(labels);
+    std::lock_guard<std::mutex> lock{ mutex };
+    family(name, Summary).summaries[key].record(value);
+}
+
+double ClipShareMetrics::value(const std::string& name, const Labels& labels) const
+{
+    auto key = renderLabels(labels);
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto it = families.find(name);
+    if (it == families.end())
+        return 0;
+    auto value = it->second.values.find(key);
+    return value == it->second.values.end() ? 0 : value->second;
+}
+
+void ClipShareMetrics::addCollector(const std::string& key, Collector collector)
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    collectors[key] = std::move(collector);
+}
+
+void ClipShareMetrics::removeCollector(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    collectors.erase(key);
+}
+
+std::string ClipShareMetrics::exposition() const
+{
+    std::string out;
+    std::lock_guard<std::mutex> lock{ mutex };
+    for (auto& item : families)
+    {
+        auto& name = item.first;
+        auto& family = item.second;
+        if (family.values.empty() && family.summaries.empty())
+            continue;
+
+        if (!family.help.empty())
+            out += fmt::format("# HELP {} {}\n", name, family.help);
+        out += fmt::format("# TYPE {} {}\n", name, typeName(family.type));
+
+        for (auto& value : family.values)
+        {
+            if (value.first.empty())
+                out += fmt::format("{} {}\n", name, value.second);
+            else
+                out += fmt::format("{}{{{}}} {}\n", name, value.first, value.second);
+        }
+        for (auto& summary : family.summaries)
+            appendSummary(out, name, summary.first, summary.second);
+    }
+
+    for (auto& collector : collectors)
+        collector.second(out);
+    return out;
+}
+
+std::string ClipShareMetrics::renderLabels(const Labels& labels)
+{
+    std::string rendered;
+    for (auto& label : labels)
+    {
+        if (!rendered.empty())
+            rendered.push_back(',');
+        rendered += fmt::format("{}=\"{}\"", label.first, escape(label.second));
+    }
+    return rendered;
+}
+
+void ClipShareMetrics::appendSummary(std::string& out, const std::string& name, const std::string& labels, const ClipShareHistogram& histogram)
+{
+    for (auto quantile : { 0.5, 0.9, 0.99, 0.999 })
+    {
+        out += fmt::format("{}{{{}}} {}\n", name, joinLabels(labels, fmt::format("quantile=\"{}\"", quantile))
+            , histogram.percentile(quantile * 100));
+    }
+    auto suffix = labels.empty() ? std::string{} : "{" + labels + "}";
+    out += fmt::format("{}_sum{} {}\n", name, suffix, histogram.mean() * histogram.count());
+    out += fmt::format("{}_count{} {}\n", name, suffix, histogram.count());
+}
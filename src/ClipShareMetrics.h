@@ -0,0 +1,61 @@
+﻿#pragma once
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ClipShareHistogram.h"
+
+/// <summary>
+/// Process wide counters, gauges and summaries, rendered in Prometheus text format.
+/// Thread safe, written from the event loop and read by the metrics server thread.
+/// </summary>
+class ClipShareMetrics
+{
+public:
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+    using Collector = std::function<void(std::string&)>;
+
+    static ClipShareMetrics& instance();
+
+    void describe(const std::string& name, const std::string& help);
+
+    void increment(const std::string& name, const Labels& labels = {}, double value = 1);
+    void set(const std::string& name, const Labels& labels, double value);
+    void observe(const std::string& name, const Labels& labels, std::int64_t value);
+
+    double value(const std::string& name, const Labels& labels = {}) const;
+
+    // collectors append their own families when the metrics are rendered
+    void addCollector(const std::string& key, Collector collector);
+    void removeCollector(const std::string& key);
+
+    std::string exposition() const;
+
+    static std::string renderLabels(const Labels& labels);
+    static void appendSummary(std::string& out, const std::string& name, const std::string& labels, const ClipShareHistogram& histogram);
+
+private:
+    enum Type
+    {
+        Counter,
+        Gauge,
+        Summary
+    };
+
+    struct Family
+    {
+        Type type{ Counter };
+        std::string help;
+        std::map<std::string, double> values;
+        std::map<std::string, ClipShareHistogram> summaries;
+    };
+
+    Family& family(const std::string& name, Type type);
+
+    mutable std::mutex mutex;
+    std::map<std::string, Family> families;
+    std::map<std::string, Collector> collectors;
+};
@@ -0,0 +1,39 @@
+﻿#include <cpp-httplib/httplib.h>
+#include "ClipShareLog.h"
+#include "ClipShareMetrics.h"
+#include "ClipShareMetricsServer.h"
+
+ClipShareMetricsServer::ClipShareMetricsServer()
+    : server{ new httplib::Server }
+{
+    server->Get("/metrics", [](const httplib::Request&, httplib::Response& res)
+        {
+            res.set_content(ClipShareMetrics::instance().exposition(), "text/plain; version=0.0.4");
+        });
+}
+
+ClipShareMetricsServer::~ClipShareMetricsServer()
+{
+    stop();
+}
+
+bool ClipShareMetricsServer::start(const std::string& host, int port)
+{
+    if (!server->bind_to_port(host.c_str(), port))
+    {
+        ClipShareLog::metrics().error("[Metrics] Cannot listen on {}:{}", host, port);
+        return false;
+    }
+
+    thread = std::thread{ [this] { server->listen_after_bind(); } };
+    ClipShareLog::metrics().info("[Metrics] Serving http://{}:{}/metrics", host, port);
+    return true;
+}
+
+void ClipShareMetricsServer::stop()
+{
+    if (!thread.joinable())
+        return;
+    server->stop();
+    thread.join();
+}
@@ -0,0 +1,28 @@
+﻿#pragma once
+
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace httplib
+{
+    class Server;
+}
+
+/// <summary>
+/// Loopback only HTTP endpoint serving ClipShareMetrics on /metrics.
+/// Runs on its own thread, a slow scrape never blocks the event loop.
+/// </summary>
+class ClipShareMetricsServer
+{
+public:
+    ClipShareMetricsServer();
+    ~ClipShareMetricsServer();
+
+    bool start(const std::string& host, int port);
+    void stop();
+
+private:
+    std::unique_ptr<httplib::Server> server;
+    std::thread thread;
+};
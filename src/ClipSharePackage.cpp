@@ -0,0 +1,417 @@
+﻿#include <QMimeData>
+#include <QUrl>
+#include <QBuffer>
+#include <QImage>
+#include <QImageWriter>
+#include <QSet>
+#include <QFile>
+#include <QFileInfo>
+#include <QDataStream>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include "ClipShareDelta.h"
+#include "ClipShareLog.h"
+#include "ClipSharePackage.h"
+
+void ClipSharePackage::encodeMimeData(const QMimeData*mimeData, bool offerFiles)
+{
+    // files and whole directories, the receiver fetches them when it gets the clip
+    if (offerFiles && mimeData->hasUrls())
+    {
+        for (auto& url : mimeData->urls())
+        {
+            QFileInfo info{ url.toLocalFile() };
+            if (!url.isLocalFile() || (!info.isFile() && !info.isDir()))
+                continue;
+            fileNames.push_back(info.fileName());
+            fileSizes.push_back(info.isFile() ? static_cast<std::uint64_t>(info.size()) : 0);
+            filePaths.push_back(info.absoluteFilePath());
+        }
+    }
+
+    // attach image
+    if (mimeData->hasImage()) {
+
+        // attach file, an offered one is fetched and loaded by the receiver
+        if (!filePaths.isEmpty())
+        {
+            mimeImageType = QFileInfo{ filePaths.front() }.suffix();
+        }
+        else if (mimeData->hasUrls())
+        {
+            ClipShareLog::mime().trace("[Mime] Image from file {}", mimeData->urls().front().toLocalFile());
+            QFile file(mimeData->urls().front().toLocalFile());
+            if (file.open(QFile::ReadOnly)) {
+                mimeImageType = QFileInfo{ file }.suffix();
+                mimeImageData = file.readAll().toBase64();
+                file.close();
+            }
+            else
+            {
+                ClipShareLog::mime().warn("[Mime] Cannot load file from image url: {}", mimeData->urls().front().toString());
+            }
+        }
+
+        // from capture image / cannot load file; use image in clipboard
+        if (mimeImageData.isEmpty() && filePaths.isEmpty())
+        {
+            auto image = qvariant_cast<QImage>(mimeData->imageData());
+            ClipShareLog::mime().trace("[Mime] Image from clipboard {}x{}", image.width(), image.height());
+            QByteArray imageData;
+            QBuffer buffer(&imageData);
+            buffer.open(QIODevice::WriteOnly);
+            image.save(&buffer, DefaultMimeImageType);
+            mimeImageData = imageData.toBase64();
+        }
+
+        // use default type
+        if (mimeImageType.isEmpty())
+        {
+            ClipShareLog::mime().trace("[Mime] Set mimeImageType with {}", DefaultMimeImageType);
+            mimeImageType = DefaultMimeImageType;
+        }
+    }
+
+    // the image goes once, in mimeImageData, and setImageData() brings back the raster formats Qt can write on the receiver;
+    // the others, svg or gif, and all of them while the image only comes with the fetched files, go as they are
+    QSet<QString> regenerated;
+    if (!mimeImageData.isEmpty())
+    {
+        regenerated.insert(QStringLiteral("application/x-qt-image"));
+        for (auto& type : QImageWriter::supportedMimeTypes())
+            regenerated.insert(QString::fromLatin1(type));
+    }
+    for (auto& format : mimeData->formats())
+    {
+        if (regenerated.contains(format))
+            continue;
+        auto data = mimeData->data(format);
+        ClipShareLog::mime().trace("[Mime] format [{}bytes]: {}", data.size(), format);
+        this->mimeFormats.push_back(format);
+        this->mimeData.push_back(data.toBase64());
+    }
+}
+
+QMimeData* ClipSharePackage::decodeMimeData() const
+{
+    auto mime = new QMimeData;
+    for (int i = 0; i < mimeFormats.size() && i < mimeData.size(); ++i)
+        mime->setData(mimeFormats[i], QByteArray::fromBase64(mimeData[i]));
+
+    // the origin's paths mean nothing here, point the file manager formats to the fetched copies
+    if (!filePaths.isEmpty())
+    {
+        QList<QUrl> urls;
+        QByteArray gnomeFiles{ "copy" };
+        for (auto& path : filePaths)
+        {
+            urls.push_back(QUrl::fromLocalFile(path));
+            gnomeFiles += "\n" + urls.back().toEncoded();
+        }
+        mime->setUrls(urls);
+        if (mime->hasFormat("x-special/gnome-copied-files"))
+            mime->setData("x-special/gnome-copied-files", gnomeFiles);
+    }
+
+    if (!mimeImageData.isEmpty())
+    {
+        auto image = QImage::fromData(QByteArray::fromBase64(mimeImageData), mimeImageType.toLatin1().constData());
+        if (!image.isNull())
+            mime->setImageData(image);
+        else
+            ClipShareLog::mime().warn("[Mime] Cannot decode {} image of {}bytes", mimeImageType, mimeImageData.size());
+    }
+    else if (!mimeImageType.isEmpty() && !filePaths.isEmpty())
+    {
+        QImage image{ filePaths.front() };
+        if (!image.isNull())
+            mime->setImageData(image);
+        else
+            ClipShareLog::mime().warn("[Mime] Cannot load {} image from {}", mimeImageType, filePaths.front());
+    }
+    return mime;
+}
+
+QStringList ClipSharePackage::defaultAcceptedFormats()
+{
+    QStringList formats{ "text/plain", "text/html", "text/uri-list", "x-special/gnome-copied-files", "application/x-color", "text/*", "image/*" };
+#ifdef Q_OS_WIN
+    // the one private Windows format worth sending, the others only mean something to the copying process
+    formats.push_back("application/x-qt-windows-mime;value=\"Rich Text Format\"");
+#endif
+    return formats;
+}
+
+namespace
+{
+    bool matchFormat(const QString& pattern, const QString& format)
+    {
+        if (pattern.endsWith(QLatin1Char('*')))
+            return format.startsWith(pattern.leftRef(pattern.size() - 1), Qt::CaseInsensitive);
+        return format.compare(pattern, Qt::CaseInsensitive) == 0;
+    }
+
+    int formatRank(const QStringList& accepted, const QString& format)
+    {
+        if (accepted.isEmpty())
+            return 0;
+        for (int i = 0; i < accepted.size(); ++i)
+        {
+            if (matchFormat(accepted[i], format))
+                return i;
+        }
+        return -1;
+    }
+}
+
+int ClipSharePackage::pruneFormats(const QStringList& accepted)
+{
+    QVector<QPair<int, int>> kept;     // rank, index
+    for (int i = 0; i < mimeFormats.size() && i < mimeData.size(); ++i)
+    {
+        auto rank = formatRank(accepted, mimeFormats[i]);
+        if (rank >= 0)
+            kept.push_back({ rank, i });
+    }
+    std::stable_sort(kept.begin(), kept.end(), [](const QPair<int, int>& a, const QPair<int, int>& b) { return a.first < b.first; });
+
+    QStringList formats;
+    QByteArrayList data;
+    QStringList types;      // of formats, without parameters
+    for (auto& format : kept)
+    {
+        // text/plain and text/plain;charset=utf-8 with the same text
+        auto type = mimeFormats[format.second].section(QLatin1Char(';'), 0, 0).trimmed().toLower();
+        bool duplicate = false;
+        for (int j = 0; j < types.size() && !duplicate; ++j)
+            duplicate = types[j] == type && data[j] == mimeData[format.second];
+        if (duplicate)
+            continue;
+        formats.push_back(mimeFormats[format.second]);
+        data.push_back(mimeData[format.second]);
+        types.push_back(type);
+    }
+
+    auto dropped = mimeFormats.size() - formats.size();
+    mimeFormats = formats;
+    mimeData = data;
+    if (!mimeImageType.isEmpty() && formatRank(accepted, "image/" + mimeImageType) < 0 && formatRank(accepted, "application/x-qt-image") < 0)
+    {
+        mimeImageType.clear();
+        mimeImageData.clear();
+        ++dropped;
+    }
+    return dropped;
+}
+
+bool ClipSharePackage::textFormat(const QString& format)
+{
+    return format.startsWith(QLatin1String("text/"));
+}
+
+bool ClipSharePackage::encodeDelta(const ClipSharePackage& base, int minSize)
+{
+    for (int i = 0; i < mimeFormats.size() && i < mimeData.size(); ++i)
+    {
+        auto j = base.mimeFormats.indexOf(mimeFormats[i]);
+        if (!textFormat(mimeFormats[i]) || mimeData[i].size() < minSize || j < 0 || j >= base.mimeData.size())
+            continue;
+        // on the raw text, an edit shifts everything after it in base64
+        auto delta = ClipShareDelta::encode(QByteArray::fromBase64(base.mimeData[j]), QByteArray::fromBase64(mimeData[i]));
+        if (delta.isEmpty())
+            continue;
+        mimeData[i] = delta.toBase64();
+        deltaFormats.push_back(mimeFormats[i]);
+    }
+    deltaBase = deltaFormats.isEmpty() ? 0 : base.sequence;
+    return deltaBase != 0;
+}
+
+bool ClipSharePackage::applyDelta(const ClipSharePackage& base, int maxSize)
+{
+    for (auto& format : deltaFormats)
+    {
+        auto i = mimeFormats.indexOf(format);
+        auto j = base.mimeFormats.indexOf(format);
+        QByteArray text;
+        if (i < 0 || i >= mimeData.size() || j < 0 || j >= base.mimeData.size()
+            || !ClipShareDelta::apply(QByteArray::fromBase64(base.mimeData[j]), QByteArray::fromBase64(mimeData[i]), text, maxSize))
+            return false;
+        mimeData[i] = text.toBase64();
+    }
+    deltaBase = 0;
+    deltaFormats.clear();
+    return true;
+}
+
+QByteArray ClipSharePackage::encode() const
+{
+    return QByteArray::fromStdString(nlohmann::json(*this).dump());
+}
+
+// throws nlohmann::json::exception on malformed input
+ClipSharePackage ClipSharePackage::decode(const QByteArray& data)
+{
+    return nlohmann::json::parse(data.constData(), data.constData() + data.size()).get<ClipSharePackage>();
+}
+
+QByteArray ClipShareControlPackage::encode() const
+{
+    return QByteArray::fromStdString(nlohmann::json(*this).dump());
+}
+
+// throws nlohmann::json::exception on malformed input
+ClipShareControlPackage ClipShareControlPackage::decode(const QByteArray& data)
+{
+    return nlohmann::json::parse(data.constData(), data.constData() + data.size()).get<ClipShareControlPackage>();
+}
+
+QByteArray ClipShareRoutePackage::encode() const
+{
+    return QByteArray::fromStdString(nlohmann::json(*this).dump());
+}
+
+// throws nlohmann::json::exception on malformed input
+ClipShareRoutePackage ClipShareRoutePackage::decode(const QByteArray& data)
+{
+    return nlohmann::json::parse(data.constData(), data.constData() + data.size()).get<ClipShareRoutePackage>();
+}
+
+QByteArray ClipShareFormatsPackage::encode() const
+{
+    return QByteArray::fromStdString(nlohmann::json(*this).dump());
+}
+
+// throws nlohmann::json::exception on malformed input
+ClipShareFormatsPackage ClipShareFormatsPackage::decode(const QByteArray& data)
+{
+    return nlohmann::json::parse(data.constData(), data.constData() + data.size()).get<ClipShareFormatsPackage>();
+}
+
+QByteArray ClipShareRingPackage::encode() const
+{
+    return QByteArray::fromStdString(nlohmann::json(*this).dump());
+}
+
+// throws nlohmann::json::exception on malformed input
+ClipShareRingPackage ClipShareRingPackage::decode(const QByteArray& data)
+{
+    return nlohmann::json::parse(data.constData(), data.constData() + data.size()).get<ClipShareRingPackage>();
+}
+
+bool ClipShareRingPackage::fits(std::uint64_t ringSize) const
+{
+    // without overflowing offset + length
+    return length <= ringSize && offset <= ringSize - length;
+}
+
+std::vector<std::uint32_t> ClipShareRoutePackage::children(std::uint32_t parent) const
+{
+    std::vector<std::uint32_t> result;
+    for (std::uint64_t i = static_cast<std::uint64_t>(fanout) * parent + 1; i <= static_cast<std::uint64_t>(fanout) * parent + fanout && i < members.size(); ++i)
+        result.push_back(static_cast<std::uint32_t>(i));
+    return result;
+}
+
+QByteArray ClipShareClipDatagram::encode() const
+{
+    QByteArray datagram;
+    QDataStream out(&datagram, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_12);
+    out << Magic << command << nodeId << sequence;
+    if (command == Fragment)
+        out << index << count << data;
+    else if (command == Have || command == Want)
+        out << origin;
+    else if (command == Nack)
+    {
+        out << static_cast<quint16>(qMin(missing.size(), 0xffff));
+        for (int i = 0; i < missing.size() && i < 0xffff; ++i)
+            out << missing[i];
+    }
+    if (command != Clip)
+        return datagram;
+
+    for (auto stamp : package.trace.stamps)
+        out << static_cast<qint64>(stamp);
+    out << package.sender.toUtf8();
+    auto count = qMin(package.mimeFormats.size(), package.mimeData.size());
+    out << static_cast<quint8>(qMin(count, 255));
+    for (int i = 0; i < count && i < 255; ++i)
+        out << package.mimeFormats[i].toUtf8() << QByteArray::fromBase64(package.mimeData[i]);
+    return datagram;
+}
+
+bool ClipShareClipDatagram::decode(const QByteArray& datagram, ClipShareClipDatagram& out)
+{
+    QDataStream in(datagram);
+    in.setVersion(QDataStream::Qt_5_12);
+    quint32 magic = 0;
+    in >> magic >> out.command >> out.nodeId >> out.sequence;
+    if (magic != Magic || in.status() != QDataStream::Ok)
+        return false;
+    if (out.command == Ack)
+        return true;
+    if (out.command == Have || out.command == Want)
+    {
+        in >> out.origin;
+        return in.status() == QDataStream::Ok;
+    }
+    if (out.command == Fragment)
+    {
+        in >> out.index >> out.count >> out.data;
+        return in.status() == QDataStream::Ok && out.index < out.count;
+    }
+    if (out.command == Nack)
+    {
+        // counted by hand, a QVector count from the wire would be trusted for the allocation
+        quint16 size = 0;
+        in >> size;
+        out.missing.clear();
+        for (int i = 0; i < size && in.status() == QDataStream::Ok; ++i)
+        {
+            quint32 value = 0;
+            in >> value;
+            out.missing.push_back(value);
+        }
+        return in.status() == QDataStream::Ok;
+    }
+    if (out.command != Clip)
+        return false;
+
+    out.package = ClipSharePackage{};
+    out.package.origin = out.nodeId;
+    out.package.sequence = out.sequence;
+    for (auto& stamp : out.package.trace.stamps)
+    {
+        qint64 value = 0;
+        in >> value;
+        stamp = value;
+    }
+    QByteArray sender;
+    quint8 count = 0;
+    in >> sender >> count;
+    out.package.sender = QString::fromUtf8(sender);
+    for (int i = 0; i < count; ++i)
+    {
+        QByteArray format, data;
+        in >> format >> data;
+        out.package.mimeFormats.push_back(QString::fromUtf8(format));
+        out.package.mimeData.push_back(data.toBase64());
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+bool ClipShareClipDatagram::matches(const char* data, qint64 size)
+{
+    return size >= 4 && qFromBigEndian<quint32>(data) == Magic;
+}
+
+bool ClipShareHeartbeatPackage::parse(const QByteArray& datagram, ClipShareHeartbeatPackage& pkg)
+{
+    if (datagram.size() != sizeof(ClipShareHeartbeatPackage))
+        return false;
+    std::memcpy(&pkg, datagram.constData(), sizeof(ClipShareHeartbeatPackage));
+    return true;
+}
@@ -0,0 +1,249 @@
+﻿#pragma once
+
+#include <QStringList>
+#include <QByteArrayList>
+#include <QVector>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Adapter.h"
+#include "ClipShareTrace.h"
+
+class QMimeData;
+
+/// <summary>
+/// Package
+/// </summary>
+struct ClipSharePackage
+{
+    static constexpr auto DefaultMimeImageType{ "png" };
+    QStringList mimeFormats;
+    QByteArrayList mimeData;
+    QString mimeImageType;
+    QByteArray mimeImageData;
+
+    QString sender;
+    QString receiver;
+    std::uint64_t origin{ 0 };      // node id of the sender
+    std::uint64_t sequence{ 0 };    // per origin, a clip supersedes every lower one
+
+    // copied local files and directories, fetched from filePort of the origin instead of embedded, see ClipShareFileTransfer
+    QStringList fileNames;
+    std::vector<std::uint64_t> fileSizes;   // 0 for directories, their contents are listed when they are fetched
+    std::uint16_t filePort{ 0 };
+    std::uint64_t fileToken{ 0 };
+    QStringList filePaths;          // not sent, the offered files on the origin, the fetched ones on a receiver
+
+    // text formats sent to a peer as a ClipShareDelta against the same formats of a clip it acknowledged
+    std::uint64_t deltaBase{ 0 };   // sequence of that clip of the same origin, 0 none
+    QStringList deltaFormats;       // whose mimeData holds the delta
+
+    ClipShareTrace trace;
+
+    // offerFiles lists local file and directory URLs in fileNames and filePaths instead of reading image files
+    void encodeMimeData(const QMimeData*, bool offerFiles = false);
+    // with filePaths the URLs point to the fetched files
+    QMimeData* decodeMimeData() const;
+
+    // what a receiver asks for without acceptFormats in its configuration, see ClipShareFormatsPackage
+    static QStringList defaultAcceptedFormats();
+    // keep the formats matching accepted, ordered by the first pattern they match, everything without a list;
+    // of formats differing only in parameters and holding the same bytes the first is kept. The number dropped.
+    int pruneFormats(const QStringList& accepted);
+
+    // formats a delta can be made of
+    static bool textFormat(const QString& format);
+    // text formats of at least minSize encoded bytes become deltas against base, false if none got smaller
+    bool encodeDelta(const ClipSharePackage& base, int minSize);
+    // the deltas back in full, false if base lacks a format or a delta is malformed
+    bool applyDelta(const ClipSharePackage& base, int maxSize);
+
+    QByteArray encode() const;
+    static ClipSharePackage decode(const QByteArray&);
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipSharePackage, mimeFormats, mimeData, mimeImageType, mimeImageData, sender, receiver, origin, sequence, fileNames, fileSizes, filePort, fileToken, deltaBase, deltaFormats, trace);
+};
+
+/// <summary>
+/// Message on the control stream of a peer connection
+/// </summary>
+struct ClipShareControlPackage
+{
+    enum
+    {
+        Ping = 1,   // keeps an idle connection from being evicted
+        Ack = 2,    // the receiver decoded the message of stream
+        Hello = 3,  // first message to a clipshare_hub, node names the subscriber
+        Route = 4,  // a ClipShareRoutePackage
+        Ring = 5,   // a ClipShareRingPackage, same-host connections only
+        Missing = 6,    // the receiver lacks the delta base of stream, see ClipSharePackage::deltaBase
+        Formats = 7,    // a ClipShareFormatsPackage
+        Delivered = 8   // to the origin, node got its clip sequence down the overlay tree
+    };
+
+    std::uint32_t command{ Ping };
+    std::uint32_t stream{ 0 };
+    std::int64_t time{ 0 };         // ClipShareTrace::now() of the sender
+    std::uint64_t node{ 0 };
+    std::uint64_t sequence{ 0 };    // Delivered only
+
+    QByteArray encode() const;
+    static ClipShareControlPackage decode(const QByteArray&);
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipShareControlPackage, command, stream, time, node, sequence);
+};
+
+/// <summary>
+/// Control message announcing that stream carries a clip relayed down a k-ary tree.
+/// members is the tree in array order as the origin laid it out, the origin first,
+/// member i forwards to members fanout * i + 1 .. fanout * i + fanout.
+/// </summary>
+struct ClipShareRoutePackage
+{
+    std::uint32_t command{ ClipShareControlPackage::Route };
+    std::uint32_t stream{ 0 };
+    std::uint32_t fanout{ 0 };
+    std::uint32_t index{ 0 };       // of the receiver in members
+    std::uint8_t priority{ 0 };     // of the stream's chunks
+    std::vector<std::uint64_t> members;
+
+    QByteArray encode() const;
+    static ClipShareRoutePackage decode(const QByteArray&);
+
+    // indices member index sends to
+    std::vector<std::uint32_t> children(std::uint32_t index) const;
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipShareRoutePackage, command, stream, fanout, index, priority, members);
+};
+
+/// <summary>
+/// Control message a receiver sends first on every accepted connection: the formats it wants clips in,
+/// most wanted first, as MIME types or patterns ending in '*'. The sender leaves out the others.
+/// </summary>
+struct ClipShareFormatsPackage
+{
+    static constexpr int MaxFormats{ 64 };
+
+    std::uint32_t command{ ClipShareControlPackage::Formats };
+    QStringList formats;
+
+    QByteArray encode() const;
+    static ClipShareFormatsPackage decode(const QByteArray&);
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipShareFormatsPackage, command, formats);
+};
+
+/// <summary>
+/// Control message of a same-host connection, see ClipShareLocalChannel.
+/// The sender first names the shared memory ring it writes clips into (Attach),
+/// then announces each clip by the offset and length of its encoded package in the ring (Clip).
+/// The receiver's Ack of stream hands the clip's bytes back to the sender.
+/// </summary>
+struct ClipShareRingPackage
+{
+    enum
+    {
+        Attach = 1,
+        Clip = 2
+    };
+
+    std::uint32_t command{ ClipShareControlPackage::Ring };
+    std::uint32_t kind{ Attach };
+    std::uint32_t stream{ 0 };
+    std::uint64_t node{ 0 };        // Attach, the sender
+    std::string key;                // Attach, of the QSharedMemory
+    std::uint64_t size{ 0 };        // Attach, ring bytes
+    std::uint64_t offset{ 0 };      // Clip
+    std::uint64_t length{ 0 };      // Clip
+
+    QByteArray encode() const;
+    static ClipShareRingPackage decode(const QByteArray&);
+
+    // offset and length of a Clip lie within a ring of ringSize bytes
+    bool fits(std::uint64_t ringSize) const;
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipShareRingPackage, command, kind, stream, node, key, size, offset, length);
+};
+
+/// <summary>
+/// Small clip as a single datagram on the heartbeat socket,
+/// QDataStream binary with the raw format data instead of JSON and base64.
+/// Receivers answer every Clip with an Ack carrying its sequence.
+/// Larger clips are multicast as Fragments of their encoded package,
+/// receivers ask for the missing ones with a Nack, see ClipShareReassembly.
+/// In gossip mode a Have announces a clip id and a peer that does not know it yet
+/// answers with a Want, the clip then comes over the stream connection.
+/// </summary>
+struct ClipShareClipDatagram
+{
+    static constexpr quint32 Magic{ 0x63736681 };
+
+    enum : quint8
+    {
+        Clip = 1,
+        Ack = 2,
+        Fragment = 3,
+        Nack = 4,
+        Have = 5,
+        Want = 6
+    };
+
+    quint8 command{ Clip };
+    quint64 nodeId{ 0 };        // origin of a Clip or Fragment, the answering node of an Ack or Nack, the sender of a Have or Want
+    quint64 sequence{ 0 };
+    quint64 origin{ 0 };        // Have and Want only, with sequence the clip id
+    ClipSharePackage package;   // Clip only, without image
+
+    quint32 index{ 0 };         // Fragment only
+    quint32 count{ 0 };
+    QByteArray data;
+
+    QVector<quint32> missing;   // Nack only, fragment indices
+
+    QByteArray encode() const;
+    static bool decode(const QByteArray& datagram, ClipShareClipDatagram& out);
+
+    // cheap magic check before decoding
+    static bool matches(const char* data, qint64 size);
+};
+
+/// <summary>
+/// hearbeat
+/// </summary>
+struct ClipShareHeartbeatPackage
+{
+    enum
+    {
+        Heartbeat = 0x73,
+        Response = 0x66
+    };
+
+    // flags
+    static constexpr std::uint16_t LocalChannel{ 0x1 };    // accepts same-host connections, see ClipShareLocalChannel
+
+	std::uint8_t magic[4]{ 0x63, 0x73, 0x66, 0x80 };
+    std::uint32_t command { Heartbeat };
+    std::uint64_t nodeId{ 0 };          // random per process, tells peers (and ourselves) apart
+    std::uint16_t packagePort{ 0 };     // where the sender accepts package connections
+    std::uint16_t flags{ 0 };
+    std::uint32_t hostId{ 0 };          // the same for all instances on one machine, 0 unknown
+
+    // NTP style clock exchange in ClipShareTrace::now() of either side:
+    // originTime is the heartbeat send time, echoed back in the response,
+    // receiveTime/transmitTime are stamped by the responder
+    std::int64_t originTime{ 0 };
+    std::int64_t receiveTime{ 0 };
+    std::int64_t transmitTime{ 0 };
+
+    bool valid() const
+    {
+        return magic[0] == 0x63 && magic[1] == 0x73 && magic[2] == 0x66
+            && magic[3] == 0x80 && (command == Heartbeat || command == Response);
+    }
+
+    // false when the datagram has the wrong size, the content still needs valid()
+    static bool parse(const QByteArray& datagram, ClipShareHeartbeatPackage& pkg);
+};
+constexpr ClipShareHeartbeatPackage ClipShareHeartbeatPackage_Heartbeat{ { 0x63, 0x73, 0x66, 0x80 }, ClipShareHeartbeatPackage::Heartbeat };
+constexpr ClipShareHeartbeatPackage ClipShareHeartbeatPackage_Response{ { 0x63, 0x73, 0x66, 0x80 }, ClipShareHeartbeatPackage::Response };
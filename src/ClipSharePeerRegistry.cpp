@@ -0,0 +1,106 @@
+﻿#include <QDateTime>
+#include "ClipShareLog.h"
+#include "Adapter.h"
+#include "ClipSharePeerRegistry.h"
+
+ClipSharePeerRegistry::ClipSharePeerRegistry(int survivalTimeout, QObject* parent)
+    : QObject(parent)
+    , survivalTimeout{ survivalTimeout }
+{
+    expireTimer.setInterval(qMax(1000, survivalTimeout / 4));
+    connect(&expireTimer, &QTimer::timeout, this, &ClipSharePeerRegistry::expire);
+    expireTimer.start();
+}
+
+void ClipSharePeerRegistry::update(quint64 nodeId, const QHostAddress& address, quint16 packagePort, quint16 heartbeatPort, quint32 hostId)
+{
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    auto it = registry.find(nodeId);
+    if (it != registry.end())
+    {
+        it->address = address;
+        it->packagePort = packagePort;
+        it->heartbeatPort = heartbeatPort;
+        it->hostId = hostId;
+        it->lastSeen = now;
+        return;
+    }
+
+    ClipSharePeer peer;
+    peer.nodeId = nodeId;
+    peer.address = address;
+    peer.packagePort = packagePort;
+    peer.heartbeatPort = heartbeatPort;
+    peer.hostId = hostId;
+    peer.lastSeen = now;
+    registry.insert(nodeId, peer);
+
+    ClipShareLog::peer().info("[Peer] {:016x} joined at {}:{}", nodeId, address.toString(), packagePort);
+    emit peerJoined(peer);
+}
+
+void ClipSharePeerRegistry::remove(quint64 nodeId)
+{
+    auto it = registry.find(nodeId);
+    if (it == registry.end())
+        return;
+
+    auto peer = *it;
+    registry.erase(it);
+    ClipShareLog::peer().info("[Peer] {:016x} left from {}:{}", nodeId, peer.address.toString(), peer.packagePort);
+    emit peerLeft(peer);
+}
+
+void ClipSharePeerRegistry::updateClock(quint64 nodeId, qint64 t0, qint64 t1, qint64 t2, qint64 t3)
+{
+    auto it = registry.find(nodeId);
+    if (it == registry.end() || t0 == 0)
+        return;
+
+    auto roundTrip = (t3 - t0) - (t2 - t1);
+    auto offset = ((t1 - t0) + (t2 - t3)) / 2;
+    if (roundTrip < 0)
+        return;
+
+    // the sample with the shorter round trip has the tighter offset bound
+    if (it->roundTrip < 0 || roundTrip <= it->roundTrip)
+        it->clockOffset = offset;
+    else
+        it->clockOffset += (offset - it->clockOffset) / 8;
+    it->roundTrip = it->roundTrip < 0 ? roundTrip : it->roundTrip + (roundTrip - it->roundTrip) / 8;
+
+    ClipShareLog::peer().debug("[Peer] {:016x} round trip {}us, clock offset {}us", nodeId, it->roundTrip / 1000, it->clockOffset / 1000);
+}
+
+bool ClipSharePeerRegistry::contains(quint64 nodeId) const
+{
+    return registry.contains(nodeId);
+}
+
+ClipSharePeer ClipSharePeerRegistry::peer(quint64 nodeId) const
+{
+    return registry.value(nodeId);
+}
+
+QList<ClipSharePeer> ClipSharePeerRegistry::peers() const
+{
+    return registry.values();
+}
+
+int ClipSharePeerRegistry::count() const
+{
+    return registry.size();
+}
+
+void ClipSharePeerRegistry::expire()
+{
+    auto deadline = QDateTime::currentMSecsSinceEpoch() - survivalTimeout;
+    QList<quint64> expired;
+    for (auto& peer : registry)
+    {
+        if (peer.lastSeen < deadline)
+            expired.push_back(peer.nodeId);
+    }
+    for (auto nodeId : expired)
+        remove(nodeId);
+}
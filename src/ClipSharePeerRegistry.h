@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include <QObject>
+#include <QHostAddress>
+#include <QMap>
+#include <QTimer>
+
+/// <summary>
+/// A neighbor learned from heartbeats
+/// </summary>
+struct ClipSharePeer
+{
+    quint64 nodeId{ 0 };
+    QHostAddress address;
+    quint16 packagePort{ 0 };
+    quint16 heartbeatPort{ 0 };     // where its heartbeats came from, answers datagrams
+    quint32 hostId{ 0 };            // of its machine if it takes same-host connections, else 0
+    qint64 lastSeen{ 0 };      // QDateTime::currentMSecsSinceEpoch() of the last heartbeat
+
+    qint64 clockOffset{ 0 };   // ns, peer monotonic clock - local monotonic clock
+    qint64 roundTrip{ -1 };    // ns, smoothed heartbeat round trip, -1 before the first response
+};
+
+/// <summary>
+/// Peers seen on the heartbeat group, expired after the survival timeout.
+/// </summary>
+class ClipSharePeerRegistry : public QObject
+{
+    Q_OBJECT
+
+public:
+    ClipSharePeerRegistry(int survivalTimeout, QObject* parent = Q_NULLPTR);
+
+    // record a heartbeat, emits peerJoined for a new node
+    void update(quint64 nodeId, const QHostAddress& address, quint16 packagePort, quint16 heartbeatPort = 0, quint32 hostId = 0);
+    void remove(quint64 nodeId);
+
+    // one heartbeat round trip sample, t0/t3 local, t1/t2 in the peer clock
+    void updateClock(quint64 nodeId, qint64 t0, qint64 t1, qint64 t2, qint64 t3);
+
+    bool contains(quint64 nodeId) const;
+    ClipSharePeer peer(quint64 nodeId) const;
+    QList<ClipSharePeer> peers() const;
+    int count() const;
+
+public slots:
+    void expire();
+
+signals:
+    void peerJoined(const ClipSharePeer&);
+    void peerLeft(const ClipSharePeer&);
+
+private:
+    int survivalTimeout;
+    QMap<quint64, ClipSharePeer> registry;
+    QTimer expireTimer{ this };
+};
@@ -0,0 +1,34 @@
+﻿#include <algorithm>
+#include "ClipShareRateLimit.h"
+
+ClipShareTokenBucket::ClipShareTokenBucket(double rate, double burst, std::int64_t now)
+    : tokens(burst)
+    , burst(burst)
+    , tokensPerNanosecond(rate / 1e9)
+    , last(now)
+{
+}
+
+bool ClipShareTokenBucket::take(std::int64_t now, double cost)
+{
+    refill(now);
+    if (tokens < cost)
+        return false;
+
+    tokens -= cost;
+    return true;
+}
+
+bool ClipShareTokenBucket::idle(std::int64_t now) const
+{
+    return tokens + (now - last) * tokensPerNanosecond >= burst;
+}
+
+void ClipShareTokenBucket::refill(std::int64_t now)
+{
+    if (now > last)
+    {
+        tokens = std::min(burst, tokens + (now - last) * tokensPerNanosecond);
+        last = now;
+    }
+}
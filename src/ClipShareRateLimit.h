@@ -0,0 +1,84 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+/// <summary>
+/// Token bucket over a monotonic nanosecond clock (ClipShareTrace::now()).
+/// Starts full, refills rate tokens per second up to burst.
+/// </summary>
+class ClipShareTokenBucket
+{
+public:
+    ClipShareTokenBucket(double rate = 1, double burst = 1, std::int64_t now = 0);
+
+    bool take(std::int64_t now, double cost = 1);
+
+    // the bucket refilled completely, it can be forgotten without changing any decision
+    bool idle(std::int64_t now) const;
+
+private:
+    void refill(std::int64_t now);
+
+    double tokens;
+    double burst;
+    double tokensPerNanosecond;
+    std::int64_t last;
+};
+
+/// <summary>
+/// A token bucket per source, at most maxSources of them in least recently used order.
+/// A new source replaces the least recently seen one only once its bucket is idle,
+/// a flood of spoofed sources is rejected in constant time instead of scanning the table.
+/// </summary>
+template <typename Key, typename Hash = std::hash<Key>>
+class ClipShareSourceLimiter
+{
+public:
+    ClipShareSourceLimiter(double rate, double burst, int maxSources)
+        : rate(rate)
+        , burst(burst)
+        , maxSources(maxSources)
+    {
+    }
+
+    bool take(const Key& source, std::int64_t now, double cost = 1)
+    {
+        auto it = index.find(source);
+        if (it != index.end())
+        {
+            sources.splice(sources.begin(), sources, it->second);
+            return it->second->second.take(now, cost);
+        }
+
+        if (maxSources <= 0)
+            return false;
+        if (static_cast<int>(sources.size()) >= maxSources)
+        {
+            // the least recently seen source had the longest to refill, when it has not the table is busy
+            if (!sources.back().second.idle(now))
+                return false;
+            index.erase(sources.back().first);
+            sources.splice(sources.begin(), sources, std::prev(sources.end()));
+            sources.front() = { source, ClipShareTokenBucket{ rate, burst, now } };
+        }
+        else
+            sources.emplace_front(source, ClipShareTokenBucket{ rate, burst, now });
+        index.emplace(source, sources.begin());
+        return sources.front().second.take(now, cost);
+    }
+
+    int size() const { return static_cast<int>(sources.size()); }
+
+private:
+    using Sources = std::list<std::pair<Key, ClipShareTokenBucket>>;
+
+    double rate;
+    double burst;
+    int maxSources;
+    Sources sources;        // most recently seen first
+    std::unordered_map<Key, typename Sources::iterator, Hash> index;
+};
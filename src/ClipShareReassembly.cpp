@@ -0,0 +1,114 @@
+﻿#include "ClipShareReassembly.h"
+#include <limits>
+
+QList<QByteArray> ClipShareReassembly::fragment(quint64 nodeId, quint64 sequence, const QByteArray& payload)
+{
+    ClipShareClipDatagram datagram;
+    datagram.command = ClipShareClipDatagram::Fragment;
+    datagram.nodeId = nodeId;
+    datagram.sequence = sequence;
+    datagram.count = static_cast<quint32>(qMax(1, (payload.size() + FragmentSize - 1) / FragmentSize));
+
+    QList<QByteArray> fragments;
+    fragments.reserve(static_cast<int>(datagram.count));
+    for (quint32 i = 0; i < datagram.count; ++i)
+    {
+        datagram.index = i;
+        datagram.data = QByteArray::fromRawData(payload.constData() + i * FragmentSize, qMin(FragmentSize, payload.size() - static_cast<int>(i) * FragmentSize));
+        fragments.push_back(datagram.encode());
+    }
+    return fragments;
+}
+
+ClipShareReassembly::ClipShareReassembly(int maxPayload, qint64 maxPending)
+    : maxPayload(maxPayload), maxPending(maxPending)
+{
+}
+
+void ClipShareReassembly::evictOldest(quint64 keep)
+{
+    auto oldest = messages.end();
+    for (auto it = messages.begin(); it != messages.end(); ++it)
+    {
+        if (it.key() != keep && (oldest == messages.end() || it->firstFragmentAt < oldest->firstFragmentAt))
+            oldest = it;
+    }
+    if (oldest == messages.end())
+        return;
+    pending -= oldest->bytes;
+    messages.erase(oldest);
+}
+
+ClipShareReassembly::Result ClipShareReassembly::add(const ClipShareClipDatagram& fragment, qint64 receivedAt, QByteArray& payload, QVector<quint32>& missing, qint64* firstFragmentAt)
+{
+    // the message has to fit a QByteArray even without maxPayload
+    if (fragment.count == 0 || fragment.index >= fragment.count || fragment.count > static_cast<quint32>(std::numeric_limits<int>::max() / FragmentSize))
+        return Rejected;
+    if (fragment.data.size() > FragmentSize || (maxPayload > 0 && static_cast<qint64>(fragment.count) * FragmentSize > maxPayload + FragmentSize))
+        return Rejected;
+
+    auto it = messages.find(fragment.nodeId);
+    if (it != messages.end() && fragment.sequence < it->sequence)
+        return Rejected;
+
+    if (it == messages.end() || fragment.sequence > it->sequence || it->parts.size() != static_cast<int>(fragment.count))
+    {
+        if (it == messages.end() && messages.size() >= MaxOrigins)
+            evictOldest(fragment.nodeId);
+        if (it != messages.end())
+            pending -= it->bytes;
+        else
+            it = messages.insert(fragment.nodeId, Message{});
+
+        *it = Message{};
+        it->sequence = fragment.sequence;
+        it->parts.resize(static_cast<int>(fragment.count));
+        it->firstFragmentAt = receivedAt;
+    }
+
+    auto& part = it->parts[static_cast<int>(fragment.index)];
+    if (part.isNull())
+    {
+        // fragments are not rate limited, the memory they hold is
+        while (maxPending > 0 && pending + fragment.data.size() > maxPending && messages.size() > 1)
+            evictOldest(fragment.nodeId);
+        if (maxPending > 0 && pending + fragment.data.size() > maxPending)
+            return Rejected;
+
+        // detach from the receive buffer the datagram was parsed from
+        part = QByteArray(fragment.data.constData(), fragment.data.size());
+        ++it->received;
+        it->bytes += part.size();
+        pending += part.size();
+    }
+
+    if (it->received == it->parts.size())
+    {
+        payload.clear();
+        payload.reserve(static_cast<int>(it->bytes));
+        for (auto& data : it->parts)
+            payload.append(data);
+        if (firstFragmentAt != nullptr)
+            *firstFragmentAt = it->firstFragmentAt;
+        pending -= it->bytes;
+        messages.erase(it);
+        return Complete;
+    }
+
+    // only the last fragment tells that everything should be here by now
+    if (fragment.index + 1 != fragment.count)
+        return Incomplete;
+
+    missing.clear();
+    for (int i = 0; i < it->parts.size() && missing.size() < MaxNackIndices; ++i)
+    {
+        if (it->parts[i].isNull())
+            missing.push_back(static_cast<quint32>(i));
+    }
+    return Missing;
+}
+
+qint64 ClipShareReassembly::pendingBytes() const
+{
+    return pending;
+}
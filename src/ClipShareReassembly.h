@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QVector>
+#include "ClipSharePackage.h"
+
+/// <summary>
+/// Multicast clips: the sender cuts the encoded package into Fragment datagrams,
+/// receivers collect them per origin and report what is missing once the last
+/// fragment (or the sender's poll, which repeats it) arrived.
+/// A newer sequence of the same origin replaces an incomplete one.
+/// Beyond MaxOrigins or maxPending bytes the origin whose message started first is dropped.
+/// </summary>
+class ClipShareReassembly
+{
+public:
+    static constexpr int FragmentSize{ 1200 };
+    static constexpr int MaxDatagramSize{ FragmentSize + 64 };     // with the fragment header
+    static constexpr int MaxNackIndices{ 256 };
+    static constexpr int MaxOrigins{ 64 };
+
+    static QList<QByteArray> fragment(quint64 nodeId, quint64 sequence, const QByteArray& payload);
+
+    // maxPayload and maxPending 0 accept any size
+    explicit ClipShareReassembly(int maxPayload = 0, qint64 maxPending = 0);
+
+    enum Result
+    {
+        Incomplete,
+        Complete,   // payload holds the message
+        Missing,    // missing holds the indices to Nack
+        Rejected    // too large, or an older sequence
+    };
+
+    // a fragment whose index or count does not make sense is Rejected
+    Result add(const ClipShareClipDatagram& fragment, qint64 receivedAt, QByteArray& payload, QVector<quint32>& missing, qint64* firstFragmentAt = nullptr);
+
+    // bytes of incomplete messages
+    qint64 pendingBytes() const;
+
+private:
+    // the origin whose message started first, except keep
+    void evictOldest(quint64 keep);
+
+    struct Message
+    {
+        quint64 sequence{ 0 };
+        QVector<QByteArray> parts;
+        int received{ 0 };
+        qint64 bytes{ 0 };
+        qint64 firstFragmentAt{ 0 };
+    };
+
+    int maxPayload;
+    qint64 maxPending;
+    QHash<quint64, Message> messages;   // by origin
+    qint64 pending{ 0 };
+};
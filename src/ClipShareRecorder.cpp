@@ -0,0 +1,88 @@
+﻿#include "ClipShareLog.h"
+#include "Adapter.h"
+#include "ClipShareRecorder.h"
+
+bool ClipShareRecorder::open(const QString& path)
+{
+    file.setFileName(path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+    {
+        ClipShareLog::recorder().error("[Recorder] Cannot write {}: {}", path, file.errorString());
+        return false;
+    }
+
+    stream.setDevice(&file);
+    stream.setVersion(QDataStream::Qt_5_12);
+    stream << Magic << Version;
+    ClipShareLog::recorder().info("[Recorder] Recording clipboard to {}", path);
+    return true;
+}
+
+bool ClipShareRecorder::isOpen() const
+{
+    return file.isOpen();
+}
+
+void ClipShareRecorder::record(const ClipShareSnapshot& snapshot)
+{
+    if (!file.isOpen())
+        return;
+    if (!clock.isValid())
+        clock.start();
+
+    stream << clock.elapsed() << static_cast<quint32>(snapshot.formats.size());
+    for (int i = 0; i < snapshot.formats.size() && i < snapshot.data.size(); ++i)
+        stream << snapshot.formats[i] << qCompress(snapshot.data[i]);
+    file.flush();
+}
+
+QVector<ClipShareSnapshot> ClipShareRecorder::load(const QString& path, bool* ok)
+{
+    QVector<ClipShareSnapshot> snapshots;
+    if (ok != Q_NULLPTR)
+        *ok = false;
+
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+    {
+        ClipShareLog::recorder().error("[Recorder] Cannot read {}: {}", path, file.errorString());
+        return snapshots;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_12);
+    quint32 magic = 0;
+    quint16 version = 0;
+    stream >> magic >> version;
+    if (magic != Magic || version != Version)
+    {
+        ClipShareLog::recorder().error("[Recorder] {} is not a clipboard recording", path);
+        return snapshots;
+    }
+
+    while (!stream.atEnd())
+    {
+        ClipShareSnapshot snapshot;
+        quint32 count = 0;
+        stream >> snapshot.elapsed >> count;
+        for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i)
+        {
+            QString format;
+            QByteArray data;
+            stream >> format >> data;
+            snapshot.formats.push_back(format);
+            snapshot.data.push_back(qUncompress(data));
+        }
+        if (stream.status() != QDataStream::Ok)
+        {
+            // a recording cut by a crash keeps its complete snapshots
+            ClipShareLog::recorder().warn("[Recorder] {} truncated after {} snapshots", path, snapshots.size());
+            break;
+        }
+        snapshots.push_back(snapshot);
+    }
+
+    if (ok != Q_NULLPTR)
+        *ok = true;
+    return snapshots;
+}
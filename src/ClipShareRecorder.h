@@ -0,0 +1,32 @@
+﻿#pragma once
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QDataStream>
+#include <QVector>
+
+#include "ClipShareClipboard.h"
+
+/// <summary>
+/// Appends clipboard snapshots with their timing to a compact file,
+/// replayed later through ClipShareVirtualClipboard.
+/// File: "CSRC" magic, version, then per snapshot the ms since the first one
+/// and every format with its zlib compressed bytes.
+/// </summary>
+class ClipShareRecorder
+{
+public:
+    static constexpr quint32 Magic{ 0x43535243 };
+    static constexpr quint16 Version{ 1 };
+
+    bool open(const QString& path);
+    bool isOpen() const;
+    void record(const ClipShareSnapshot&);
+
+    static QVector<ClipShareSnapshot> load(const QString& path, bool* ok = Q_NULLPTR);
+
+private:
+    QFile file;
+    QDataStream stream;
+    QElapsedTimer clock;
+};
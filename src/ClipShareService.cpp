@@ -0,0 +1,170 @@
+﻿#include <QMimeData>
+#include <QHostInfo>
+#include "ClipShareLog.h"
+#include "ClipShareMetrics.h"
+#include "ClipShareService.h"
+
+ClipShareService::ClipShareService(QObject *parent)
+    : ClipShareService(ClipShareConfig{}, Q_NULLPTR, parent)
+{
+}
+
+ClipShareService::ClipShareService(const ClipShareConfig& config, QObject *parent)
+    : ClipShareService(config, Q_NULLPTR, parent)
+{
+}
+
+ClipShareService::ClipShareService(const ClipShareConfig& config, ClipShareClipboard* clipboard, QObject *parent)
+    : QObject(parent)
+    , config{ config }
+    , clipboard{ clipboard != Q_NULLPTR ? clipboard : new ClipShareSystemClipboard(this) }
+    , transport{ config, this }
+    , fileTransfer{ config, this }
+{
+    ClipShareLog::config().info("[Config] Heartbeat Port = {}", config.heartbeatPort);
+    ClipShareLog::config().info("[Config] Heartbeat Interval = {}", config.heartbeatInterval);
+    ClipShareLog::config().info("[Config] Heartbeat Multicast Group Host = {}", config.heartbeatMulticastGroupHost);
+    ClipShareLog::config().info("[Config] Package Port = {}", config.packagePort);
+    ClipShareLog::config().info("[Config] Metrics Port = {}", config.metricsPort);
+
+    if (!config.recordFile.isEmpty())
+        recorder.open(config.recordFile);
+
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.describe("clipshare_encode_microseconds", "Time spent in encodeMimeData.");
+    metrics.describe("clipshare_peers", "Peers currently known from heartbeats.");
+    metrics.addCollector("latency", [this](std::string& out) { latency.expose(out); });
+
+    auto updatePeerCount = [this] { ClipShareMetrics::instance().set("clipshare_peers", {}, transport.getPeerRegistry().count()); };
+    connect(&transport.getPeerRegistry(), &ClipSharePeerRegistry::peerJoined, this, updatePeerCount);
+    connect(&transport.getPeerRegistry(), &ClipSharePeerRegistry::peerLeft, this, updatePeerCount);
+
+    connect(&transport, &ClipShareTransport::packageReceived, this, &ClipShareService::handlePackageReceived);
+    connect(&fileTransfer, &ClipShareFileTransfer::fetched, this, &ClipShareService::applyPackage);
+    connect(this->clipboard, &ClipShareClipboard::dataChanged, this, &ClipShareService::handleClipboardChanged);
+}
+
+bool ClipShareService::start()
+{
+    if (config.metricsPort > 0)
+    {
+        metricsServer.reset(new ClipShareMetricsServer);
+        metricsServer->start("127.0.0.1", config.metricsPort);
+    }
+    // without it copied files go out as URLs only
+    fileTransfer.listen();
+    return transport.start();
+}
+
+ClipShareService::~ClipShareService()
+{
+    // stop scraping before the collected objects go away
+    metricsServer.reset();
+    ClipShareMetrics::instance().removeCollector("latency");
+}
+
+const ClipShareConfig& ClipShareService::getConfig() const
+{
+    return config;
+}
+
+ClipShareClipboard& ClipShareService::getClipboard()
+{
+    return *clipboard;
+}
+
+ClipShareTransport& ClipShareService::getTransport()
+{
+    return transport;
+}
+
+const ClipShareLatencyTracker& ClipShareService::getLatency() const
+{
+    return latency;
+}
+
+void ClipShareService::handleClipboardChanged()
+{
+    auto captureAt = ClipShareTrace::now();
+    auto mimeData = clipboard->mimeData();
+
+    // our own echo of a received package
+    if (applyingPackage || (clipboard->ownsClipboard() && mimeData == appliedMimeData))
+        return;
+
+    if (recorder.isOpen())
+        recorder.record(ClipShareSnapshot::capture(mimeData));
+
+    // mimeData->data() copies every format, only pay for it when the dump is wanted
+    if (ClipShareLog::clipboard().should_log(spdlog::level::trace))
+    {
+        auto formats = mimeData->formats();
+        ClipShareLog::clipboard().trace("[Clipboard][MimeData] contains {} formats", formats.count());
+        for (auto& key : formats)
+        {
+            auto val = mimeData->data(key);
+            ClipShareLog::clipboard().trace("[Clipboard][MimeData] {} = [{}bytes]{}", key, val.size(), ClipShareLog::payload(val));
+        }
+    }
+
+    emit clipboardChanged(mimeData);
+    // a clip still fetching its files must not replace this one
+    fileTransfer.cancel();
+
+    ClipSharePackage package;
+    package.trace.stamp(ClipShareTrace::Capture, captureAt);
+
+    package.encodeMimeData(mimeData, fileTransfer.listening());
+    if (fileTransfer.listening())
+    {
+        // the previous clip's files are not served any more
+        package.fileToken = fileTransfer.offer(package.filePaths);
+        package.filePort = package.filePaths.isEmpty() ? 0 : fileTransfer.port();
+    }
+    package.trace.stamp(ClipShareTrace::Encode);
+    ClipShareMetrics::instance().observe("clipshare_encode_microseconds", {}
+        , (package.trace.stamps[ClipShareTrace::Encode] - captureAt) / 1000);
+
+    package.sender = QHostInfo::localHostName();
+    package.receiver = QHostAddress(config.heartbeatMulticastGroupHost).toString();
+    transport.send(package);
+}
+
+void ClipShareService::handlePackageReceived(const QTcpSocket*conn, const ClipSharePackage& package)
+{
+    auto peer = transport.getPeerRegistry().peer(package.origin);
+    ClipShareLog::transport().info("[Server] Receive: {}, from {}:{} {}", package.mimeFormats.join("; ")
+        , conn != nullptr ? conn->peerAddress().toString() : peer.address.toString()
+        , conn != nullptr ? conn->peerPort() : peer.heartbeatPort, package.sender);
+
+    // files come on connections of their own to the origin, the clip follows once they are here
+    if (!package.fileNames.isEmpty() && package.filePort != 0 && !peer.address.isNull())
+    {
+        fileTransfer.fetch(peer.address, package);
+        return;
+    }
+    fileTransfer.cancel();
+    applyPackage(package);
+}
+
+void ClipShareService::applyPackage(const ClipSharePackage& package)
+{
+    auto peer = transport.getPeerRegistry().peer(package.origin);
+    auto mimeData = package.decodeMimeData();
+    applyingPackage = true;
+    appliedMimeData = mimeData;
+    clipboard->setMimeData(mimeData);
+    applyingPackage = false;
+
+    auto applied = package;
+    applied.trace.stamp(ClipShareTrace::Applied);
+
+    // receiver stages can only be compared once the origin answered a heartbeat
+    if (peer.roundTrip >= 0)
+    {
+        latency.record(package.origin, applied.trace, peer.clockOffset);
+        ClipShareLog::metrics().debug("[Latency] {:016x} copy to paste {}", package.origin, latency.summary(package.origin));
+    }
+
+    emit packageReceived(applied);
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <QObject>
+#include <QMimeData>
+#include <memory>
+
+#include "ClipShareClipboard.h"
+#include "ClipShareConfig.h"
+#include "ClipShareFileTransfer.h"
+#include "ClipShareLatency.h"
+#include "ClipShareMetricsServer.h"
+#include "ClipShareRecorder.h"
+#include "ClipSharePackage.h"
+#include "ClipShareTransport.h"
+
+/// <summary>
+/// Clipboard capture on top of the transport, without any widget.
+/// Shared by the tray window and the headless daemon.
+/// </summary>
+class ClipShareService : public QObject
+{
+    Q_OBJECT
+
+public:
+    ClipShareService(QObject *parent = Q_NULLPTR);
+    // without a clipboard the service uses (and owns) the system clipboard
+    ClipShareService(const ClipShareConfig& config, ClipShareClipboard* clipboard = Q_NULLPTR, QObject *parent = Q_NULLPTR);
+    ClipShareService(const ClipShareConfig& config, QObject *parent);
+    ~ClipShareService();
+
+    // listen, heartbeat and serve metrics; without it the service only encodes
+    bool start();
+
+    const ClipShareConfig& getConfig() const;
+    ClipShareClipboard& getClipboard();
+    ClipShareTransport& getTransport();
+    const ClipShareLatencyTracker& getLatency() const;
+
+signals:
+
+    void clipboardChanged(const QMimeData*);
+    void packageReceived(const ClipSharePackage&);
+
+public slots:
+
+    void handleClipboardChanged();
+    void handlePackageReceived(const QTcpSocket*, const ClipSharePackage&);
+
+protected:
+    // put on the clipboard, once its files are fetched
+    void applyPackage(const ClipSharePackage&);
+
+    ClipShareConfig config{};
+    ClipShareClipboard* clipboard;
+
+    ClipShareTransport transport;
+    ClipShareFileTransfer fileTransfer;
+    ClipShareLatencyTracker latency;
+    std::unique_ptr<ClipShareMetricsServer> metricsServer;
+    ClipShareRecorder recorder;
+
+    // set while a received package is put on the clipboard, so it is not sent back
+    bool applyingPackage{ false };
+    const QMimeData* appliedMimeData{ nullptr };
+};
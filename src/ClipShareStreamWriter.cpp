@@ -0,0 +1,159 @@
+﻿#include <QIODevice>
+#include "ClipShareFrame.h"
+#include "ClipShareStreamWriter.h"
+
+ClipShareStreamWriter::ClipShareStreamWriter(QIODevice* device)
+    : device(device)
+{
+}
+
+quint32 ClipShareStreamWriter::allocateStream()
+{
+    auto stream = nextStream++;
+    if (nextStream == ClipShareChunkHeader::ControlStream)
+        ++nextStream;
+    return stream;
+}
+
+quint32 ClipShareStreamWriter::enqueue(const QByteArray& payload, quint8 priority)
+{
+    auto stream = allocateStream();
+    queue.push_back(Pending{ stream, priority, payload });
+    queued += payload.size();
+    pump();
+    return stream;
+}
+
+quint32 ClipShareStreamWriter::open(quint8 priority)
+{
+    auto stream = allocateStream();
+    Pending pending{ stream, priority };
+    pending.open = true;
+    queue.push_back(pending);
+    return stream;
+}
+
+bool ClipShareStreamWriter::append(quint32 stream, const QByteArray& data, bool end)
+{
+    for (auto& pending : queue)
+    {
+        if (pending.stream != stream || !pending.open)
+            continue;
+
+        // what was written already is not needed any more, relayed messages can be large
+        if (pending.offset > 0)
+        {
+            pending.payload.remove(0, pending.offset);
+            pending.offset = 0;
+        }
+        pending.payload.append(data);
+        pending.open = !end;
+        queued += data.size();
+        pump();
+        return true;
+    }
+    return false;
+}
+
+bool ClipShareStreamWriter::cancel(quint32 stream, qint64* releasedBytes)
+{
+    for (int i = 0; i < queue.size(); ++i)
+    {
+        if (queue[i].stream != stream)
+            continue;
+        writeCancel(queue[i]);
+        auto released = queue[i].payload.size() - queue[i].offset;
+        queued -= released;
+        if (releasedBytes != nullptr)
+            *releasedBytes = released;
+        queue.removeAt(i);
+        return true;
+    }
+    return false;
+}
+
+void ClipShareStreamWriter::writeCancel(const Pending& pending)
+{
+    // the receiver never saw the ones that did not start
+    if (pending.started && device != nullptr)
+    {
+        ClipShareChunkHeader header;
+        header.stream = pending.stream;
+        header.flags = ClipShareChunkHeader::Cancel;
+        device->write(ClipShareFrame::encodeHeader(header));
+    }
+}
+
+QList<quint32> ClipShareStreamWriter::cancelAll(qint64* releasedBytes)
+{
+    QList<quint32> cancelled;
+    for (auto& pending : queue)
+    {
+        writeCancel(pending);
+        cancelled.push_back(pending.stream);
+    }
+
+    if (releasedBytes != nullptr)
+        *releasedBytes = queued;
+    queue.clear();
+    queued = 0;
+    return cancelled;
+}
+
+void ClipShareStreamWriter::writeControl(const QByteArray& payload)
+{
+    if (device != nullptr)
+        device->write(ClipShareFrame::encode(payload, ClipShareChunkHeader::ControlStream));
+}
+
+void ClipShareStreamWriter::pump()
+{
+    while (device != nullptr && !queue.isEmpty() && device->bytesToWrite() < LowWatermark)
+    {
+        // first of the most urgent priority, sent ones move to the back to take turns.
+        // An open message waiting for more of its payload is skipped
+        int pick = -1;
+        for (int i = 0; i < queue.size(); ++i)
+        {
+            if (queue[i].open && queue[i].offset == queue[i].payload.size())
+                continue;
+            if (pick < 0 || queue[i].priority < queue[pick].priority)
+                pick = i;
+        }
+        if (pick < 0)
+            break;
+
+        auto& pending = queue[pick];
+        auto length = qMin(ChunkSize, pending.payload.size() - pending.offset);
+
+        ClipShareChunkHeader header;
+        header.stream = pending.stream;
+        header.priority = pending.priority;
+        header.length = static_cast<quint32>(length);
+        if (!pending.started)
+            header.flags |= ClipShareChunkHeader::Begin;
+        if (!pending.open && pending.offset + length == pending.payload.size())
+            header.flags |= ClipShareChunkHeader::End;
+        pending.started = true;
+
+        device->write(ClipShareFrame::encodeHeader(header));
+        device->write(pending.payload.constData() + pending.offset, length);
+        pending.offset += length;
+        queued -= length;
+
+        if (header.flags & ClipShareChunkHeader::End)
+            queue.removeAt(pick);
+        else
+            queue.move(pick, queue.size() - 1);
+    }
+}
+
+qint64 ClipShareStreamWriter::queuedBytes() const
+{
+    return queued;
+}
+
+int ClipShareStreamWriter::queuedMessages() const
+{
+    return queue.size();
+}
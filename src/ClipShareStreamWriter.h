@@ -0,0 +1,67 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include "ClipShareChunk.h"
+
+class QIODevice;
+
+/// <summary>
+/// Sending side of a multiplexed peer connection.
+/// Queued messages are cut into chunks and only handed to the socket while
+/// little is waiting in it, so a message queued later with a lower priority
+/// value overtakes the rest of a large one. Equal priorities take turns.
+/// </summary>
+class ClipShareStreamWriter
+{
+public:
+    static constexpr int ChunkSize{ 16 * 1024 };
+    static constexpr qint64 LowWatermark{ 64 * 1024 };    // socket bytesToWrite() we keep filled
+
+    explicit ClipShareStreamWriter(QIODevice* device = nullptr);
+
+    // returns the stream id of the message
+    quint32 enqueue(const QByteArray& payload, quint8 priority);
+
+    // a message whose payload arrives in parts, see append(), returns its stream id
+    quint32 open(quint8 priority);
+    // more of an open message, end completes it. False once the stream is no longer queued
+    bool append(quint32 stream, const QByteArray& data, bool end);
+
+    // drop one queued message, cancelled on the receiver if it started
+    // releasedBytes gets the bytes that will not be sent
+    bool cancel(quint32 stream, qint64* releasedBytes = nullptr);
+
+    // drop every queued message, the ones partially written are cancelled on the receiver too
+    // returns their stream ids, releasedBytes gets the bytes that will not be sent
+    QList<quint32> cancelAll(qint64* releasedBytes = nullptr);
+
+    // single chunk on the control stream, ahead of everything queued
+    void writeControl(const QByteArray& payload);
+
+    // call whenever the socket wrote something
+    void pump();
+
+    // bytes of queued messages not handed to the socket yet
+    qint64 queuedBytes() const;
+    int queuedMessages() const;
+
+private:
+    struct Pending
+    {
+        quint32 stream;
+        quint8 priority;
+        QByteArray payload;
+        int offset{ 0 };
+        bool open{ false };     // append() may still add to payload
+        bool started{ false };  // its Begin chunk was written
+    };
+
+    quint32 allocateStream();
+    void writeCancel(const Pending&);
+
+    QIODevice* device;
+    QList<Pending> queue;
+    quint32 nextStream{ ClipShareChunkHeader::ControlStream + 1 };
+    qint64 queued{ 0 };
+};
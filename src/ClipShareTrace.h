@@ -0,0 +1,52 @@
+﻿#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+/// <summary>
+/// Monotonic timestamps (ns) of a clip on its way from one clipboard to another.
+/// The sender stamps the first stages before the package is serialized,
+/// the receiver stamps the rest in its own clock.
+/// </summary>
+struct ClipShareTrace
+{
+    enum Stage
+    {
+        Capture,        // dataChanged on the origin
+        Encode,         // encodeMimeData done
+        Enqueue,        // handed to the transport
+        Write,          // serialized, written to the sockets
+        FirstByte,      // first byte of the frame received
+        FrameComplete,  // whole frame received
+        Decoded,        // package parsed
+        Applied,        // set on the receiving clipboard
+        StageCount
+    };
+
+    std::array<std::int64_t, StageCount> stamps{};
+
+    static std::int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static const char* stageName(int stage)
+    {
+        static const char* names[StageCount]{ "capture", "encode", "enqueue", "write", "first_byte", "frame_complete", "decoded", "applied" };
+        return stage >= 0 && stage < StageCount ? names[stage] : "unknown";
+    }
+
+    void stamp(Stage stage, std::int64_t at = now())
+    {
+        stamps[stage] = at;
+    }
+
+    bool has(Stage stage) const
+    {
+        return stamps[stage] != 0;
+    }
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ClipShareTrace, stamps);
+};
@@ -0,0 +1,1497 @@
+﻿#include <QRandomGenerator>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "ClipShareLog.h"
+#include <spdlog/fmt/bin_to_hex.h>
+#include "ClipShareMetrics.h"
+#include "ClipShareTransport.h"
+
+ClipShareTransport::ClipShareTransport(const ClipShareConfig& config, QObject *parent)
+    : QObject(parent)
+    , config{ config }
+    , nodeId{ QRandomGenerator::global()->generate64() }
+    , peerRegistry{ config.heartbeatSuvivalTimeout, this }
+    , hostId{ ClipShareLocalChannel::hostId(config.localHostId) }
+    , localChannel{ nodeId, config.localRingSize, this }
+    , reassembly{ config.packageMaxFrameBytes, config.packageMaxTotalBufferedBytes }
+    , heartbeatSources{ config.heartbeatRateLimit, static_cast<double>(config.heartbeatRateBurst), config.heartbeatMaxSources }
+    , clipSources{ config.heartbeatRateLimit, static_cast<double>(config.heartbeatRateBurst), config.heartbeatMaxSources }
+    , nackSources{ config.heartbeatRateLimit, static_cast<double>(config.heartbeatRateBurst), config.heartbeatMaxSources }
+{
+    connect(&packageReciver, &QTcpServer::newConnection, this, &ClipShareTransport::acceptConnections);
+    connect(&heartbeatBroadcaster, &QUdpSocket::readyRead, this, &ClipShareTransport::readDatagrams);
+    connect(&peerRegistry, &ClipSharePeerRegistry::peerLeft, this, &ClipShareTransport::disconnectPeer);
+    connect(&localChannel, &ClipShareLocalChannel::clipReceived, this, &ClipShareTransport::readLocalClip);
+
+    // what peers are to send us, see ClipShareFormatsPackage
+    ClipShareFormatsPackage formats;
+    formats.formats = config.acceptFormats.isEmpty() ? ClipSharePackage::defaultAcceptedFormats() : config.acceptFormats;
+    acceptedFormats = ClipShareFrame::encode(formats.encode(), ClipShareChunkHeader::ControlStream);
+
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.describe("clipshare_clips_sent_total", "Clips written to peers, once per peer.");
+    metrics.describe("clipshare_clips_received_total", "Clips received from peers.");
+    metrics.describe("clipshare_sent_bytes_total", "Encoded bytes written to peers by format.");
+    metrics.describe("clipshare_received_bytes_total", "Encoded bytes received from peers by format.");
+    metrics.describe("clipshare_package_parse_failures_total", "Received frames that were not a valid package.");
+    metrics.describe("clipshare_send_queue_bytes", "Bytes waiting in the peer sockets and their stream queues.");
+    metrics.describe("clipshare_clips_cancelled_total", "Clips superseded while queued or in flight, by side.");
+    metrics.describe("clipshare_cancelled_bytes_total", "Queued bytes released without being sent because a newer clip superseded them.");
+    metrics.describe("clipshare_clips_superseded_total", "Received clips dropped because a newer one of the same origin was already delivered.");
+    metrics.describe("clipshare_fastpath_datagrams_total", "Fast path datagrams by kind: clip, retry or ack.");
+    metrics.describe("clipshare_fastpath_fallbacks_total", "Fast path clips a peer never acknowledged, sent on the stream connection instead.");
+    metrics.describe("clipshare_multicast_clips_total", "Clips multicast as fragments to the group.");
+    metrics.describe("clipshare_multicast_fragments_total", "Fragment datagrams written, retransmissions included.");
+    metrics.describe("clipshare_multicast_nacks_total", "Negative acknowledgements sent or received.");
+    metrics.describe("clipshare_delta_clips_total", "Text clips sent or applied as a delta, or sent again because the receiver lacked the base.");
+    metrics.describe("clipshare_peer_saved_bytes_total", "Bytes not written to peers because their copy left out formats they do not accept or carried deltas.");
+    metrics.describe("clipshare_overlay_clips_total", "Clips sent down the overlay tree.");
+    metrics.describe("clipshare_overlay_relayed_bytes_total", "Bytes of other nodes' tree clips forwarded to our children.");
+    metrics.describe("clipshare_overlay_repaired_total", "Tree clips sent again directly to members that did not report them.");
+    metrics.describe("clipshare_delivery_microseconds", "Time from queueing a clip for a peer until the peer acknowledged it.");
+    metrics.describe("clipshare_receive_buffer_bytes", "Bytes of incomplete frames held for peers.");
+    metrics.describe("clipshare_server_connections", "Accepted package connections.");
+    metrics.describe("clipshare_server_evictions_total", "Package connections closed by reason: limit, frame_size, buffer, memory, idle or stalled.");
+    metrics.addCollector("heartbeat", [this](std::string& out) { exposeDrops(out); });
+
+    // setup heartbeat sender
+    heartbeatTimer.setInterval(config.heartbeatInterval);
+    connect(&heartbeatTimer, &QTimer::timeout, this, &ClipShareTransport::broadcastHeartbeat);
+
+    // one timer for all connections, eviction only needs to be roughly on time
+    auto shortest = config.packageIdleTimeout <= 0 ? config.packageStallTimeout
+        : config.packageStallTimeout <= 0 ? config.packageIdleTimeout
+        : qMin(config.packageIdleTimeout, config.packageStallTimeout);
+    connectionSweepTimer.setInterval(qMax(1000, shortest / 4));
+    connect(&connectionSweepTimer, &QTimer::timeout, this, &ClipShareTransport::evictIdleConnections);
+    connect(&fastPathTimer, &QTimer::timeout, this, &ClipShareTransport::retryDatagram);
+    connect(&multicastTimer, &QTimer::timeout, this, &ClipShareTransport::sendFragments);
+    overlayRepairTimer.setSingleShot(true);
+    overlayRepairTimer.setInterval(qMax(1, config.overlayRepairTimeout));
+    connect(&overlayRepairTimer, &QTimer::timeout, this, &ClipShareTransport::repairOverlay);
+    multicastTimer.setTimerType(Qt::PreciseTimer);
+    gossipTimer.setInterval(qMax(1, config.gossipInterval));
+    connect(&gossipTimer, &QTimer::timeout, this, &ClipShareTransport::gossipLatest);
+}
+
+ClipShareTransport::~ClipShareTransport()
+{
+    ClipShareMetrics::instance().removeCollector("heartbeat");
+}
+
+bool ClipShareTransport::start()
+{
+    ClipShareLog::transport().info("[Transport] Node id {:016x}.", nodeId);
+
+    // start package listen
+    if (!packageReciver.listen(QHostAddress::AnyIPv4, config.packagePort))
+    {
+        ClipShareLog::transport().error("[Server] Cannot listen on {}: {}", config.packagePort, packageReciver.errorString());
+        return false;
+    }
+    ClipShareLog::transport().info("[Server] Listen on {}.", packageReciver.serverPort());
+
+    // setup heartbeat response
+    if (!heartbeatBroadcaster.bind(QHostAddress::AnyIPv4, config.heartbeatPort, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint))
+    {
+        ClipShareLog::heartbeat().error("[Heartbeat] Cannot bind {}: {}", config.heartbeatPort, heartbeatBroadcaster.errorString());
+        return false;
+    }
+    heartbeatBroadcaster.joinMulticastGroup(QHostAddress(config.heartbeatMulticastGroupHost));
+    // instances sharing this network stack only see each other's heartbeats looped back, our own are dropped by node id
+    heartbeatBroadcaster.setSocketOption(QAbstractSocket::MulticastLoopbackOption, 1);
+
+    // without it same-host peers keep using TCP loopback
+    if (config.localRingSize > 0 && hostId != 0)
+        localChannel.listen();
+
+    // start timer
+    heartbeatTimer.start();
+    connectHub();
+    if (config.packageIdleTimeout > 0 || config.packageStallTimeout > 0)
+        connectionSweepTimer.start();
+    if (config.gossipFanout > 0)
+        gossipTimer.start();
+    // send heartbeat
+    broadcastHeartbeat();
+    return true;
+}
+
+quint64 ClipShareTransport::getNodeId() const
+{
+    return nodeId;
+}
+
+quint16 ClipShareTransport::getPackagePort() const
+{
+    return packageReciver.serverPort();
+}
+
+const ClipShareConfig& ClipShareTransport::getConfig() const
+{
+    return config;
+}
+
+ClipSharePeerRegistry& ClipShareTransport::getPeerRegistry()
+{
+    return peerRegistry;
+}
+
+void ClipShareTransport::send(ClipSharePackage package)
+{
+    package.trace.stamp(ClipShareTrace::Enqueue);
+    package.origin = nodeId;
+    package.sequence = ++sequence;
+    rememberBase(package);
+    lastSent = package;
+
+    // a clipboard holds one value, whatever is still queued is obsolete now
+    cancelQueued();
+
+    package.trace.stamp(ClipShareTrace::Write);
+    // shared memory beats any of the group paths, same-host peers get it first and the others leave them out
+    auto copies = sendLocal(package);
+    int grouped = 0;
+    if (!groupPeers().isEmpty())
+    {
+        // one copy for every receiver, only duplicate formats are left out
+        auto shared = package;
+        shared.pruneFormats({});
+        // gossip is chosen explicitly, it replaces the group and tree paths
+        grouped = sendGossip(shared);
+        if (grouped == 0)
+            grouped = sendDatagram(shared) || sendMulticast(shared) ? fastPath.unacked.size() : sendOverlay(shared);
+    }
+    // none of them applied, every other stream connection gets a copy
+    if (grouped == 0)
+        grouped = enqueue(package);
+    // the hub only has the stream connection, peers drop what they got both ways by sequence
+    else if (clientSockets.contains(HubNodeId))
+        grouped += enqueue(package, clientSockets.value(HubNodeId));
+    copies += grouped;
+
+    ClipShareMetrics::instance().increment("clipshare_clips_sent_total", {}, copies);
+    countFormatBytes("clipshare_sent_bytes_total", package, copies);
+    updateQueueDepth();
+}
+
+void ClipShareTransport::cancelQueued()
+{
+    auto& metrics = ClipShareMetrics::instance();
+    for (auto it = clientStreams.begin(); it != clientStreams.end(); ++it)
+    {
+        // only our own clips are superseded, the subtree below us still wants what we relay for others
+        qint64 released = 0;
+        int cancelled = 0;
+        for (auto stream : it->ownStreams)
+        {
+            qint64 bytes = 0;
+            if (!it->writer.cancel(stream, &bytes))
+                continue;
+            ++cancelled;
+            released += bytes;
+            it->unacked.remove(stream);
+            it->sequences.remove(stream);
+        }
+        it->ownStreams.clear();
+        if (cancelled > 0)
+        {
+            metrics.increment("clipshare_clips_cancelled_total", { { "side", "sender" } }, cancelled);
+            metrics.increment("clipshare_cancelled_bytes_total", {}, static_cast<double>(released));
+        }
+    }
+
+    if (!fastPath.unacked.isEmpty())
+        metrics.increment("clipshare_clips_cancelled_total", { { "side", "sender" } }, fastPath.unacked.size());
+    fastPath = FastPath{};
+    fastPathTimer.stop();
+    multicastTimer.stop();
+    overlay = Overlay{};
+    overlayRepairTimer.stop();
+}
+
+int ClipShareTransport::sendLocal(const ClipSharePackage& package)
+{
+    ringPeers.clear();
+    if (localChannel.connectedCount() == 0)
+        return 0;
+
+    // same host, copied once into each peer's ring instead of through loopback
+    auto shared = package;
+    shared.pruneFormats({});
+    auto payload = shared.encode();
+    for (auto it = clientSockets.cbegin(); it != clientSockets.cend(); ++it)
+    {
+        // a full ring leaves the peer to the other paths
+        if (it.key() != HubNodeId && localChannel.send(it.key(), payload))
+            ringPeers.insert(it.key());
+    }
+    return ringPeers.size();
+}
+
+QList<ClipSharePeer> ClipShareTransport::groupPeers() const
+{
+    QList<ClipSharePeer> peers;
+    for (auto& peer : peerRegistry.peers())
+    {
+        if (!ringPeers.contains(peer.nodeId))
+            peers.push_back(peer);
+    }
+    return peers;
+}
+
+int ClipShareTransport::enqueue(const ClipSharePackage& package, QTcpSocket* only)
+{
+    // for same-host peers and those that did not say what they accept
+    auto shared = package;
+    shared.pruneFormats({});
+    auto payload = shared.encode();
+    // gossiped clips are passed on as they are, a delta only makes sense to the peer that has its base
+    auto delta = package.origin == nodeId && config.deltaMinSize > 0 && config.gossipFanout <= 0;
+    QHash<QString, QPair<QByteArray, bool>> payloads;
+    auto enqueuedAt = ClipShareTrace::now();
+    int copies = 0;
+    for (auto it = clientSockets.cbegin(); it != clientSockets.cend(); ++it)
+    {
+        if (only != nullptr && it.value() != only)
+            continue;
+        // sent through the ring already, see sendLocal()
+        if (only == nullptr && ringPeers.contains(it.key()))
+            continue;
+        auto client = clientStreams.find(it.value());
+        if (client != clientStreams.end() && it.value()->state() == QAbstractSocket::ConnectedState)
+        {
+            // the hub passes clips on to nodes that never saw the base
+            auto bytes = it.key() != HubNodeId ? peerPayload(package, *client, delta, payload, payloads) : payload;
+            // small clips overtake whatever large one is still being written
+            quint8 priority = bytes.size() <= SmallClipSize ? ClipPriority : LargeClipPriority;
+            auto stream = client->writer.enqueue(bytes, priority);
+            client->unacked.insert(stream, enqueuedAt);
+            client->sequences.insert(stream, package.sequence);
+            if (package.origin == nodeId)
+                client->ownStreams.insert(stream);
+            ++copies;
+        }
+    }
+    return copies;
+}
+
+bool ClipShareTransport::sendDatagram(const ClipSharePackage& package)
+{
+    // the datagram carries text formats only, an image or a file offer goes as a whole package
+    if (config.fastPathThreshold <= 0 || !package.mimeImageData.isEmpty() || !package.fileNames.isEmpty() || package.filePort != 0
+        || groupPeers().isEmpty())
+        return false;
+
+    ClipShareClipDatagram datagram;
+    datagram.nodeId = nodeId;
+    datagram.sequence = package.sequence;
+    datagram.package = package;
+    auto bytes = datagram.encode();
+    if (bytes.size() > config.fastPathThreshold)
+        return false;
+
+    // one packet reaches the whole group, the peers that miss it get it unicast on retry
+    fastPath.package = package;
+    fastPath.datagram = bytes;
+    for (auto& peer : groupPeers())
+        fastPath.unacked.insert(peer.nodeId);
+    heartbeatBroadcaster.writeDatagram(bytes, QHostAddress(config.heartbeatMulticastGroupHost), config.heartbeatPort);
+    ClipShareMetrics::instance().increment("clipshare_fastpath_datagrams_total", { { "kind", "clip" } });
+    fastPathTimer.start(qMax(1, config.fastPathRetryInterval));
+    return true;
+}
+
+bool ClipShareTransport::sendMulticast(const ClipSharePackage& package)
+{
+    // a few unicast streams are cheaper than the acknowledgements of a multicast
+    auto peers = groupPeers();
+    if (config.multicastMinPeers <= 0 || peers.size() < config.multicastMinPeers)
+        return false;
+
+    auto payload = package.encode();
+    if (config.packageMaxFrameBytes > 0 && payload.size() > config.packageMaxFrameBytes)
+        return false;
+
+    fastPath.package = package;
+    fastPath.fragments = ClipShareReassembly::fragment(nodeId, package.sequence, payload);
+    for (auto& peer : peers)
+        fastPath.unacked.insert(peer.nodeId);
+    ClipShareMetrics::instance().increment("clipshare_multicast_clips_total");
+
+    multicastTimer.start(MulticastPacingInterval);
+    sendFragments();
+    return true;
+}
+
+int ClipShareTransport::sendOverlay(const ClipSharePackage& package)
+{
+    auto peers = groupPeers();
+    if (config.overlayFanout <= 0 || peers.size() < config.overlayMinPeers)
+        return 0;
+
+    QList<ClipSharePeer> members;
+    for (auto& peer : peers)
+    {
+        auto conn = clientSockets.value(peer.nodeId);
+        if (conn != nullptr && conn->state() == QAbstractSocket::ConnectedState)
+            members.push_back(peer);
+    }
+    if (members.size() < config.overlayMinPeers)
+        return 0;
+
+    // inner nodes forward the most, the peers with the shortest round trip get those places
+    std::sort(members.begin(), members.end(), [](const ClipSharePeer& a, const ClipSharePeer& b)
+        {
+            auto ra = a.roundTrip < 0 ? std::numeric_limits<qint64>::max() : a.roundTrip;
+            auto rb = b.roundTrip < 0 ? std::numeric_limits<qint64>::max() : b.roundTrip;
+            return ra != rb ? ra < rb : a.nodeId < b.nodeId;
+        });
+
+    auto payload = package.encode();
+    ClipShareRoutePackage route;
+    route.fanout = static_cast<std::uint32_t>(config.overlayFanout);
+    route.priority = payload.size() <= SmallClipSize ? ClipPriority : LargeClipPriority;
+    route.members.reserve(members.size() + 1);
+    route.members.push_back(nodeId);
+    for (auto& peer : members)
+        route.members.push_back(peer.nodeId);
+
+    QList<Relay> children;
+    openRelays(route, 0, children);
+    auto enqueuedAt = ClipShareTrace::now();
+    for (auto& child : children)
+    {
+        auto it = clientStreams.find(child.conn);
+        it->writer.append(child.stream, payload, true);
+        it->unacked.insert(child.stream, enqueuedAt);
+        it->ownStreams.insert(child.stream);
+    }
+    ClipShareMetrics::instance().increment("clipshare_overlay_clips_total");
+
+    overlay.package = package;
+    overlay.children = children;
+    for (auto& peer : members)
+        overlay.pending.insert(peer.nodeId);
+    if (config.overlayRepairTimeout > 0)
+        overlayRepairTimer.start();
+    return children.size();
+}
+
+void ClipShareTransport::repairOverlay()
+{
+    if (overlay.pending.isEmpty())
+        return;
+
+    // a large clip still on its way to our children is still on its way to their subtrees
+    for (auto& child : overlay.children)
+    {
+        auto it = clientStreams.find(child.conn);
+        if (it != clientStreams.end() && it->unacked.contains(child.stream) && ++overlay.rounds < OverlayRepairRounds)
+        {
+            overlayRepairTimer.start();
+            return;
+        }
+    }
+
+    int repaired = 0;
+    for (auto member : overlay.pending)
+    {
+        auto conn = clientSockets.value(member);
+        if (conn != nullptr && conn->state() == QAbstractSocket::ConnectedState)
+            repaired += enqueue(overlay.package, conn);
+    }
+    if (repaired > 0)
+    {
+        ClipShareLog::transport().info("[Client] {} tree members did not report clip {}, sent it to them directly", repaired, overlay.package.sequence);
+        ClipShareMetrics::instance().increment("clipshare_overlay_repaired_total", {}, repaired);
+        ClipShareMetrics::instance().increment("clipshare_clips_sent_total", {}, repaired);
+    }
+    overlay = Overlay{};
+    updateQueueDepth();
+}
+
+void ClipShareTransport::openRelays(ClipShareRoutePackage route, quint32 parent, QList<Relay>& relays)
+{
+    for (auto child : route.children(parent))
+    {
+        auto conn = clientSockets.value(route.members[child]);
+        auto it = clientStreams.find(conn);
+        // a member we cannot reach is skipped, its children are ours then, repairOverlay() sends it the clip
+        if (conn == nullptr || it == clientStreams.end() || conn->state() != QAbstractSocket::ConnectedState)
+        {
+            openRelays(route, child, relays);
+            continue;
+        }
+
+        // the route goes ahead on the control stream, the stream's chunks follow as they arrive
+        route.index = child;
+        route.stream = it->writer.open(route.priority);
+        it->writer.writeControl(route.encode());
+        relays.push_back(Relay{ conn, route.stream });
+    }
+}
+
+void ClipShareTransport::readRoute(QTcpSocket* conn, const QByteArray& payload)
+{
+    ClipShareRoutePackage route;
+    try {
+        auto control = ClipShareControlPackage::decode(payload);
+        // a member of our tree has the clip, it needs no repair
+        if (control.command == ClipShareControlPackage::Delivered)
+        {
+            if (control.sequence == overlay.package.sequence)
+                overlay.pending.remove(control.node);
+            return;
+        }
+        if (control.command != ClipShareControlPackage::Route)
+            return;
+        route = ClipShareRoutePackage::decode(payload);
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        ClipShareMetrics::instance().increment("clipshare_package_parse_failures_total");
+        ClipShareLog::transport().debug("[Server] Invalid control message: {}", e.what());
+        return;
+    }
+
+    if (route.fanout == 0 || route.index == 0 || route.index >= route.members.size() || route.members[route.index] != nodeId)
+        return;
+
+    // the origin hears once the clip is here, streams whose clip never completes must not pile up
+    if (routedStreams.size() >= MaxUnacked)
+        routedStreams.clear();
+    routedStreams.insert(qMakePair(conn, route.stream), route.members[0]);
+
+    // as many as the frame keeps open, routes whose chunks never come must not pile up
+    int open = 0;
+    for (auto it = relays.lowerBound(qMakePair(conn, quint32{ 0 })); it != relays.end() && it.key().first == conn; ++it)
+        ++open;
+    if (open >= ClipShareFrame::MaxOpenStreams)
+        return;
+
+    QList<Relay> children;
+    openRelays(route, route.index, children);
+    if (!children.isEmpty())
+        relays.insert(qMakePair(conn, route.stream), children);
+}
+
+void ClipShareTransport::relayChunk(QTcpSocket* conn, const ClipShareChunkHeader& header, const char* data)
+{
+    auto it = relays.find(qMakePair(conn, header.stream));
+    if (it == relays.end())
+        return;
+
+    // cut through, each chunk goes on as soon as it is here instead of once the clip is complete
+    QByteArray chunk{ data, static_cast<int>(header.length) };
+    bool end = header.flags & (ClipShareChunkHeader::End | ClipShareChunkHeader::Cancel);
+    int copies = 0;
+    for (auto& relay : *it)
+    {
+        auto stream = clientStreams.find(relay.conn);
+        if (stream == clientStreams.end())
+            continue;
+        if (header.flags & ClipShareChunkHeader::Cancel)
+            stream->writer.cancel(relay.stream);
+        else if (stream->writer.append(relay.stream, chunk, header.flags & ClipShareChunkHeader::End))
+            ++copies;
+    }
+    ClipShareMetrics::instance().increment("clipshare_overlay_relayed_bytes_total", {}, static_cast<double>(chunk.size()) * copies);
+    if (end)
+        relays.erase(it);
+}
+
+void ClipShareTransport::dropRelays(QTcpSocket* conn)
+{
+    for (auto it = routedStreams.begin(); it != routedStreams.end();)
+        it = it.key().first == conn ? routedStreams.erase(it) : std::next(it);
+
+    // the rest of those clips is not coming, the children drop what they have and the origin repairs their subtrees
+    auto it = relays.lowerBound(qMakePair(conn, quint32{ 0 }));
+    while (it != relays.end() && it.key().first == conn)
+    {
+        for (auto& relay : *it)
+        {
+            auto stream = clientStreams.find(relay.conn);
+            if (stream != clientStreams.end())
+                stream->writer.cancel(relay.stream);
+        }
+        it = relays.erase(it);
+    }
+}
+
+int ClipShareTransport::sendGossip(const ClipSharePackage& package)
+{
+    auto peers = groupPeers().size();
+    if (config.gossipFanout <= 0 || peers == 0)
+        return 0;
+
+    gossipReceived(package);
+    return qMin(config.gossipFanout, peers);
+}
+
+void ClipShareTransport::gossipReceived(const ClipSharePackage& package)
+{
+    auto key = ClipShareBloomFilter::key(package.origin, package.sequence);
+    gossipWanted.remove(key);
+    if (!gossipSeen.testAndInsert(key))
+        return;
+
+    gossipCache.push_back(package);
+    if (gossipCache.size() > GossipCacheSize)
+        gossipCache.removeFirst();
+    pushGossip(package, config.gossipFanout);
+}
+
+int ClipShareTransport::pushGossip(const ClipSharePackage& package, int fanout)
+{
+    // only the id travels, peers that miss the clip pull it
+    ClipShareClipDatagram have;
+    have.command = ClipShareClipDatagram::Have;
+    have.nodeId = nodeId;
+    have.origin = package.origin;
+    have.sequence = package.sequence;
+    auto bytes = have.encode();
+
+    // our latest clip is not announced to the peers that got it through their ring
+    auto peers = package.origin == nodeId && package.sequence == sequence ? groupPeers() : peerRegistry.peers();
+    auto random = QRandomGenerator::global();
+    int pushed = 0;
+    // partial Fisher-Yates, fanout distinct peers
+    for (int i = 0; i < peers.size() && pushed < fanout; ++i)
+    {
+        // not swapItemsAt, that needs Qt 5.13
+        std::swap(peers[i], peers[i + static_cast<int>(random->bounded(peers.size() - i))]);
+        auto& peer = peers[i];
+        if (peer.nodeId == package.origin)
+            continue;
+        heartbeatBroadcaster.writeDatagram(bytes, peer.address, peer.heartbeatPort != 0 ? peer.heartbeatPort : config.heartbeatPort);
+        ++pushed;
+    }
+    ClipShareMetrics::instance().increment("clipshare_gossip_datagrams_total", { { "kind", "have" } }, pushed);
+    return pushed;
+}
+
+void ClipShareTransport::gossipLatest()
+{
+    // a peer that missed every push of the latest clip catches up within a few intervals
+    if (!gossipCache.isEmpty())
+        pushGossip(gossipCache.back(), 1);
+}
+
+void ClipShareTransport::readGossip(const ClipShareClipDatagram& datagram, const QHostAddress& sender, quint16 senderPort, qint64 receivedAt)
+{
+    auto& metrics = ClipShareMetrics::instance();
+    if (datagram.command == ClipShareClipDatagram::Want)
+    {
+        auto conn = clientSockets.value(datagram.nodeId);
+        for (auto& package : gossipCache)
+        {
+            if (package.origin != datagram.origin || package.sequence != datagram.sequence)
+                continue;
+            if (conn != nullptr && enqueue(package, conn) > 0)
+            {
+                metrics.increment("clipshare_gossip_pulls_total");
+                updateQueueDepth();
+            }
+            break;
+        }
+        return;
+    }
+
+    // known, superseded or already asked for, none of them costs an allocation
+    auto key = ClipShareBloomFilter::key(datagram.origin, datagram.sequence);
+    if (datagram.origin == nodeId || gossipSeen.contains(key) || datagram.sequence <= latestSequence.value(datagram.origin))
+    {
+        metrics.increment("clipshare_gossip_duplicates_total");
+        return;
+    }
+    auto wanted = gossipWanted.find(key);
+    if (wanted != gossipWanted.end() && *wanted > receivedAt)
+        return;
+
+    if (gossipWanted.size() >= MaxGossipWanted)
+        gossipWanted.clear();
+    // another announcement after the retry interval asks again, the first answer may be lost
+    gossipWanted.insert(key, receivedAt + static_cast<qint64>(qMax(1, config.fastPathRetryInterval)) * 1000000);
+
+    ClipShareClipDatagram want;
+    want.command = ClipShareClipDatagram::Want;
+    want.nodeId = nodeId;
+    want.origin = datagram.origin;
+    want.sequence = datagram.sequence;
+    heartbeatBroadcaster.writeDatagram(want.encode(), sender, senderPort);
+    metrics.increment("clipshare_gossip_datagrams_total", { { "kind", "want" } });
+}
+
+void ClipShareTransport::sendFragments()
+{
+    // paced, a burst of a whole screenshot would overflow the socket buffers on either side
+    qint64 budget = qMax<qint64>(ClipShareReassembly::FragmentSize, static_cast<qint64>(config.multicastRate) * 1024 * MulticastPacingInterval / 1000);
+    QHostAddress group{ config.heartbeatMulticastGroupHost };
+    int sent = 0;
+    while (budget > 0)
+    {
+        int index;
+        if (!fastPath.retransmit.isEmpty())
+            index = fastPath.retransmit.takeFirst();
+        else if (fastPath.nextFragment < fastPath.fragments.size())
+            index = fastPath.nextFragment++;
+        else
+            break;
+
+        auto& fragment = fastPath.fragments[index];
+        if (heartbeatBroadcaster.writeDatagram(fragment, group, config.heartbeatPort) < 0)
+        {
+            // socket buffer full, try again on the next tick
+            fastPath.retransmit.prepend(index);
+            break;
+        }
+        budget -= fragment.size();
+        ++sent;
+    }
+    ClipShareMetrics::instance().increment("clipshare_multicast_fragments_total", {}, sent);
+
+    if (fastPath.retransmit.isEmpty() && fastPath.nextFragment >= fastPath.fragments.size())
+    {
+        multicastTimer.stop();
+        if (!fastPath.unacked.isEmpty() && !fastPathTimer.isActive())
+            fastPathTimer.start(qMax(1, config.fastPathRetryInterval));
+    }
+}
+
+void ClipShareTransport::retryDatagram()
+{
+    // still sending, nobody could have answered yet
+    if (multicastTimer.isActive())
+        return;
+
+    // left the group in the meantime
+    for (auto it = fastPath.unacked.begin(); it != fastPath.unacked.end();)
+        it = peerRegistry.contains(*it) ? std::next(it) : fastPath.unacked.erase(it);
+
+    if (fastPath.unacked.isEmpty())
+    {
+        fastPathTimer.stop();
+        return;
+    }
+
+    auto& metrics = ClipShareMetrics::instance();
+    if (fastPath.attempts < config.fastPathRetries)
+    {
+        ++fastPath.attempts;
+        if (!fastPath.fragments.isEmpty())
+        {
+            // poll with the last fragment, receivers answer with an Ack or a Nack
+            fastPath.retransmit.push_back(fastPath.fragments.size() - 1);
+            metrics.increment("clipshare_fastpath_datagrams_total", { { "kind", "retry" } });
+            multicastTimer.start(MulticastPacingInterval);
+            sendFragments();
+            return;
+        }
+
+        for (auto peerNodeId : fastPath.unacked)
+        {
+            auto peer = peerRegistry.peer(peerNodeId);
+            heartbeatBroadcaster.writeDatagram(fastPath.datagram, peer.address, peer.heartbeatPort != 0 ? peer.heartbeatPort : config.heartbeatPort);
+            metrics.increment("clipshare_fastpath_datagrams_total", { { "kind", "retry" } });
+        }
+        return;
+    }
+
+    // out of retries, the stream connection delivers it
+    for (auto peerNodeId : fastPath.unacked)
+    {
+        auto conn = clientSockets.value(peerNodeId);
+        if (conn != nullptr && enqueue(fastPath.package, conn) > 0)
+            metrics.increment("clipshare_fastpath_fallbacks_total");
+    }
+    fastPath = FastPath{};
+    fastPathTimer.stop();
+    multicastTimer.stop();
+    updateQueueDepth();
+}
+
+void ClipShareTransport::readClipDatagram(const QByteArray& data, const QHostAddress& sender, quint16 senderPort, qint64 receivedAt)
+{
+    auto& metrics = ClipShareMetrics::instance();
+    ClipShareClipDatagram datagram;
+    if (!ClipShareClipDatagram::decode(data, datagram))
+    {
+        countDrop(DropMagic);
+        return;
+    }
+
+    if (datagram.command == ClipShareClipDatagram::Ack)
+    {
+        if (datagram.sequence == fastPath.package.sequence && fastPathMember(datagram, sender) && fastPath.unacked.remove(datagram.nodeId))
+            metrics.increment("clipshare_fastpath_datagrams_total", { { "kind", "ack" } });
+        if (fastPath.unacked.isEmpty())
+        {
+            fastPathTimer.stop();
+            multicastTimer.stop();
+        }
+        return;
+    }
+
+    if (datagram.command == ClipShareClipDatagram::Nack)
+    {
+        if (datagram.sequence != fastPath.package.sequence || fastPath.fragments.isEmpty() || !fastPathMember(datagram, sender))
+            return;
+        if (!nackSources.take(sender, receivedAt))
+        {
+            countDrop(DropRate);
+            return;
+        }
+        metrics.increment("clipshare_multicast_nacks_total");
+        // retransmitted to the group, other receivers are likely missing the same ones.
+        // Bounded, so the retries go on and the stream connection takes over in the end
+        auto limit = fastPath.fragments.size() * MaxRetransmitRounds;
+        for (auto index : datagram.missing)
+        {
+            if (fastPath.retransmitted >= limit)
+                break;
+            if (index < static_cast<quint32>(fastPath.fragments.size()) && !fastPath.retransmit.contains(static_cast<int>(index)))
+            {
+                fastPath.retransmit.push_back(static_cast<int>(index));
+                ++fastPath.retransmitted;
+            }
+        }
+        if (!fastPath.retransmit.isEmpty() && !multicastTimer.isActive())
+            multicastTimer.start(MulticastPacingInterval);
+        return;
+    }
+
+    // our own clip looped back
+    if (datagram.nodeId == nodeId)
+        return;
+
+    if (datagram.command == ClipShareClipDatagram::Fragment)
+    {
+        readFragment(datagram, sender, senderPort, receivedAt);
+        return;
+    }
+
+    // clips and gossip make us answer right away, one datagram or clip for each
+    if (!allowClipFrom(datagram, sender, receivedAt))
+    {
+        countDrop(DropRate);
+        return;
+    }
+
+    if (datagram.command == ClipShareClipDatagram::Have || datagram.command == ClipShareClipDatagram::Want)
+    {
+        readGossip(datagram, sender, senderPort, receivedAt);
+        return;
+    }
+
+    // acknowledged every time, the first ack may have been lost
+    ClipShareClipDatagram ack;
+    ack.command = ClipShareClipDatagram::Ack;
+    ack.nodeId = nodeId;
+    ack.sequence = datagram.sequence;
+    heartbeatBroadcaster.writeDatagram(ack.encode(), sender, senderPort);
+
+    auto& package = datagram.package;
+    package.trace.stamp(ClipShareTrace::FirstByte, receivedAt);
+    package.trace.stamp(ClipShareTrace::FrameComplete, receivedAt);
+    package.trace.stamp(ClipShareTrace::Decoded);
+    if (!acceptSequence(package))
+        return;
+
+    metrics.increment("clipshare_clips_received_total");
+    countFormatBytes("clipshare_received_bytes_total", package, 1);
+    emit packageReceived(nullptr, package);
+}
+
+void ClipShareTransport::readFragment(const ClipShareClipDatagram& fragment, const QHostAddress& sender, quint16 senderPort, qint64 receivedAt)
+{
+    auto& metrics = ClipShareMetrics::instance();
+    ClipShareClipDatagram answer;
+    answer.nodeId = nodeId;
+    answer.sequence = fragment.sequence;
+
+    // delivered already, the sender polls because our ack was lost
+    if (fragment.sequence <= latestSequence.value(fragment.nodeId))
+    {
+        if (fragment.index + 1 == fragment.count)
+        {
+            answer.command = ClipShareClipDatagram::Ack;
+            heartbeatBroadcaster.writeDatagram(answer.encode(), sender, senderPort);
+        }
+        return;
+    }
+
+    QByteArray payload;
+    qint64 firstFragmentAt = 0;
+    switch (reassembly.add(fragment, receivedAt, payload, answer.missing, &firstFragmentAt))
+    {
+    case ClipShareReassembly::Missing:
+        answer.command = ClipShareClipDatagram::Nack;
+        heartbeatBroadcaster.writeDatagram(answer.encode(), sender, senderPort);
+        metrics.increment("clipshare_multicast_nacks_total");
+        return;
+    case ClipShareReassembly::Rejected:
+        countDrop(DropSize);
+        return;
+    case ClipShareReassembly::Incomplete:
+        return;
+    case ClipShareReassembly::Complete:
+        break;
+    }
+
+    answer.command = ClipShareClipDatagram::Ack;
+    heartbeatBroadcaster.writeDatagram(answer.encode(), sender, senderPort);
+
+    try {
+        auto package = ClipSharePackage::decode(payload);
+        package.trace.stamp(ClipShareTrace::FirstByte, firstFragmentAt);
+        package.trace.stamp(ClipShareTrace::FrameComplete, receivedAt);
+        package.trace.stamp(ClipShareTrace::Decoded);
+        if (package.origin != fragment.nodeId || !acceptSequence(package))
+            return;
+
+        metrics.increment("clipshare_clips_received_total");
+        countFormatBytes("clipshare_received_bytes_total", package, 1);
+        emit packageReceived(nullptr, package);
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        metrics.increment("clipshare_package_parse_failures_total");
+        auto suppressed = invalidPackageLog.allow();
+        if (suppressed >= 0)
+            ClipShareLog::transport().error("[Multicast] Invaild package [{}bytes] from {}:{} {} ({} similar suppressed)", payload.size()
+                , sender.toString(), senderPort, e.what(), suppressed);
+    }
+}
+
+bool ClipShareTransport::acceptSequence(const ClipSharePackage& package)
+{
+    // a newer clip of the same origin has already been delivered
+    if (latestSequence.size() >= MaxOrigins && !latestSequence.contains(package.origin))
+        latestSequence.clear();
+    auto& latest = latestSequence[package.origin];
+    if (package.sequence != 0 && package.sequence <= latest)
+    {
+        ClipShareMetrics::instance().increment("clipshare_clips_superseded_total");
+        return false;
+    }
+    latest = package.sequence;
+    return true;
+}
+
+void ClipShareTransport::rememberBase(const ClipSharePackage& package)
+{
+    if (deltaBases.size() >= MaxOrigins && !deltaBases.contains(package.origin))
+        deltaBases.clear();
+
+    // deltas are only ever made of the text formats
+    ClipSharePackage base;
+    base.origin = package.origin;
+    base.sequence = package.sequence;
+    for (int i = 0; i < package.mimeFormats.size() && i < package.mimeData.size(); ++i)
+    {
+        if (ClipSharePackage::textFormat(package.mimeFormats[i]))
+        {
+            base.mimeFormats.push_back(package.mimeFormats[i]);
+            base.mimeData.push_back(package.mimeData[i]);
+        }
+    }
+    auto& bases = deltaBases[package.origin];
+    bases.push_back(base);
+    while (bases.size() > DeltaBases)
+        bases.removeFirst();
+}
+
+const ClipSharePackage* ClipShareTransport::findBase(quint64 origin, quint64 sequence) const
+{
+    auto it = deltaBases.constFind(origin);
+    if (it == deltaBases.constEnd())
+        return nullptr;
+    for (auto& base : *it)
+    {
+        if (base.sequence == sequence)
+            return &base;
+    }
+    return nullptr;
+}
+
+QByteArray ClipShareTransport::peerPayload(const ClipSharePackage& package, const ClientStream& client, bool delta, const QByteArray& payload, QHash<QString, QPair<QByteArray, bool>>& payloads)
+{
+    auto base = delta && client.ackedSequence < package.sequence ? client.ackedSequence : 0;
+    if (base == 0 && client.acceptedFormats.isEmpty())
+        return payload;
+
+    // most peers run the same configuration and acknowledged the same clip
+    auto key = client.acceptedFormats.join(QLatin1Char('\n')) + QLatin1Char('\n') + QString::number(base);
+    auto it = payloads.find(key);
+    if (it == payloads.end())
+    {
+        auto peer = package;
+        peer.pruneFormats(client.acceptedFormats);
+        auto basePackage = base != 0 ? findBase(nodeId, base) : nullptr;
+        auto isDelta = basePackage != nullptr && peer.encodeDelta(*basePackage, config.deltaMinSize);
+        it = payloads.insert(key, { peer.encode(), isDelta });
+    }
+
+    auto& metrics = ClipShareMetrics::instance();
+    if (it->second)
+        metrics.increment("clipshare_delta_clips_total", { { "result", "sent" } });
+    if (it->first.size() < payload.size())
+        metrics.increment("clipshare_peer_saved_bytes_total", {}, static_cast<double>(payload.size() - it->first.size()));
+    return it->first;
+}
+
+void ClipShareTransport::broadcastHeartbeat()
+{
+    auto pkg = makeHeartbeat(ClipShareHeartbeatPackage::Heartbeat);
+    pkg.originTime = ClipShareTrace::now();
+    heartbeatBroadcaster.writeDatagram(reinterpret_cast<const char*>(&pkg), sizeof(ClipShareHeartbeatPackage), QHostAddress(config.heartbeatMulticastGroupHost), config.heartbeatPort);
+
+    // keeps our connections clear of the peers' idle timeout
+    ClipShareControlPackage ping;
+    ping.time = pkg.originTime;
+    auto control = ping.encode();
+    for (auto it = clientStreams.begin(); it != clientStreams.end(); ++it)
+    {
+        if (it.key()->state() == QAbstractSocket::ConnectedState)
+            it->writer.writeControl(control);
+    }
+    connectHub();
+}
+
+void ClipShareTransport::connectHub()
+{
+    if (config.hubAddress.isEmpty() || clientSockets.contains(HubNodeId))
+        return;
+
+    // a pseudo peer, reconnected on every heartbeat like the real ones
+    auto separator = config.hubAddress.lastIndexOf(':');
+    ClipSharePeer hub;
+    hub.nodeId = HubNodeId;
+    hub.address = QHostAddress{ config.hubAddress.left(separator) };
+    hub.packagePort = static_cast<quint16>(config.hubAddress.mid(separator + 1).toUInt());
+    if (separator < 0 || hub.address.isNull() || hub.packagePort == 0)
+    {
+        ClipShareLog::transport().error("[Client] Invalid hubAddress {}", config.hubAddress);
+        config.hubAddress.clear();
+        return;
+    }
+    connectPeer(hub);
+}
+
+void ClipShareTransport::connectPeer(const ClipSharePeer& peer)
+{
+    // in addition to TCP, which still carries what does not fit the ring
+    if (peer.hostId != 0 && peer.hostId == hostId && localChannel.listening())
+        localChannel.connectPeer(peer.nodeId);
+    if (clientSockets.contains(peer.nodeId))
+        return;
+
+    auto conn = new QTcpSocket(this);
+    clientSockets.insert(peer.nodeId, conn);
+    clientStreams.insert(conn, ClientStream{ ClipShareStreamWriter{ conn }, ClipShareFrame{ config.packageMaxFrameBytes } });
+
+    auto peerNodeId = peer.nodeId;
+    connect(conn, &QTcpSocket::connected, this, [=]
+        {
+            ClipShareLog::transport().info("[Client] Connected to {:016x} {}:{}.", peerNodeId, conn->peerAddress().toString(), conn->peerPort());
+
+            // the hub catches us up with what we missed while away
+            auto it = clientStreams.find(conn);
+            if (peerNodeId == HubNodeId && it != clientStreams.end())
+            {
+                ClipShareControlPackage hello;
+                hello.command = ClipShareControlPackage::Hello;
+                hello.time = ClipShareTrace::now();
+                hello.node = nodeId;
+                it->writer.writeControl(hello.encode());
+            }
+        });
+    connect(conn, &QTcpSocket::bytesWritten, this, [=]
+        {
+            auto it = clientStreams.find(conn);
+            if (it != clientStreams.end())
+                it->writer.pump();
+            updateQueueDepth();
+        });
+    connect(conn, &QTcpSocket::readyRead, this, [=]
+        {
+            readControl(conn);
+        });
+    connect(conn, &QTcpSocket::disconnected, this, [=]
+        {
+            ClipShareLog::transport().info("[Client] Disconnected from {:016x}.", peerNodeId);
+            removeClient(peerNodeId, conn);
+        });
+    connect(conn, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, [=]
+        {
+            ClipShareLog::transport().warn("[Client] {:016x}: {}", peerNodeId, conn->errorString());
+            // never connected, retried on the next heartbeat
+            if (conn->state() == QAbstractSocket::UnconnectedState)
+                removeClient(peerNodeId, conn);
+        });
+
+    conn->connectToHost(peer.address, peer.packagePort);
+}
+
+void ClipShareTransport::disconnectPeer(const ClipSharePeer& peer)
+{
+    localChannel.disconnectPeer(peer.nodeId);
+    auto conn = clientSockets.value(peer.nodeId);
+    if (conn != nullptr)
+    {
+        conn->disconnect(this);
+        conn->abort();
+        removeClient(peer.nodeId, conn);
+    }
+}
+
+void ClipShareTransport::removeClient(quint64 peerNodeId, QTcpSocket* conn)
+{
+    if (clientSockets.value(peerNodeId) == conn)
+        clientSockets.remove(peerNodeId);
+    clientStreams.remove(conn);
+    conn->deleteLater();
+    updateQueueDepth();
+}
+
+void ClipShareTransport::readControl(QTcpSocket* conn)
+{
+    auto it = clientStreams.find(conn);
+    if (it == clientStreams.end())
+        return;
+
+    auto receivedAt = ClipShareTrace::now();
+    it->control.append(conn->readAll(), receivedAt);
+    QByteArray payload;
+    quint32 stream = 0;
+    qint64 firstByteAt = 0;
+    while (it->control.next(payload, &firstByteAt, &stream))
+    {
+        // peers only ever answer on the control stream, the hub also relays the other nodes' clips
+        if (stream != ClipShareChunkHeader::ControlStream)
+        {
+            if (clientSockets.value(HubNodeId) == conn)
+                deliverPackage(conn, payload, stream, firstByteAt, receivedAt);
+            continue;
+        }
+
+        try {
+            auto control = ClipShareControlPackage::decode(payload);
+            if (control.command == ClipShareControlPackage::Ack)
+            {
+                auto enqueuedAt = it->unacked.take(control.stream);
+                if (enqueuedAt > 0)
+                    ClipShareMetrics::instance().observe("clipshare_delivery_microseconds", {}, (ClipShareTrace::now() - enqueuedAt) / 1000);
+                it->ackedSequence = qMax(it->ackedSequence, it->sequences.take(control.stream));
+            }
+            else if (control.command == ClipShareControlPackage::Formats)
+            {
+                // applies from the next clip on
+                it->acceptedFormats = ClipShareFormatsPackage::decode(payload).formats.mid(0, ClipShareFormatsPackage::MaxFormats);
+                ClipShareLog::transport().debug("[Client] {}:{} accepts {}", conn->peerAddress().toString(), conn->peerPort(), it->acceptedFormats.join(", "));
+            }
+            else if (control.command == ClipShareControlPackage::Missing)
+            {
+                // the peer lost the base, no more deltas until it acknowledges a whole clip
+                it->unacked.remove(control.stream);
+                auto sequence = it->sequences.take(control.stream);
+                it->ackedSequence = 0;
+                ClipShareMetrics::instance().increment("clipshare_delta_clips_total", { { "result", "missing" } });
+                if (sequence != 0 && sequence == lastSent.sequence)
+                    enqueue(lastSent, conn);
+            }
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            ClipShareMetrics::instance().increment("clipshare_package_parse_failures_total");
+            ClipShareLog::transport().debug("[Client] Invalid control message: {}", e.what());
+        }
+    }
+
+    // a peer that never acknowledges must not grow the table
+    if (it->unacked.size() > MaxUnacked)
+    {
+        it->unacked.clear();
+        it->sequences.clear();
+    }
+    if (it->control.oversized())
+        conn->abort();
+}
+
+void ClipShareTransport::acceptConnections()
+{
+    while (packageReciver.hasPendingConnections())
+    {
+        auto conn = packageReciver.nextPendingConnection();
+        if (config.packageMaxConnections > 0 && serverSockets.size() >= config.packageMaxConnections)
+        {
+            ClipShareMetrics::instance().increment("clipshare_server_evictions_total", { { "reason", "limit" } });
+            auto suppressed = rejectedConnectionLog.allow();
+            if (suppressed >= 0)
+                ClipShareLog::transport().warn("[Server] Reject {}:{}, {} connections open ({} similar suppressed)"
+                    , conn->peerAddress().toString(), conn->peerPort(), serverSockets.size(), suppressed);
+            conn->abort();
+            conn->deleteLater();
+            continue;
+        }
+        ClipShareLog::transport().info("[Server] Client {}:{} connected.", conn->peerAddress().toString(), conn->peerPort());
+        // before any clip, the peer prunes what it sends us from then on
+        conn->write(acceptedFormats);
+
+        // Qt would buffer an unbounded amount from the kernel otherwise
+        conn->setReadBufferSize(ReadChunkSize);
+        auto frame = serverSockets.insert(conn, ClipShareFrame{ config.packageMaxFrameBytes, ClipShareTrace::now() });
+        frame->setChunkHandler([=](const ClipShareChunkHeader& header, const char* data)
+            {
+                relayChunk(conn, header, data);
+            });
+        ClipShareMetrics::instance().set("clipshare_server_connections", {}, serverSockets.size());
+
+        connect(conn, &QTcpSocket::disconnected, [=]
+            {
+                auto it = serverSockets.find(conn);
+                if (it != serverSockets.end())
+                {
+                    receiveBuffered -= it->pendingBytes();
+                    serverSockets.erase(it);
+                }
+                dropRelays(conn);
+                ClipShareMetrics::instance().set("clipshare_server_connections", {}, serverSockets.size());
+                ClipShareLog::transport().info("[Server] Client {}:{} disconnected.", conn->peerAddress().toString(), conn->peerPort());
+                conn->deleteLater();
+            });
+        connect(conn, &QTcpSocket::readyRead, [=]
+            {
+                readPackages(conn);
+            });
+    }
+}
+
+void ClipShareTransport::readPackages(QTcpSocket* conn)
+{
+    auto it = serverSockets.find(conn);
+    if (it == serverSockets.end())
+        return;
+
+    auto receivedAt = ClipShareTrace::now();
+    auto data = conn->readAll();
+    ClipShareLog::transport().trace("[Server] Receive [{}bytes] {}:{}", data.length()
+        , conn->peerAddress().toString(), conn->peerPort());
+
+    auto pendingBefore = it->pendingBytes();
+    auto cancelledBefore = it->cancelledCount();
+    it->append(data, receivedAt);
+    QByteArray payload;
+    qint64 firstByteAt = 0;
+    quint32 stream = 0;
+    while (it->next(payload, &firstByteAt, &stream))
+    {
+        // pings only refresh lastReceived(), routes announce a stream to relay
+        if (stream == ClipShareChunkHeader::ControlStream)
+        {
+            readRoute(conn, payload);
+            continue;
+        }
+        deliverPackage(conn, payload, stream, firstByteAt, receivedAt);
+    }
+    receiveBuffered += it->pendingBytes() - pendingBefore;
+    if (it->cancelledCount() != cancelledBefore)
+        ClipShareMetrics::instance().increment("clipshare_clips_cancelled_total", { { "side", "receiver" } }, it->cancelledCount() - cancelledBefore);
+
+    const char* reason = nullptr;
+    if (it->oversized())
+        reason = "frame_size";
+    else if (config.packageMaxBufferedBytes > 0 && it->pendingBytes() > config.packageMaxBufferedBytes)
+        reason = "buffer";
+    else if (config.packageMaxTotalBufferedBytes > 0 && receiveBuffered > config.packageMaxTotalBufferedBytes)
+        reason = "memory";
+    if (reason != nullptr)
+        evictConnection(conn, reason);
+    updateQueueDepth();
+}
+
+void ClipShareTransport::deliverPackage(QTcpSocket* conn, const QByteArray& payload, quint32 stream, qint64 firstByteAt, qint64 receivedAt)
+{
+    try {
+        auto package = ClipSharePackage::decode(payload);
+        package.trace.stamp(ClipShareTrace::FirstByte, firstByteAt);
+        package.trace.stamp(ClipShareTrace::FrameComplete, receivedAt);
+        package.trace.stamp(ClipShareTrace::Decoded);
+
+        ClipShareControlPackage ack;
+        if (package.deltaBase != 0)
+        {
+            // a base evicted here, or a clip that came on another path in between, the sender sends it again whole
+            auto base = findBase(package.origin, package.deltaBase);
+            if (base == nullptr || !package.applyDelta(*base, config.packageMaxFrameBytes))
+            {
+                ClipShareLog::transport().debug("[Server] No base {} for the delta of {:016x}, asking for all of it", package.deltaBase, package.origin);
+                ack.command = ClipShareControlPackage::Missing;
+                ack.stream = stream;
+                ack.time = ClipShareTrace::now();
+                conn->write(ClipShareFrame::encode(ack.encode(), ClipShareChunkHeader::ControlStream));
+                return;
+            }
+            ClipShareMetrics::instance().increment("clipshare_delta_clips_total", { { "result", "applied" } });
+        }
+
+        // a tree clip is reported to its origin, a duplicate too, it needs no repair either way
+        auto origin = routedStreams.take(qMakePair(conn, stream));
+        auto originConn = clientSockets.value(origin);
+        auto originStream = clientStreams.find(originConn);
+        if (origin != 0 && originStream != clientStreams.end() && originConn->state() == QAbstractSocket::ConnectedState)
+        {
+            ClipShareControlPackage delivered;
+            delivered.command = ClipShareControlPackage::Delivered;
+            delivered.time = ClipShareTrace::now();
+            delivered.node = nodeId;
+            delivered.sequence = package.sequence;
+            originStream->writer.writeControl(delivered.encode());
+        }
+
+        if (!acceptSequence(package))
+            return;
+        // only clips acknowledged on a stream connection serve as bases, the sender picks from those
+        rememberBase(package);
+
+        ClipShareMetrics::instance().increment("clipshare_clips_received_total");
+        countFormatBytes("clipshare_received_bytes_total", package, 1);
+        if (config.gossipFanout > 0)
+            gossipReceived(package);
+
+        ack.command = ClipShareControlPackage::Ack;
+        ack.stream = stream;
+        ack.time = ClipShareTrace::now();
+        conn->write(ClipShareFrame::encode(ack.encode(), ClipShareChunkHeader::ControlStream));
+
+        emit packageReceived(conn, package);
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        ClipShareMetrics::instance().increment("clipshare_package_parse_failures_total");
+        auto suppressed = invalidPackageLog.allow();
+        if (suppressed >= 0)
+        {
+            ClipShareLog::transport().error("[Server] Invaild package [{}bytes] from {}:{} {:a} ({} similar suppressed)", payload.size()
+                , conn->peerAddress().toString(), conn->peerPort(), spdlog::to_hex(ClipShareLog::payload(payload)), suppressed);
+            ClipShareLog::transport().error("[Server] {}", e.what());
+        }
+    }
+}
+
+void ClipShareTransport::readLocalClip(quint64 peerNodeId, const QByteArray& payload, qint64 receivedAt)
+{
+    try {
+        // decoded in place, payload is the sender's shared memory
+        auto package = ClipSharePackage::decode(payload);
+        package.trace.stamp(ClipShareTrace::FirstByte, receivedAt);
+        package.trace.stamp(ClipShareTrace::FrameComplete, receivedAt);
+        package.trace.stamp(ClipShareTrace::Decoded);
+        if (!acceptSequence(package))
+            return;
+
+        ClipShareMetrics::instance().increment("clipshare_clips_received_total");
+        countFormatBytes("clipshare_received_bytes_total", package, 1);
+        if (config.gossipFanout > 0)
+            gossipReceived(package);
+        emit packageReceived(nullptr, package);
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        ClipShareMetrics::instance().increment("clipshare_package_parse_failures_total");
+        auto suppressed = invalidPackageLog.allow();
+        if (suppressed >= 0)
+            ClipShareLog::transport().error("[Local] Invaild package [{}bytes] from {:016x} {} ({} similar suppressed)", payload.size()
+                , peerNodeId, e.what(), suppressed);
+    }
+}
+
+void ClipShareTransport::evictConnection(QTcpSocket* conn, const char* reason)
+{
+    ClipShareMetrics::instance().increment("clipshare_server_evictions_total", { { "reason", reason } });
+    auto suppressed = rejectedConnectionLog.allow();
+    if (suppressed >= 0)
+        ClipShareLog::transport().warn("[Server] Evict {}:{} ({}), {} bytes pending ({} similar suppressed)"
+            , conn->peerAddress().toString(), conn->peerPort(), reason, serverSockets.value(conn).pendingBytes(), suppressed);
+
+    // the disconnected handler releases the frame and the socket
+    conn->abort();
+}
+
+void ClipShareTransport::evictIdleConnections()
+{
+    auto now = ClipShareTrace::now();
+    auto idleLimit = static_cast<qint64>(config.packageIdleTimeout) * 1000000;
+    auto stallLimit = static_cast<qint64>(config.packageStallTimeout) * 1000000;
+
+    QList<QPair<QTcpSocket*, const char*>> evicted;
+    for (auto it = serverSockets.cbegin(); it != serverSockets.cend(); ++it)
+    {
+        // peers reconnect on their next heartbeat, an idle connection is cheap to drop
+        if (idleLimit > 0 && now - it->lastReceived() > idleLimit)
+            evicted.push_back({ it.key(), "idle" });
+        // a frame trickling in slower than this is holding memory on purpose
+        else if (stallLimit > 0 && it->pendingSince() > 0 && now - it->pendingSince() > stallLimit)
+            evicted.push_back({ it.key(), "stalled" });
+    }
+    for (auto& item : evicted)
+        evictConnection(item.first, item.second);
+    if (!evicted.isEmpty())
+        updateQueueDepth();
+}
+
+void ClipShareTransport::readDatagrams()
+{
+    // heartbeats, fast path clips and multicast fragments
+    auto maxDatagram = qMax<qint64>(qMax<qint64>(sizeof(ClipShareHeartbeatPackage), config.fastPathThreshold), ClipShareReassembly::MaxDatagramSize);
+    if (datagramBuffer.size() < maxDatagram)
+        datagramBuffer.resize(static_cast<int>(maxDatagram));
+
+    while (heartbeatBroadcaster.hasPendingDatagrams()) {
+        // read into a reused buffer, anything that is not a heartbeat or a clip datagram
+        // is dropped before it costs an allocation or a formatted message
+        auto size = heartbeatBroadcaster.pendingDatagramSize();
+        QHostAddress sender;
+        quint16 senderPort = 0;
+        auto read = heartbeatBroadcaster.readDatagram(datagramBuffer.data(), size <= maxDatagram ? maxDatagram : 0, &sender, &senderPort);
+        auto receivedAt = ClipShareTrace::now();
+
+        // a magic of its own, a fragment may be as long as a heartbeat
+        if (size <= maxDatagram && ClipShareClipDatagram::matches(datagramBuffer.constData(), read))
+        {
+            readClipDatagram(QByteArray::fromRawData(datagramBuffer.constData(), static_cast<int>(read)), sender, senderPort, receivedAt);
+            continue;
+        }
+
+        if (size != sizeof(ClipShareHeartbeatPackage) || read != sizeof(ClipShareHeartbeatPackage))
+        {
+            countDrop(DropSize);
+            auto suppressed = invalidHeartbeatLog.allow();
+            if (suppressed >= 0)
+                ClipShareLog::heartbeat().warn("[Heartbeat] {}:{} Incorrect heartbeat package size: {} ({} similar suppressed)"
+                    , sender.toString(), senderPort, size, suppressed);
+            continue;
+        }
+
+        ClipShareHeartbeatPackage pkg;
+        std::memcpy(&pkg, datagramBuffer.constData(), sizeof(ClipShareHeartbeatPackage));
+        if (!pkg.valid())
+        {
+            countDrop(DropMagic);
+            auto suppressed = invalidHeartbeatLog.allow();
+            if (suppressed >= 0)
+                ClipShareLog::heartbeat().warn("[Invalid] {}:{} heartbeat package [magic = 0x{:xns} command = 0x{:x}] ({} similar suppressed)"
+                    , sender.toString(), senderPort, spdlog::to_hex(pkg.magic, pkg.magic + 4), pkg.command, suppressed);
+            continue;
+        }
+
+        // our own heartbeat looped back
+        if (pkg.nodeId == nodeId)
+            continue;
+
+        if (!allowHeartbeatFrom(sender, receivedAt))
+        {
+            countDrop(DropRate);
+            continue;
+        }
+
+        ClipShareLog::heartbeat().trace("[Heartbeat] Receive [{}bytes] {}:{} {:a}", size, sender.toString(), senderPort
+            , spdlog::to_hex(reinterpret_cast<const char*>(&pkg), reinterpret_cast<const char*>(&pkg) + sizeof(ClipShareHeartbeatPackage)));
+
+        if (pkg.command == ClipShareHeartbeatPackage::Heartbeat)
+        {
+            ClipShareLog::heartbeat().info("[Heartbeat] Heartbeat from ({}:{})", sender.toString(), senderPort);
+            auto response = makeHeartbeat(ClipShareHeartbeatPackage::Response);
+            response.originTime = pkg.originTime;
+            response.receiveTime = receivedAt;
+            response.transmitTime = ClipShareTrace::now();
+            heartbeatBroadcaster.writeDatagram(reinterpret_cast<const char*>(&response)
+                , sizeof(ClipShareHeartbeatPackage), sender, senderPort);
+        }
+        else if (pkg.command == ClipShareHeartbeatPackage::Response)
+        {
+            ClipShareLog::heartbeat().info("[Heartbeat] Response from {}:{}", sender.toString(), senderPort);
+        }
+
+        peerRegistry.update(pkg.nodeId, sender, pkg.packagePort, senderPort
+            , (pkg.flags & ClipShareHeartbeatPackage::LocalChannel) != 0 ? pkg.hostId : 0);
+        if (pkg.command == ClipShareHeartbeatPackage::Response)
+            peerRegistry.updateClock(pkg.nodeId, pkg.originTime, pkg.receiveTime, pkg.transmitTime, receivedAt);
+        else if (peerRegistry.peer(pkg.nodeId).roundTrip < 0)
+        {
+            // unicast peers never see our multicast heartbeat, probe their clock directly
+            auto probe = makeHeartbeat(ClipShareHeartbeatPackage::Heartbeat);
+            probe.originTime = ClipShareTrace::now();
+            heartbeatBroadcaster.writeDatagram(reinterpret_cast<const char*>(&probe)
+                , sizeof(ClipShareHeartbeatPackage), sender, senderPort);
+        }
+        connectPeer(peerRegistry.peer(pkg.nodeId));
+    }
+}
+
+bool ClipShareTransport::allowHeartbeatFrom(const QHostAddress& sender, qint64 now)
+{
+    return heartbeatSources.take(sender, now);
+}
+
+bool ClipShareTransport::fastPathMember(const ClipShareClipDatagram& datagram, const QHostAddress& sender) const
+{
+    return fastPath.unacked.contains(datagram.nodeId) && peerRegistry.contains(datagram.nodeId)
+        && peerRegistry.peer(datagram.nodeId).address == sender;
+}
+
+bool ClipShareTransport::allowClipFrom(const ClipShareClipDatagram& datagram, const QHostAddress& sender, qint64 now)
+{
+    // a peer we heard heartbeats from at this address copies as fast as its user does, gossip bursts with the group
+    if (peerRegistry.contains(datagram.nodeId) && peerRegistry.peer(datagram.nodeId).address == sender)
+        return true;
+    return clipSources.take(sender, now);
+}
+
+void ClipShareTransport::exposeDrops(std::string& out) const
+{
+    static const std::string name{ "clipshare_heartbeat_dropped_total" };
+    static const char* reasons[DropReasonCount]{ "size", "magic", "rate" };
+
+    out += "# HELP " + name + " Heartbeat datagrams dropped by reason: size, magic or rate.\n";
+    out += "# TYPE " + name + " counter\n";
+    for (int reason = 0; reason < DropReasonCount; ++reason)
+        out += fmt::format("{}{{reason=\"{}\"}} {}\n", name, reasons[reason], droppedDatagrams[reason].load(std::memory_order_relaxed));
+}
+
+ClipShareHeartbeatPackage ClipShareTransport::makeHeartbeat(std::uint32_t command) const
+{
+    auto pkg = command == ClipShareHeartbeatPackage::Response ? ClipShareHeartbeatPackage_Response : ClipShareHeartbeatPackage_Heartbeat;
+    pkg.nodeId = nodeId;
+    pkg.packagePort = getPackagePort();
+    pkg.hostId = hostId;
+    if (localChannel.listening())
+        pkg.flags |= ClipShareHeartbeatPackage::LocalChannel;
+    return pkg;
+}
+
+void ClipShareTransport::updateQueueDepth()
+{
+    qint64 sendQueue = 0;
+    for (auto it = clientStreams.cbegin(); it != clientStreams.cend(); ++it)
+        sendQueue += it.key()->bytesToWrite() + it->writer.queuedBytes();
+
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.set("clipshare_send_queue_bytes", {}, static_cast<double>(sendQueue));
+    metrics.set("clipshare_receive_buffer_bytes", {}, static_cast<double>(receiveBuffered + reassembly.pendingBytes()));
+}
+
+void ClipShareTransport::countFormatBytes(const char* metric, const ClipSharePackage& package, int copies)
+{
+    if (copies == 0)
+        return;
+
+    auto& metrics = ClipShareMetrics::instance();
+    for (int i = 0; i < package.mimeFormats.size() && i < package.mimeData.size(); ++i)
+        metrics.increment(metric, { { "format", package.mimeFormats[i].toStdString() } }, static_cast<double>(package.mimeData[i].size()) * copies);
+    if (!package.mimeImageData.isEmpty())
+        metrics.increment(metric, { { "format", "image/" + package.mimeImageType.toStdString() } }, static_cast<double>(package.mimeImageData.size()) * copies);
+}
@@ -0,0 +1,238 @@
+﻿#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QUdpSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <atomic>
+
+#include "ClipShareBloomFilter.h"
+#include "ClipShareConfig.h"
+#include "ClipShareFrame.h"
+#include "ClipShareLocalChannel.h"
+#include "ClipShareLog.h"
+#include "ClipSharePackage.h"
+#include "ClipSharePeerRegistry.h"
+#include "ClipShareRateLimit.h"
+#include "ClipShareReassembly.h"
+#include "ClipShareStreamWriter.h"
+
+/// <summary>
+/// Heartbeat discovery and framed package delivery between peers.
+/// Every node connects out to each peer it discovers and sends on that connection,
+/// packages are received on the connections accepted by packageReciver.
+/// </summary>
+class ClipShareTransport : public QObject
+{
+    Q_OBJECT
+
+public:
+    // read buffer of accepted sockets, also the largest chunk appended to a frame at once
+    static constexpr qint64 ReadChunkSize{ 256 * 1024 };
+
+    // stream priorities on the peer connections, control messages bypass the queue
+    static constexpr quint8 ClipPriority{ 1 };
+    static constexpr quint8 LargeClipPriority{ 2 };
+    static constexpr int SmallClipSize{ 64 * 1024 };
+    static constexpr int MaxUnacked{ 1024 };
+    static constexpr int MaxOrigins{ 4096 };
+    static constexpr int MulticastPacingInterval{ 2 };     // ms
+    static constexpr int MaxRetransmitRounds{ 4 };          // Nacks get the fragments of a clip sent again this many times over at most
+    static constexpr int GossipCacheSize{ 16 };             // latest clips kept to answer Wants
+    static constexpr int MaxGossipWanted{ 256 };
+    static constexpr int OverlayRepairRounds{ 15 };         // overlayRepairTimeout waits for our own children at most
+    static constexpr int DeltaBases{ 4 };                   // latest clips per origin kept to make or apply deltas
+    // clientSockets key of the hub connection, no node id is ever 0
+    static constexpr quint64 HubNodeId{ 0 };
+
+    ClipShareTransport(const ClipShareConfig& config, QObject *parent = Q_NULLPTR);
+    ~ClipShareTransport();
+
+    // bind the heartbeat socket, listen for packages and start heartbeating
+    bool start();
+
+    quint64 getNodeId() const;
+    quint16 getPackagePort() const;
+    const ClipShareConfig& getConfig() const;
+    ClipSharePeerRegistry& getPeerRegistry();
+
+    // stamp origin and trace, encode once, write the same frame to every connected peer
+    void send(ClipSharePackage);
+
+signals:
+
+    // the socket is nullptr for clips that came as a datagram or through shared memory
+    void packageReceived(const QTcpSocket*, const ClipSharePackage&);
+
+public slots:
+
+    void broadcastHeartbeat();
+    void connectPeer(const ClipSharePeer&);
+    void disconnectPeer(const ClipSharePeer&);
+
+protected:
+    void acceptConnections();
+    void readDatagrams();
+    void readPackages(QTcpSocket*);
+    void readControl(QTcpSocket*);
+    void connectHub();
+    // decode, acknowledge and emit one clip received on conn
+    void deliverPackage(QTcpSocket* conn, const QByteArray& payload, quint32 stream, qint64 firstByteAt, qint64 receivedAt);
+    void readClipDatagram(const QByteArray& data, const QHostAddress& sender, quint16 senderPort, qint64 receivedAt);
+    void readLocalClip(quint64 peerNodeId, const QByteArray& payload, qint64 receivedAt);
+    bool acceptSequence(const ClipSharePackage&);
+
+    // deltas of text clips, see ClipShareConfig::deltaMinSize
+    void rememberBase(const ClipSharePackage&);
+    const ClipSharePackage* findBase(quint64 origin, quint64 sequence) const;
+    struct ClientStream;
+    // payload, or package pruned to the formats the peer accepts and as a delta against its base,
+    // encoded once per combination of the two in payloads
+    QByteArray peerPayload(const ClipSharePackage&, const ClientStream&, bool delta, const QByteArray& payload, QHash<QString, QPair<QByteArray, bool>>& payloads);
+
+    // sending side, see send()
+    void cancelQueued();
+    int sendLocal(const ClipSharePackage&);
+    // registry peers the group paths send our latest clip to, those in ringPeers are left out
+    QList<ClipSharePeer> groupPeers() const;
+    int enqueue(const ClipSharePackage&, QTcpSocket* only = nullptr);
+    bool sendDatagram(const ClipSharePackage&);
+    bool sendMulticast(const ClipSharePackage&);
+    int sendOverlay(const ClipSharePackage&);
+
+    // gossip mode, see ClipShareConfig::gossipFanout
+    int sendGossip(const ClipSharePackage&);
+    int pushGossip(const ClipSharePackage&, int fanout);
+    void readGossip(const ClipShareClipDatagram&, const QHostAddress& sender, quint16 senderPort, qint64 receivedAt);
+    void gossipReceived(const ClipSharePackage&);
+    void gossipLatest();
+    void sendFragments();
+    void retryDatagram();
+    void readFragment(const ClipShareClipDatagram&, const QHostAddress& sender, quint16 senderPort, qint64 receivedAt);
+    void removeClient(quint64 peerNodeId, QTcpSocket*);
+
+    // overlay tree, see ClipShareRoutePackage
+    struct Relay
+    {
+        QTcpSocket* conn;
+        quint32 stream;
+    };
+    void openRelays(ClipShareRoutePackage route, quint32 parent, QList<Relay>& relays);
+    void readRoute(QTcpSocket*, const QByteArray& payload);
+    void relayChunk(QTcpSocket*, const ClipShareChunkHeader&, const char* data);
+    void dropRelays(QTcpSocket*);
+    // members that did not report the clip, skipped or below a lost relay, get it on their own connection
+    void repairOverlay();
+
+    // package server limits, see ClipShareConfig::packageMax*
+    void evictConnection(QTcpSocket*, const char* reason);
+    void evictIdleConnections();
+
+    bool allowHeartbeatFrom(const QHostAddress& sender, qint64 now);
+    // clips and gossip from addresses the registry does not know, a bucket apart from the heartbeats'
+    bool allowClipFrom(const ClipShareClipDatagram&, const QHostAddress& sender, qint64 now);
+    // Acks and Nacks of the fast path clip count from the peers it waits for only, at the address we know them by
+    bool fastPathMember(const ClipShareClipDatagram&, const QHostAddress& sender) const;
+    ClipShareHeartbeatPackage makeHeartbeat(std::uint32_t command) const;
+
+    // clipshare_heartbeat_dropped_total, counted without a lookup and rendered by a collector
+    enum DropReason
+    {
+        DropSize,
+        DropMagic,
+        DropRate,
+        DropReasonCount
+    };
+    void countDrop(DropReason reason) { droppedDatagrams[reason].fetch_add(1, std::memory_order_relaxed); }
+    void exposeDrops(std::string& out) const;
+
+    // queue depth gauges for /metrics
+    void updateQueueDepth();
+    static void countFormatBytes(const char* metric, const ClipSharePackage&, int copies);
+
+    ClipShareConfig config;
+    quint64 nodeId;
+    quint64 sequence{ 0 };                      // of the last clip we sent
+    QHash<quint64, quint64> latestSequence;     // of the last clip received, by origin
+    QHash<quint64, QList<ClipSharePackage>> deltaBases;     // text formats of the latest clips by origin, ours included, newest last
+    ClipSharePackage lastSent;                  // sent again in full to a peer that lacks its delta base
+
+    ClipSharePeerRegistry peerRegistry;
+    quint32 hostId;                     // see ClipShareLocalChannel::hostId
+    ClipShareLocalChannel localChannel;
+    QSet<quint64> ringPeers;            // same-host peers our latest clip went to through their ring
+
+    QTcpServer packageReciver{ this };
+    QByteArray acceptedFormats;         // the ClipShareFormatsPackage written to every accepted connection
+    struct ClientStream
+    {
+        ClipShareStreamWriter writer;
+        ClipShareFrame control;             // acknowledgements coming back
+        QHash<quint32, qint64> unacked;     // stream id => ClipShareTrace::now() it was queued
+        QHash<quint32, quint64> sequences;  // stream id => sequence of the clip, until acknowledged
+        quint64 ackedSequence{ 0 };         // latest of our clips the peer acknowledged, its delta base
+        QSet<quint32> ownStreams;           // queued since our last clip and carrying ours, relays and other origins are left alone
+        QStringList acceptedFormats;        // as the peer asked, empty for all of them
+    };
+
+    QMap<quint64, QTcpSocket*> clientSockets;           // outgoing, by peer node id
+    QMap<QTcpSocket*, ClientStream> clientStreams;      // outgoing, with their queued messages
+    QMap<QTcpSocket*, ClipShareFrame> serverSockets;    // incoming, with their partial frames
+    qint64 receiveBuffered{ 0 };                        // pendingBytes() of all serverSockets
+    QTimer connectionSweepTimer{ this };
+    QMap<QPair<QTcpSocket*, quint32>, QList<Relay>> relays;     // incoming stream => the streams its chunks are copied to
+    QHash<QPair<QTcpSocket*, quint32>, quint64> routedStreams;  // incoming stream of a tree clip => its origin, told once it is here
+
+    // the latest clip we sent down the tree, until every member reported it
+    struct Overlay
+    {
+        ClipSharePackage package;
+        QList<Relay> children;      // ours, the repair waits until they are written
+        QSet<quint64> pending;      // member node ids
+        int rounds{ 0 };
+    };
+    Overlay overlay;
+    QTimer overlayRepairTimer{ this };
+
+    // a misbehaving sender must not flood the log
+    ClipShareLogLimiter invalidHeartbeatLog;
+    ClipShareLogLimiter invalidPackageLog;
+    ClipShareLogLimiter rejectedConnectionLog;
+
+    QUdpSocket heartbeatBroadcaster{ this };
+    QByteArray datagramBuffer;
+
+    // the latest clip sent as one datagram or multicast fragments, until every peer acknowledged it
+    struct FastPath
+    {
+        ClipSharePackage package;
+        QByteArray datagram;
+        QSet<quint64> unacked;      // peer node ids
+        int attempts{ 0 };
+
+        QList<QByteArray> fragments;
+        int nextFragment{ 0 };
+        QList<int> retransmit;      // indices, before the remaining fragments
+        int retransmitted{ 0 };     // fragments queued again on Nacks
+    };
+    FastPath fastPath;
+    QTimer fastPathTimer{ this };
+    QTimer multicastTimer{ this };
+    ClipShareReassembly reassembly;
+    ClipShareBloomFilter gossipSeen;
+    QList<ClipSharePackage> gossipCache;        // newest last
+    QHash<quint64, qint64> gossipWanted;        // bloom key => ClipShareTrace::now() the Want may be repeated
+    QTimer gossipTimer{ this };
+    struct AddressHash
+    {
+        std::size_t operator()(const QHostAddress& address) const { return qHash(address); }
+    };
+    ClipShareSourceLimiter<QHostAddress, AddressHash> heartbeatSources;     // per sender, see allowHeartbeatFrom
+    ClipShareSourceLimiter<QHostAddress, AddressHash> clipSources;          // per sender, see allowClipFrom
+    ClipShareSourceLimiter<QHostAddress, AddressHash> nackSources;          // per sender, see fastPathMember
+    std::atomic<quint64> droppedDatagrams[DropReasonCount]{};
+    QTimer heartbeatTimer{ this };
+};
@@ -3,7 +3,7 @@
 
 #include <QApplication>
 
-class QLocalServer;
+class SingleInstance;
 
 class SingleApplication : public QApplication
 {
@@ -11,16 +11,10 @@ class SingleApplication : public QApplication
 public:
 	SingleApplication(int& argc, char** argv);
 	bool instanceRunning() const;					// 实例已经运行
-	void receiveNewLocalConnection();				// 收到新的连接
 signals:
 	void newInstanceStartup(QStringList commandLine);	// 新实例启动
 private:
-
-	void initLocalConnection();		// 初始化本地连接
-	void createLocalServer();		// 创建服务端
-	bool isInstanceRunning;			// 是否已经有实例在运行
-	QLocalServer* localServer;		// 本地socket Server
-	QString serverName;				// 服务名称
+	SingleInstance* singleInstance;	// 单实例守护
 };
 
-#endif // SINGLEAPPLICATION_H
\ No newline at end of file
+#endif // SINGLEAPPLICATION_H
@@ -0,0 +1,27 @@
+﻿#ifndef SINGLEINSTANCE_H
+#define SINGLEINSTANCE_H
+
+#include <QObject>
+#include <QStringList>
+
+class QLocalServer;
+
+class SingleInstance : public QObject
+{
+	Q_OBJECT
+public:
+	SingleInstance(const QString& serverName, QObject* parent = Q_NULLPTR);
+	bool instanceRunning() const;					// 实例已经运行
+	void receiveNewLocalConnection();				// 收到新的连接
+signals:
+	void newInstanceStartup(QStringList commandLine);	// 新实例启动
+private:
+
+	void initLocalConnection();		// 初始化本地连接
+	void createLocalServer();		// 创建服务端
+	bool isInstanceRunning;			// 是否已经有实例在运行
+	QLocalServer* localServer;		// 本地socket Server
+	QString serverName;				// 服务名称
+};
+
+#endif // SINGLEINSTANCE_H
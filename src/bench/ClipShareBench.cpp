@@ -0,0 +1,411 @@
+﻿#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QMimeData>
+#include <QBuffer>
+#include <QImage>
+#include <QPainter>
+#include <QRandomGenerator>
+#include <QFile>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include "ClipShareChunker.h"
+#include "ClipShareClipboard.h"
+#include "ClipShareLog.h"
+#include "ClipSharePackage.h"
+#include "ClipShareService.h"
+
+// Allocation counters, every operator new in the process goes through here.
+namespace
+{
+    std::atomic<std::uint64_t> allocationCount{ 0 };
+    std::atomic<std::uint64_t> allocationBytes{ 0 };
+}
+
+void* operator new(std::size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocationBytes.fetch_add(size, std::memory_order_relaxed);
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+    /// <summary>
+    /// One synthetic clipboard content
+    /// </summary>
+    struct BenchCorpus
+    {
+        QString type;       // text / html / screenshot / photo
+        QString name;
+        QImage image;
+        QByteArray text;
+        qint64 bytes{ 0 };  // size of the raw clipboard content
+
+        QMimeData* mimeData() const
+        {
+            auto mime = new QMimeData;
+            if (type == "text")
+                mime->setText(QString::fromUtf8(text));
+            else if (type == "html")
+            {
+                mime->setHtml(QString::fromUtf8(text));
+                mime->setText(QString::fromUtf8(text));
+            }
+            else
+                mime->setImageData(image);
+            return mime;
+        }
+    };
+
+    struct BenchResult
+    {
+        QString stage;
+        const BenchCorpus* corpus;
+        qint64 iterations{ 0 };
+        qint64 nanoseconds{ 0 };
+        std::uint64_t allocations{ 0 };
+        std::uint64_t allocatedBytes{ 0 };
+        qint64 outputBytes{ 0 };
+    };
+
+    QByteArray makeText(int size)
+    {
+        static const QByteArray words{ "clip share copy paste lorem ipsum dolor sit amet consectetur adipiscing elit " };
+        QByteArray text;
+        text.reserve(size);
+        while (text.size() < size)
+        {
+            text.append(words);
+            if (text.size() % 97 < words.size())
+                text.append('\n');
+        }
+        text.resize(size);
+        return text;
+    }
+
+    QByteArray makeHtml(int size)
+    {
+        QByteArray html{ "<html><body><table>" };
+        int row = 0;
+        while (html.size() < size)
+        {
+            html.append("<tr><td style=\"color:#333;font-family:sans-serif\">");
+            html.append(QByteArray::number(row++));
+            html.append("</td><td><b>");
+            html.append(makeText(48));
+            html.append("</b></td></tr>\n");
+        }
+        html.append("</table></body></html>");
+        return html;
+    }
+
+    // flat colors, text and window chrome compress well, like real screenshots
+    QImage makeScreenshot(int width, int height)
+    {
+        QImage image(width, height, QImage::Format_ARGB32);
+        image.fill(QColor(0xf3, 0xf3, 0xf3));
+        QPainter painter(&image);
+        auto random = QRandomGenerator(0x5c);
+        for (int i = 0; i < 64; ++i)
+        {
+            QRect window(random.bounded(width), random.bounded(height), random.bounded(width / 2) + 64, random.bounded(height / 2) + 48);
+            painter.fillRect(window, QColor::fromRgb(random.generate()));
+            painter.fillRect(window.adjusted(0, 0, 0, -(window.height() - 24)), QColor(0x2b, 0x57, 0x9a));
+            painter.setPen(Qt::black);
+            painter.drawText(window.adjusted(8, 32, -8, -8), Qt::TextWordWrap, QString::fromUtf8(makeText(400)));
+        }
+        return image;
+    }
+
+    // gradients with noise compress badly, like camera photos
+    QImage makePhoto(int width, int height)
+    {
+        QImage image(width, height, QImage::Format_RGB32);
+        auto random = QRandomGenerator(0x9e);
+        for (int y = 0; y < height; ++y)
+        {
+            auto line = reinterpret_cast<QRgb*>(image.scanLine(y));
+            for (int x = 0; x < width; ++x)
+            {
+                int noise = random.bounded(32);
+                line[x] = qRgb((x * 255 / width + noise) & 0xff, (y * 255 / height + noise) & 0xff, (128 + noise) & 0xff);
+            }
+        }
+        return image;
+    }
+
+    std::vector<BenchCorpus> makeCorpus()
+    {
+        std::vector<BenchCorpus> corpus;
+        for (int size : { 64, 1 << 10, 64 << 10, 1 << 20 })
+        {
+            BenchCorpus text;
+            text.type = "text";
+            text.name = QString("text-%1").arg(size);
+            text.text = makeText(size);
+            text.bytes = text.text.size();
+            corpus.push_back(text);
+
+            BenchCorpus html;
+            html.type = "html";
+            html.name = QString("html-%1").arg(size);
+            html.text = makeHtml(size);
+            html.bytes = html.text.size();
+            corpus.push_back(html);
+        }
+        for (auto size : { QSize(1280, 720), QSize(1920, 1080), QSize(3840, 2160) })
+        {
+            BenchCorpus screenshot;
+            screenshot.type = "screenshot";
+            screenshot.name = QString("screenshot-%1x%2").arg(size.width()).arg(size.height());
+            screenshot.image = makeScreenshot(size.width(), size.height());
+            screenshot.bytes = screenshot.image.sizeInBytes();
+            corpus.push_back(screenshot);
+        }
+        for (auto size : { QSize(1280, 960), QSize(4032, 3024) })
+        {
+            BenchCorpus photo;
+            photo.type = "photo";
+            photo.name = QString("photo-%1x%2").arg(size.width()).arg(size.height());
+            photo.image = makePhoto(size.width(), size.height());
+            photo.bytes = photo.image.sizeInBytes();
+            corpus.push_back(photo);
+        }
+        return corpus;
+    }
+
+    /// <summary>
+    /// Runs one stage until minTime has passed, at least minIterations times.
+    /// The stage returns the size of what it produced, so nothing is optimized out.
+    /// </summary>
+    BenchResult measure(const QString& stage, const BenchCorpus& corpus, qint64 minTime, int minIterations, const std::function<qint64()>& body)
+    {
+        // warm up caches and lazy statics out of the numbers
+        body();
+
+        BenchResult result{ stage, &corpus };
+        auto allocationStart = allocationCount.load();
+        auto allocationBytesStart = allocationBytes.load();
+        QElapsedTimer timer;
+        timer.start();
+        while (result.iterations < minIterations || timer.elapsed() < minTime)
+        {
+            result.outputBytes = body();
+            ++result.iterations;
+        }
+        result.nanoseconds = timer.nsecsElapsed();
+        result.allocations = allocationCount.load() - allocationStart;
+        result.allocatedBytes = allocationBytes.load() - allocationBytesStart;
+        return result;
+    }
+
+    nlohmann::json toJson(const BenchResult& result)
+    {
+        auto perOp = static_cast<double>(result.nanoseconds) / result.iterations;
+        return {
+            { "stage", result.stage },
+            { "corpus", result.corpus->name },
+            { "type", result.corpus->type },
+            { "inputBytes", result.corpus->bytes },
+            { "outputBytes", result.outputBytes },
+            { "iterations", result.iterations },
+            { "nsPerOp", perOp },
+            { "mbPerSecond", result.corpus->bytes / perOp * 1e9 / (1 << 20) },
+            { "allocationsPerOp", static_cast<double>(result.allocations) / result.iterations },
+            { "allocatedBytesPerOp", static_cast<double>(result.allocatedBytes) / result.iterations },
+        };
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication a(argc, argv);
+    ClipShareLog::setLevels("warn");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("ClipShare pipeline micro-benchmarks");
+    parser.addHelpOption();
+    QCommandLineOption minTimeOption{ "min-time", "Minimum milliseconds per stage and corpus.", "ms", "200" };
+    QCommandLineOption minIterationsOption{ "min-iterations", "Minimum iterations per stage and corpus.", "count", "3" };
+    QCommandLineOption outputOption{ "output", "Write the JSON report to a file instead of stdout.", "file" };
+    QCommandLineOption filterOption{ "filter", "Only run stages whose name contains this text.", "stage" };
+    parser.addOptions({ minTimeOption, minIterationsOption, outputOption, filterOption });
+    parser.process(a);
+
+    auto minTime = parser.value(minTimeOption).toLongLong();
+    auto minIterations = parser.value(minIterationsOption).toInt();
+    auto filter = parser.value(filterOption);
+
+    std::vector<BenchResult> results;
+    auto run = [&](const QString& stage, const BenchCorpus& corpus, const std::function<qint64()>& body)
+    {
+        if (!filter.isEmpty() && !stage.contains(filter))
+            return;
+        results.push_back(measure(stage, corpus, minTime, minIterations, body));
+    };
+
+    // an idle service on an in-memory clipboard: each injected change runs the
+    // whole capture -> encode -> send path synchronously, with no peer to write to
+    ClipShareVirtualClipboard virtualClipboard;
+    ClipShareService service{ ClipShareConfig{}, &virtualClipboard };
+
+    // outlives the loop, the results point into it until the report is written
+    const auto corpora = makeCorpus();
+    for (auto& corpus : corpora)
+    {
+        QScopedPointer<QMimeData> mimeData{ corpus.mimeData() };
+
+        // what the dataChanged handler reads out of the clipboard
+        run("snapshot", corpus, [&]
+            {
+                qint64 bytes = 0;
+                for (auto& format : mimeData->formats())
+                    bytes += mimeData->data(format).size();
+                return bytes;
+            });
+
+        auto snapshot = ClipShareSnapshot::capture(mimeData.data());
+        run("pipeline", corpus, [&]
+            {
+                virtualClipboard.inject(snapshot);
+                return virtualClipboard.injectedCount();
+            });
+
+        run("encodeMimeData", corpus, [&]
+            {
+                ClipSharePackage package;
+                package.encodeMimeData(mimeData.data());
+                return static_cast<qint64>(package.mimeImageData.size() + package.mimeData.join().size());
+            });
+
+        QByteArray raw = corpus.text;
+        if (!corpus.image.isNull())
+        {
+            run("pngEncode", corpus, [&]
+                {
+                    QByteArray png;
+                    QBuffer buffer(&png);
+                    buffer.open(QIODevice::WriteOnly);
+                    corpus.image.save(&buffer, ClipSharePackage::DefaultMimeImageType);
+                    return static_cast<qint64>(png.size());
+                });
+
+            QBuffer buffer(&raw);
+            buffer.open(QIODevice::WriteOnly);
+            corpus.image.save(&buffer, ClipSharePackage::DefaultMimeImageType);
+        }
+
+        run("base64", corpus, [&]
+            {
+                return static_cast<qint64>(raw.toBase64().size());
+            });
+
+        // cut points only, without the hash of each chunk
+        run("chunk", corpus, [&]
+            {
+                auto data = reinterpret_cast<const std::uint8_t*>(raw.constData());
+                std::size_t size = static_cast<std::size_t>(raw.size());
+                qint64 chunks = 0;
+                for (std::size_t offset = 0; offset < size; ++chunks)
+                    offset += ClipShareChunker::boundary(data + offset, size - offset);
+                return chunks;
+            });
+
+        ClipSharePackage package;
+        package.encodeMimeData(mimeData.data());
+        package.sender = "bench";
+        package.receiver = "239.99.115.102";
+
+        run("jsonDump", corpus, [&]
+            {
+                return static_cast<qint64>(package.encode().size());
+            });
+
+        auto encoded = package.encode();
+        run("jsonParse", corpus, [&]
+            {
+                auto json = nlohmann::json::parse(encoded.constData(), encoded.constData() + encoded.size());
+                return static_cast<qint64>(json.size());
+            });
+
+        auto json = nlohmann::json::parse(encoded.constData(), encoded.constData() + encoded.size());
+        run("fromJson", corpus, [&]
+            {
+                auto decoded = json.get<ClipSharePackage>();
+                return static_cast<qint64>(decoded.mimeImageData.size() + decoded.mimeFormats.size());
+            });
+    }
+
+    // fixed size, measured once against a dummy corpus
+    BenchCorpus heartbeatCorpus;
+    heartbeatCorpus.type = "heartbeat";
+    heartbeatCorpus.name = "heartbeat";
+    heartbeatCorpus.bytes = sizeof(ClipShareHeartbeatPackage);
+    auto heartbeat = QByteArray(reinterpret_cast<const char*>(&ClipShareHeartbeatPackage_Heartbeat), sizeof(ClipShareHeartbeatPackage));
+    run("heartbeatParse", heartbeatCorpus, [&]
+        {
+            ClipShareHeartbeatPackage pkg;
+            return static_cast<qint64>(ClipShareHeartbeatPackage::parse(heartbeat, pkg) && pkg.valid());
+        });
+
+    nlohmann::json report;
+    report["benchmark"] = "clipshare_bench";
+    report["qtVersion"] = qVersion();
+    report["minTimeMs"] = minTime;
+    report["results"] = nlohmann::json::array();
+    for (auto& result : results)
+        report["results"].push_back(toJson(result));
+
+    auto text = QByteArray::fromStdString(report.dump(2));
+    if (parser.isSet(outputOption))
+    {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        {
+            spdlog::error("[Bench] Cannot write {}", parser.value(outputOption));
+            return 1;
+        }
+        file.write(text);
+    }
+    else
+    {
+        fwrite(text.constData(), 1, text.size(), stdout);
+        fputc('\n', stdout);
+    }
+    return 0;
+}
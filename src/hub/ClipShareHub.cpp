@@ -0,0 +1,801 @@
+﻿#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include "ClipShareChunk.h"
+#include "ClipShareHub.h"
+#include "ClipShareMetrics.h"
+
+namespace
+{
+    constexpr std::size_t ReadSize{ 256 * 1024 };
+    constexpr int MaxOpenStreams{ 64 };
+    constexpr int MaxEvents{ 256 };
+    constexpr std::int64_t SaveInterval{ 10000 };   // ms between writes of the store cursors
+    constexpr std::size_t CatchUpSliceBytes{ 4 << 20 };     // retained clips read and queued at a time
+
+    // the ClipShareControlPackage commands the hub speaks, it does not share the Qt side's headers
+    constexpr int AckCommand{ 2 };      // ClipShareControlPackage::Ack
+    constexpr int HelloCommand{ 3 };    // ClipShareControlPackage::Hello
+
+    std::int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct Outgoing
+    {
+        ClipShareHubFrame frame;
+        std::size_t offset{ 0 };
+        std::uint8_t priority{ 0 };
+        std::uint64_t source{ 0 };
+        std::uint64_t sequence{ 0 };    // store sequence of the last clip in frame
+        std::size_t chunkEnd{ 0 };      // offset of the next chunk boundary, see flush()
+        bool catchUp{ false };          // a slice of retained clips, the next one is read once it is written
+    };
+
+    struct Connection
+    {
+        int fd{ -1 };
+        std::uint64_t id{ 0 };
+        std::uint64_t node{ 0 };        // from Hello, 0 until then
+        std::uint64_t delivered{ 0 };   // store sequence of the last clip written
+        std::uint64_t advanced{ 0 };    // delivered as the store knows it, told once per flush
+        bool catchingUp{ false };       // retained clips after catchUpAfter up to catchUpUntil are still to be sent
+        std::uint64_t catchUpAfter{ 0 };
+        std::uint64_t catchUpUntil{ 0 };
+        std::string peer;
+        std::int64_t lastActivity{ 0 };
+
+        // chunks not parsed yet, from inputHead on
+        std::vector<std::uint8_t> input;
+        std::size_t inputHead{ 0 };
+        std::unordered_map<std::uint32_t, std::vector<std::uint8_t>> streams;
+        std::size_t streamBytes{ 0 };
+
+        std::deque<Outgoing> output;
+        std::size_t queued{ 0 };
+        bool writable{ true };      // false while EPOLLOUT is armed
+    };
+}
+
+/// <summary>
+/// One reactor thread: its own epoll set, SO_REUSEPORT listener and clients.
+/// Other threads only reach it through post() and stop(), which wake it with an eventfd.
+/// </summary>
+class ClipShareHubLoop
+{
+public:
+    ClipShareHubLoop(ClipShareHub& hub, int index)
+        : hub(hub)
+        , index(index)
+    {
+    }
+
+    ~ClipShareHubLoop()
+    {
+        for (auto& item : connections)
+            ::close(item.first);
+        for (auto fd : { listener, wakeup, epoll })
+        {
+            if (fd >= 0)
+                ::close(fd);
+        }
+    }
+
+    bool open(const ClipShareHubConfig& config)
+    {
+        listener = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener < 0)
+            return fail("socket");
+
+        int on = 1;
+        ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        // the kernel spreads new connections over the listeners of all loops
+        if (::setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+            return fail("SO_REUSEPORT");
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<std::uint16_t>(config.port));
+        if (::inet_pton(AF_INET, config.host.c_str(), &address.sin_addr) != 1)
+        {
+            spdlog::error("[Hub] Invalid host {}", config.host);
+            return false;
+        }
+        if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+            return fail("bind");
+        if (::listen(listener, SOMAXCONN) < 0)
+            return fail("listen");
+
+        epoll = ::epoll_create1(EPOLL_CLOEXEC);
+        wakeup = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll < 0 || wakeup < 0)
+            return fail("epoll");
+
+        watch(listener, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakeup, EPOLLIN, EPOLL_CTL_ADD);
+        return true;
+    }
+
+    void start()
+    {
+        thread = std::thread([this] { run(); });
+    }
+
+    void join()
+    {
+        if (thread.joinable())
+            thread.join();
+    }
+
+    // thread safe
+    void post(const ClipShareHubFrame& frame, std::uint8_t priority, std::uint64_t source, std::uint64_t sequence)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            posted.push_back(Outgoing{ frame, 0, priority, source, sequence });
+        }
+        wake();
+    }
+
+    // thread safe
+    void stop()
+    {
+        stopping = true;
+        wake();
+    }
+
+private:
+    void run()
+    {
+        epoll_event events[MaxEvents];
+        auto lastSweep = nowMs();
+        while (!stopping)
+        {
+            auto count = ::epoll_wait(epoll, events, MaxEvents, 1000);
+            if (count < 0 && errno != EINTR)
+            {
+                fail("epoll_wait");
+                break;
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                auto fd = events[i].data.fd;
+                if (fd == listener)
+                    accept();
+                else if (fd == wakeup)
+                    drainPosted();
+                else
+                    handle(fd, events[i].events);
+            }
+
+            auto now = nowMs();
+            if (now - lastSweep >= 1000)
+            {
+                sweep(now);
+                lastSweep = now;
+            }
+        }
+    }
+
+    void accept()
+    {
+        while (true)
+        {
+            sockaddr_in address{};
+            socklen_t length = sizeof(address);
+            auto fd = ::accept4(listener, reinterpret_cast<sockaddr*>(&address), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    fail("accept");
+                break;
+            }
+
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+            char host[INET_ADDRSTRLEN]{};
+            ::inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+            auto& conn = connections[fd];
+            conn.fd = fd;
+            conn.id = (static_cast<std::uint64_t>(index) << 48) | ++accepted;
+            conn.peer = fmt::format("{}:{}", host, ntohs(address.sin_port));
+            conn.lastActivity = nowMs();
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+            spdlog::info("[Hub] Client {} connected on loop {}", conn.peer, index);
+        }
+        updateGauge();
+    }
+
+    void handle(int fd, std::uint32_t events)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end())
+            return;
+
+        auto& conn = it->second;
+        if (events & (EPOLLERR | EPOLLHUP))
+        {
+            close(conn, "hangup");
+            return;
+        }
+        if ((events & EPOLLOUT) && !flush(conn))
+            return;
+        if (events & (EPOLLIN | EPOLLRDHUP))
+            read(conn);
+    }
+
+    void read(Connection& conn)
+    {
+        auto& metrics = ClipShareMetrics::instance();
+        // one bounded read per wakeup keeps a busy client from starving the others
+        auto offset = conn.input.size();
+        conn.input.resize(offset + ReadSize);
+        auto received = ::recv(conn.fd, conn.input.data() + offset, ReadSize, 0);
+        if (received <= 0)
+        {
+            auto error = errno;
+            conn.input.resize(offset);
+            if (received == 0 || (error != EAGAIN && error != EWOULDBLOCK && error != EINTR))
+                close(conn, received == 0 ? "closed" : std::strerror(error));
+            return;
+        }
+        conn.input.resize(offset + static_cast<std::size_t>(received));
+        conn.lastActivity = nowMs();
+        metrics.increment("clipshare_hub_received_bytes_total", {}, static_cast<double>(received));
+
+        if (!parse(conn))
+            return;
+
+        // drop the consumed chunks once per read
+        if (conn.inputHead > 0)
+        {
+            conn.input.erase(conn.input.begin(), conn.input.begin() + static_cast<std::ptrdiff_t>(conn.inputHead));
+            conn.inputHead = 0;
+        }
+
+        // acknowledgements queued while parsing
+        if (conn.writable)
+            flush(conn);
+    }
+
+    // false when the connection was closed
+    bool parse(Connection& conn)
+    {
+        auto& config = hub.getConfig();
+        while (conn.input.size() - conn.inputHead >= ClipShareChunkHeader::Size)
+        {
+            auto header = ClipShareChunkHeader::read(conn.input.data() + conn.inputHead);
+            if (header.length > config.maxFrameBytes)
+                return close(conn, "frame too large");
+            if (conn.input.size() - conn.inputHead < ClipShareChunkHeader::Size + header.length)
+                break;
+
+            auto chunk = conn.input.data() + conn.inputHead + ClipShareChunkHeader::Size;
+            conn.inputHead += ClipShareChunkHeader::Size + header.length;
+
+            // pings only keep the connection alive, a Hello names the subscriber
+            if (header.stream == ClipShareChunkHeader::ControlStream)
+            {
+                if (!hello(conn, chunk, header.length))
+                    return false;
+                continue;
+            }
+
+            if (header.flags & ClipShareChunkHeader::Cancel)
+            {
+                auto it = conn.streams.find(header.stream);
+                if (it != conn.streams.end())
+                {
+                    unbuffer(conn, it->second.size());
+                    conn.streams.erase(it);
+                }
+                continue;
+            }
+
+            // a whole message in one chunk is forwarded without a copy into a stream
+            bool whole = (header.flags & ClipShareChunkHeader::Begin) && (header.flags & ClipShareChunkHeader::End);
+            if (whole && conn.streams.count(header.stream) == 0)
+            {
+                forward(conn, header, chunk, header.length);
+                continue;
+            }
+
+            auto it = conn.streams.find(header.stream);
+            if (header.flags & ClipShareChunkHeader::Begin)
+            {
+                if (it != conn.streams.end())
+                {
+                    unbuffer(conn, it->second.size());
+                    it->second.clear();
+                }
+                else
+                {
+                    if (conn.streams.size() >= MaxOpenStreams)
+                        return close(conn, "too many streams");
+                    it = conn.streams.emplace(header.stream, std::vector<std::uint8_t>{}).first;
+                }
+            }
+            if (it == conn.streams.end())
+                continue;
+
+            if (it->second.size() + header.length > config.maxFrameBytes)
+                return close(conn, "message too large");
+            // the per client limits times the clients would still be too much
+            if (!hub.buffer(header.length))
+            {
+                ClipShareMetrics::instance().increment("clipshare_hub_evictions_total", { { "reason", "memory" } });
+                return close(conn, "hub buffers full");
+            }
+            it->second.insert(it->second.end(), chunk, chunk + header.length);
+            conn.streamBytes += header.length;
+
+            if (header.flags & ClipShareChunkHeader::End)
+            {
+                forward(conn, header, it->second.data(), it->second.size());
+                unbuffer(conn, it->second.size());
+                conn.streams.erase(it);
+            }
+        }
+        return true;
+    }
+
+    void unbuffer(Connection& conn, std::size_t size)
+    {
+        conn.streamBytes -= size;
+        hub.release(size);
+    }
+
+    void forward(Connection& conn, const ClipShareChunkHeader& header, const std::uint8_t* payload, std::size_t size)
+    {
+        ClipShareMetrics::instance().increment("clipshare_hub_messages_total");
+        auto store = hub.getStore();
+        auto sequence = store != nullptr ? store->append(conn.node, header.priority, payload, size) : 0;
+        hub.broadcast(ClipShareHub::makeFrame(hub.nextStream(), header.priority, payload, size), header.priority, conn.id, sequence);
+
+        // same acknowledgement a peer sends, the client's delivery summary then covers the hub
+        auto ack = nlohmann::json{ { "command", AckCommand }, { "stream", header.stream }, { "time", 0 } }.dump();
+        ClipShareChunkHeader control;
+        control.stream = ClipShareChunkHeader::ControlStream;
+        control.flags = ClipShareChunkHeader::Begin | ClipShareChunkHeader::End;
+        control.length = static_cast<std::uint32_t>(ack.size());
+        auto frame = std::make_shared<std::vector<std::uint8_t>>(ClipShareChunkHeader::Size + ack.size());
+        control.write(frame->data());
+        std::memcpy(frame->data() + ClipShareChunkHeader::Size, ack.data(), ack.size());
+        enqueue(conn, Outgoing{ frame, 0, 0, 0 });
+    }
+
+    // false when the connection was closed
+    bool hello(Connection& conn, const std::uint8_t* payload, std::size_t size)
+    {
+        std::uint64_t node = 0;
+        if (!ClipShareHub::readControl(payload, size, node))
+            return close(conn, "bad control message");
+
+        auto store = hub.getStore();
+        if (node == 0 || store == nullptr || conn.node != 0)
+            return true;
+
+        conn.node = node;
+        conn.catchUpAfter = store->subscribe(conn.node, conn.catchUpUntil);
+        conn.catchingUp = conn.catchUpAfter < conn.catchUpUntil;
+        catchUp(conn);
+        return true;
+    }
+
+    // queues the next slice of the retained clips, one at a time so the queue holds at most one
+    void catchUp(Connection& conn)
+    {
+        if (!conn.catchingUp)
+            return;
+        auto& config = hub.getConfig();
+        auto clips = hub.getStore()->catchUp(conn.node, conn.catchUpAfter, conn.catchUpUntil, std::min(CatchUpSliceBytes, config.maxQueuedBytes));
+        if (clips.empty())
+        {
+            conn.catchingUp = false;
+            return;
+        }
+        conn.catchUpAfter = clips.back().sequence;
+
+        // a slice goes out as one write, not a round trip per clip
+        std::size_t bytes = 0;
+        std::uint8_t priority = 0xff;
+        for (auto& clip : clips)
+        {
+            bytes += clip.payload.size() + ClipShareChunkHeader::Size * (clip.payload.size() / ClipShareHub::ChunkSize + 1);
+            priority = std::min(priority, clip.priority);
+        }
+        auto batch = std::make_shared<std::vector<std::uint8_t>>();
+        batch->reserve(bytes);
+        for (auto& clip : clips)
+        {
+            auto frame = ClipShareHub::makeFrame(hub.nextStream(), clip.priority, clip.payload.data(), clip.payload.size());
+            batch->insert(batch->end(), frame->begin(), frame->end());
+        }
+        spdlog::debug("[Hub] Catch up {:016x} with {} clips, {} bytes", conn.node, clips.size(), batch->size());
+        Outgoing item{ batch, 0, priority, 0, clips.back().sequence };
+        item.catchUp = true;
+        enqueue(conn, std::move(item));
+    }
+
+    void drainPosted()
+    {
+        std::uint64_t value = 0;
+        while (::read(wakeup, &value, sizeof(value)) > 0)
+        {
+        }
+
+        std::vector<Outgoing> items;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.swap(posted);
+        }
+
+        for (auto& item : items)
+        {
+            for (auto it = connections.begin(); it != connections.end();)
+            {
+                // flush may close the connection and erase it
+                auto& conn = (it++)->second;
+                if (conn.id == item.source)
+                    continue;
+                supersede(conn, item.source);
+                enqueue(conn, item);
+                if (conn.writable)
+                    flush(conn);
+            }
+        }
+    }
+
+    // a clipboard holds one value, a newer clip from the same client replaces the queued ones
+    void supersede(Connection& conn, std::uint64_t source)
+    {
+        for (auto it = conn.output.begin(); it != conn.output.end();)
+        {
+            if (it->source == source && it->offset == 0)
+            {
+                conn.queued -= it->frame->size();
+                it = conn.output.erase(it);
+                ClipShareMetrics::instance().increment("clipshare_hub_dropped_total", { { "reason", "superseded" } });
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // only queues, the callers flush once the connection may be closed under them
+    void enqueue(Connection& conn, Outgoing item)
+    {
+        auto& config = hub.getConfig();
+        // a slow client loses its oldest clips, not the hub its memory
+        while (conn.queued + item.frame->size() > config.maxQueuedBytes)
+        {
+            auto victim = std::find_if(conn.output.begin(), conn.output.end(), [](const Outgoing& queued) { return queued.offset == 0 && queued.source != 0; });
+            if (victim == conn.output.end())
+                break;
+            conn.queued -= victim->frame->size();
+            conn.output.erase(victim);
+            ClipShareMetrics::instance().increment("clipshare_hub_dropped_total", { { "reason", "queue" } });
+        }
+
+        conn.queued += item.frame->size();
+        conn.output.push_back(std::move(item));
+    }
+
+    // false when the connection was closed
+    bool flush(Connection& conn)
+    {
+        auto& metrics = ClipShareMetrics::instance();
+        while (!conn.output.empty())
+        {
+            // between chunks the most urgent frame goes first, a started chunk has to finish
+            auto& front = conn.output.front();
+            if (front.offset == front.chunkEnd)
+            {
+                auto best = std::min_element(conn.output.begin(), conn.output.end(),
+                    [](const Outgoing& a, const Outgoing& b) { return a.priority < b.priority; });
+                if (best != conn.output.begin() && best->priority < front.priority)
+                    std::iter_swap(conn.output.begin(), best);
+            }
+
+            // boundaries come from the headers, a catch-up batch holds messages of any size
+            auto& item = conn.output.front();
+            auto& frame = *item.frame;
+            while (item.chunkEnd <= item.offset && item.chunkEnd < frame.size())
+                item.chunkEnd += ClipShareChunkHeader::Size + ClipShareChunkHeader::read(frame.data() + item.chunkEnd).length;
+            auto length = frame.size() - item.offset;
+            if (conn.output.size() > 1)
+                length = std::min(length, item.chunkEnd - item.offset);
+
+            auto sent = ::send(conn.fd, frame.data() + item.offset, length, MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    if (conn.writable)
+                    {
+                        conn.writable = false;
+                        watch(conn.fd, EPOLLIN | EPOLLRDHUP | EPOLLOUT, EPOLL_CTL_MOD);
+                    }
+                    advance(conn);
+                    return true;
+                }
+                if (errno == EINTR)
+                    continue;
+                return close(conn, std::strerror(errno));
+            }
+
+            metrics.increment("clipshare_hub_sent_bytes_total", {}, static_cast<double>(sent));
+            item.offset += static_cast<std::size_t>(sent);
+            if (item.offset == frame.size())
+            {
+                // newer clips may pass a catch-up, the cursor waits until the retained ones are all out
+                if (item.sequence > conn.delivered && (item.catchUp || !conn.catchingUp))
+                    conn.delivered = item.sequence;
+                auto slice = item.catchUp;
+                conn.queued -= frame.size();
+                conn.output.pop_front();
+                if (slice)
+                    catchUp(conn);
+            }
+        }
+
+        if (!conn.writable)
+        {
+            conn.writable = true;
+            watch(conn.fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+        }
+        advance(conn);
+        return true;
+    }
+
+    // one store update for everything a flush wrote, not one per clip
+    void advance(Connection& conn)
+    {
+        if (conn.delivered <= conn.advanced || conn.node == 0 || hub.getStore() == nullptr)
+            return;
+        hub.getStore()->advance(conn.node, conn.delivered);
+        conn.advanced = conn.delivered;
+    }
+
+    void sweep(std::int64_t now)
+    {
+        auto idleTimeout = hub.getConfig().idleTimeout;
+        if (idleTimeout <= 0)
+            return;
+
+        for (auto it = connections.begin(); it != connections.end();)
+        {
+            auto& conn = (it++)->second;
+            if (now - conn.lastActivity > idleTimeout)
+                close(conn, "idle");
+        }
+    }
+
+    // always false, for the callers that return it
+    bool close(Connection& conn, const char* reason)
+    {
+        spdlog::info("[Hub] Client {} disconnected: {}", conn.peer, reason);
+        advance(conn);
+        hub.release(conn.streamBytes);
+        ::epoll_ctl(epoll, EPOLL_CTL_DEL, conn.fd, nullptr);
+        ::close(conn.fd);
+        connections.erase(conn.fd);
+        updateGauge();
+        return false;
+    }
+
+    void watch(int fd, std::uint32_t events, int operation)
+    {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        ::epoll_ctl(epoll, operation, fd, &event);
+    }
+
+    void wake()
+    {
+        std::uint64_t one = 1;
+        auto written = ::write(wakeup, &one, sizeof(one));
+        (void)written;
+    }
+
+    void updateGauge()
+    {
+        ClipShareMetrics::instance().set("clipshare_hub_connections", { { "loop", std::to_string(index) } }, static_cast<double>(connections.size()));
+    }
+
+    bool fail(const char* what)
+    {
+        spdlog::error("[Hub] Loop {} {}: {}", index, what, std::strerror(errno));
+        return false;
+    }
+
+    ClipShareHub& hub;
+    int index;
+    int listener{ -1 };
+    int epoll{ -1 };
+    int wakeup{ -1 };
+    std::uint64_t accepted{ 0 };
+    std::unordered_map<int, Connection> connections;
+    std::thread thread;
+    std::atomic<bool> stopping{ false };
+
+    std::mutex mutex;
+    std::vector<Outgoing> posted;
+};
+
+ClipShareHub::ClipShareHub(const ClipShareHubConfig& config)
+    : config(config)
+{
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.describe("clipshare_hub_connections", "Connected clients by event loop.");
+    metrics.describe("clipshare_hub_messages_total", "Messages received from clients and fanned out.");
+    metrics.describe("clipshare_hub_received_bytes_total", "Bytes read from clients.");
+    metrics.describe("clipshare_hub_sent_bytes_total", "Bytes written to clients.");
+    metrics.describe("clipshare_hub_dropped_total", "Queued messages dropped before they were written, by reason: superseded or queue.");
+    metrics.describe("clipshare_hub_evictions_total", "Clients closed by reason: memory, their incomplete messages did not fit maxBufferedBytes.");
+}
+
+ClipShareHub::~ClipShareHub()
+{
+    stop();
+    wait();
+}
+
+bool ClipShareHub::start()
+{
+    if (!config.storeDirectory.empty())
+    {
+        store = std::make_unique<ClipShareHubStore>(config.storeDirectory, config.storeClips, config.storeBytes, config.storeSubscribers);
+        if (!store->open())
+            return false;
+    }
+
+    auto count = config.threads > 0 ? config.threads : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (int i = 0; i < count; ++i)
+    {
+        loops.push_back(std::make_unique<ClipShareHubLoop>(*this, i));
+        if (!loops.back()->open(config))
+        {
+            loops.clear();
+            return false;
+        }
+    }
+
+    for (auto& loop : loops)
+        loop->start();
+    if (store != nullptr)
+    {
+        saver = std::thread([this]
+            {
+                std::unique_lock<std::mutex> lock{ saverMutex };
+                while (!saverWake.wait_for(lock, std::chrono::milliseconds(SaveInterval), [this] { return stopping; }))
+                {
+                    lock.unlock();
+                    store->save();
+                    lock.lock();
+                }
+            });
+    }
+    spdlog::info("[Hub] Listen on {}:{} with {} loops", config.host, config.port, count);
+    return true;
+}
+
+void ClipShareHub::stop()
+{
+    for (auto& loop : loops)
+        loop->stop();
+    {
+        std::lock_guard<std::mutex> lock{ saverMutex };
+        stopping = true;
+    }
+    saverWake.notify_all();
+}
+
+void ClipShareHub::wait()
+{
+    for (auto& loop : loops)
+        loop->join();
+    if (saver.joinable())
+        saver.join();
+}
+
+const ClipShareHubConfig& ClipShareHub::getConfig() const
+{
+    return config;
+}
+
+ClipShareHubFrame ClipShareHub::makeFrame(std::uint32_t stream, std::uint8_t priority, const std::uint8_t* payload, std::size_t size)
+{
+    auto chunks = std::max<std::size_t>(1, (size + ChunkSize - 1) / ChunkSize);
+    auto frame = std::make_shared<std::vector<std::uint8_t>>(chunks * ClipShareChunkHeader::Size + size);
+
+    auto out = frame->data();
+    for (std::size_t i = 0; i < chunks; ++i)
+    {
+        ClipShareChunkHeader header;
+        header.stream = stream;
+        header.priority = priority;
+        header.length = static_cast<std::uint32_t>(std::min<std::size_t>(ChunkSize, size - i * ChunkSize));
+        if (i == 0)
+            header.flags |= ClipShareChunkHeader::Begin;
+        if (i + 1 == chunks)
+            header.flags |= ClipShareChunkHeader::End;
+
+        header.write(out);
+        if (header.length > 0)
+            std::memcpy(out + ClipShareChunkHeader::Size, payload + i * ChunkSize, header.length);
+        out += ClipShareChunkHeader::Size + header.length;
+    }
+    return frame;
+}
+
+bool ClipShareHub::readControl(const std::uint8_t* payload, std::size_t size, std::uint64_t& node)
+{
+    node = 0;
+    // any client may send it, a field of the wrong type must not throw on the loop
+    auto control = nlohmann::json::parse(payload, payload + size, nullptr, false);
+    if (!control.is_object() || !control["command"].is_number_unsigned())
+        return false;
+    if (control["command"].get<std::uint64_t>() != HelloCommand)
+        return true;
+    if (!control["node"].is_number_unsigned())
+        return false;
+    node = control["node"].get<std::uint64_t>();
+    return node != 0;
+}
+
+void ClipShareHub::broadcast(const ClipShareHubFrame& frame, std::uint8_t priority, std::uint64_t source, std::uint64_t sequence)
+{
+    // the frame is shared, never copied, whatever number of clients and loops
+    for (auto& loop : loops)
+        loop->post(frame, priority, source, sequence);
+}
+
+ClipShareHubStore* ClipShareHub::getStore()
+{
+    return store.get();
+}
+
+bool ClipShareHub::buffer(std::size_t size)
+{
+    auto current = buffered.load();
+    do
+    {
+        if (config.maxBufferedBytes > 0 && current + size > config.maxBufferedBytes)
+            return false;
+    } while (!buffered.compare_exchange_weak(current, current + size));
+    return true;
+}
+
+void ClipShareHub::release(std::size_t size)
+{
+    buffered -= size;
+}
+
+std::uint32_t ClipShareHub::nextStream()
+{
+    auto stream = ++streams;
+    if (stream == ClipShareChunkHeader::ControlStream)
+        stream = ++streams;
+    return stream;
+}
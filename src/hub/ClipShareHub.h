@@ -0,0 +1,93 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ClipShareHubStore.h"
+
+/// <summary>
+/// Settings of clipshare_hub, from the command line.
+/// </summary>
+struct ClipShareHubConfig
+{
+    std::string host{ "0.0.0.0" };
+    int port{ 41689 };
+    int threads{ 0 };                               // event loops, 0 for one per core
+    std::size_t maxFrameBytes{ 64 << 20 };          // larger messages close the connection
+    std::size_t maxQueuedBytes{ 256 << 20 };        // per client, the oldest clips are dropped beyond it
+    std::size_t maxBufferedBytes{ 1024u << 20 };    // incomplete messages of all clients, the client that exceeds it is closed
+    int idleTimeout{ 600000 };                      // ms without a byte, clients ping with every heartbeat
+    int metricsPort{ 0 };                           // loopback /metrics endpoint, 0 disables it
+
+    std::string storeDirectory;                     // store and forward for offline subscribers, empty disables it
+    std::size_t storeClips{ 16 };                   // latest clips retained, 1 for the latest only
+    std::size_t storeBytes{ 256 << 20 };
+    std::size_t storeSubscribers{ 4096 };           // cursors kept, the longest absent is forgotten first
+};
+
+// a message as the chunks written to every client, shared by all write queues
+using ClipShareHubFrame = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+class ClipShareHubLoop;
+
+/// <summary>
+/// Relay for the ClipShare package protocol, clients connect to the hub instead of to every peer.
+/// Each complete message a client sends is written to all other clients. The frame is built
+/// once and shared by reference count between the write queues of all loops.
+/// Linux only: one epoll loop per thread, each accepting on its own SO_REUSEPORT listener.
+/// </summary>
+class ClipShareHub
+{
+public:
+    static constexpr int ChunkSize{ 16 * 1024 };
+
+    explicit ClipShareHub(const ClipShareHubConfig& config);
+    ~ClipShareHub();
+
+    bool start();
+    // thread safe, wait() returns once every loop has closed its clients
+    void stop();
+    void wait();
+
+    const ClipShareHubConfig& getConfig() const;
+
+    // a message cut into ChunkSize chunks of one stream, Begin on the first and End on the last
+    static ClipShareHubFrame makeFrame(std::uint32_t stream, std::uint8_t priority, const std::uint8_t* payload, std::size_t size);
+
+    // a control stream message: node is the subscriber a Hello names, 0 for any other command.
+    // false if it is not a control package or a Hello without a node, the client is closed
+    static bool readControl(const std::uint8_t* payload, std::size_t size, std::uint64_t& node);
+
+    // called by the loops, queues the frame on every client but source.
+    // sequence is the clip's place in the store, 0 without one
+    void broadcast(const ClipShareHubFrame& frame, std::uint8_t priority, std::uint64_t source, std::uint64_t sequence);
+
+    // nullptr without storeDirectory
+    ClipShareHubStore* getStore();
+
+    // stream ids of the frames the hub writes, never the control stream
+    std::uint32_t nextStream();
+
+    // incomplete message bytes held by all loops, false if size does not fit maxBufferedBytes
+    bool buffer(std::size_t size);
+    void release(std::size_t size);
+
+private:
+    ClipShareHubConfig config;
+    std::unique_ptr<ClipShareHubStore> store;
+    std::vector<std::unique_ptr<ClipShareHubLoop>> loops;
+    std::atomic<std::uint32_t> streams{ 0 };
+    std::atomic<std::size_t> buffered{ 0 };
+
+    // writes the store cursors, their fsync stays off the loops
+    std::thread saver;
+    std::mutex saverMutex;
+    std::condition_variable saverWake;
+    bool stopping{ false };
+};
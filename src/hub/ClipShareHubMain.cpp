@@ -0,0 +1,134 @@
+﻿#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <pthread.h>
+#include <cpp-httplib/httplib.h>
+#include <spdlog/spdlog.h>
+#include "ClipShareHub.h"
+#include "ClipShareMetrics.h"
+
+namespace
+{
+    void usage(const char* name)
+    {
+        std::printf(
+            "Usage: %s [options]\n"
+            "Relays ClipShare clips between all connected clients.\n"
+            "\n"
+            "  --host <address>       Listen address, default 0.0.0.0\n"
+            "  --port <port>          Listen port, default 41689\n"
+            "  --threads <count>      Event loops, default one per core\n"
+            "  --max-frame <bytes>    Largest message a client may send, default 64 MiB\n"
+            "  --max-queued <bytes>   Write queue per client before clips are dropped, default 256 MiB\n"
+            "  --max-buffered <bytes> Incomplete messages of all clients, 0 no limit, default 1 GiB\n"
+            "  --idle-timeout <ms>    Close silent clients after this long, 0 never, default 600000\n"
+            "  --metrics-port <port>  Serve /metrics on 127.0.0.1, default off\n"
+            "  --store <directory>    Keep the latest clips for subscribers that are away, default off\n"
+            "  --store-clips <count>  Clips kept, 1 for the latest only, default 16\n"
+            "  --store-bytes <bytes>  Bytes kept, default 256 MiB\n"
+            "  --store-subscribers <count>  Subscribers remembered, default 4096\n"
+            "  --log <level>          trace, debug, info, warn or error, default info\n"
+            "  --help                 Show this help\n",
+            name);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    ClipShareHubConfig config;
+    std::string level{ "info" };
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option{ argv[i] };
+        if (option == "--help" || option == "-h")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        std::string value{ argv[++i] };
+        if (option == "--host")
+            config.host = value;
+        else if (option == "--port")
+            config.port = std::atoi(value.c_str());
+        else if (option == "--threads")
+            config.threads = std::atoi(value.c_str());
+        else if (option == "--max-frame")
+            config.maxFrameBytes = std::strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--max-queued")
+            config.maxQueuedBytes = std::strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--max-buffered")
+            config.maxBufferedBytes = std::strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--idle-timeout")
+            config.idleTimeout = std::atoi(value.c_str());
+        else if (option == "--metrics-port")
+            config.metricsPort = std::atoi(value.c_str());
+        else if (option == "--store")
+            config.storeDirectory = value;
+        else if (option == "--store-clips")
+            config.storeClips = std::strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--store-bytes")
+            config.storeBytes = std::strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--store-subscribers")
+            config.storeSubscribers = std::strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--log")
+            level = value;
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    spdlog::set_level(spdlog::level::from_str(level));
+
+    // blocked before any thread starts, so only sigwait below sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    ClipShareHub hub{ config };
+    if (!hub.start())
+        return 1;
+
+    httplib::Server metricsServer;
+    std::thread metricsThread;
+    if (config.metricsPort > 0)
+    {
+        metricsServer.Get("/metrics", [](const httplib::Request&, httplib::Response& res)
+            {
+                res.set_content(ClipShareMetrics::instance().exposition(), "text/plain; version=0.0.4");
+            });
+        if (metricsServer.bind_to_port("127.0.0.1", config.metricsPort))
+        {
+            metricsThread = std::thread{ [&] { metricsServer.listen_after_bind(); } };
+            spdlog::info("[Hub] Serving http://127.0.0.1:{}/metrics", config.metricsPort);
+        }
+        else
+        {
+            spdlog::error("[Hub] Cannot listen on 127.0.0.1:{} for metrics", config.metricsPort);
+        }
+    }
+
+    int signal = 0;
+    sigwait(&signals, &signal);
+    spdlog::info("[Hub] Stopping on signal {}", signal);
+
+    if (metricsThread.joinable())
+    {
+        metricsServer.stop();
+        metricsThread.join();
+    }
+    hub.stop();
+    hub.wait();
+    return 0;
+}
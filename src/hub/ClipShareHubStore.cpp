@@ -0,0 +1,486 @@
+﻿#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <spdlog/spdlog.h>
+#include "ClipShareHubStore.h"
+#include "ClipShareMetrics.h"
+
+namespace
+{
+    // one index record, host byte order, the store never leaves the machine
+    struct IndexRecord
+    {
+        std::uint64_t sequence;
+        std::uint64_t source;
+        std::uint64_t offset;
+        std::uint32_t length;
+        std::uint8_t priority;
+        std::uint8_t reserved[3];
+    };
+    static_assert(sizeof(IndexRecord) == 32, "index records are 32 bytes");
+
+    std::int64_t wallMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    bool writeAll(int fd, const void* data, std::size_t size)
+    {
+        auto p = static_cast<const std::uint8_t*>(data);
+        while (size > 0)
+        {
+            auto written = ::write(fd, p, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            p += written;
+            size -= static_cast<std::size_t>(written);
+        }
+        return true;
+    }
+
+    bool readAll(int fd, void* data, std::size_t size, std::uint64_t offset)
+    {
+        auto p = static_cast<std::uint8_t*>(data);
+        while (size > 0)
+        {
+            auto read = ::pread(fd, p, size, static_cast<off_t>(offset));
+            if (read < 0 && errno == EINTR)
+                continue;
+            if (read <= 0)
+                return false;
+            p += read;
+            size -= static_cast<std::size_t>(read);
+            offset += static_cast<std::uint64_t>(read);
+        }
+        return true;
+    }
+}
+
+ClipShareHubStore::ClipShareHubStore(const std::string& directory, std::size_t maxClips, std::size_t maxBytes, std::size_t maxSubscribers)
+    : directory(directory)
+    , maxClips(std::max<std::size_t>(1, maxClips))
+    , maxBytes(maxBytes)
+    , maxSubscribers(maxSubscribers)
+{
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.describe("clipshare_hub_store_clips", "Clips retained for offline subscribers.");
+    metrics.describe("clipshare_hub_store_bytes", "Bytes of the retained clips.");
+    metrics.describe("clipshare_hub_store_subscribers", "Subscribers with a cursor.");
+    metrics.describe("clipshare_hub_catchup_clips_total", "Retained clips sent to reconnecting subscribers.");
+}
+
+ClipShareHubStore::~ClipShareHubStore()
+{
+    // whatever was appended is written first
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        stopping = true;
+    }
+    writeWake.notify_all();
+    if (writer.joinable())
+        writer.join();
+    save();
+    for (auto& segment : segments)
+        closeSegment(segment);
+}
+
+bool ClipShareHubStore::open()
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    if (::mkdir(directory.c_str(), 0700) < 0 && errno != EEXIST)
+    {
+        spdlog::error("[Store] Cannot create {}: {}", directory, std::strerror(errno));
+        return false;
+    }
+
+    std::vector<std::uint64_t> found;
+    if (auto dir = ::opendir(directory.c_str()))
+    {
+        while (auto item = ::readdir(dir))
+        {
+            std::uint64_t first = 0;
+            char extension[8]{};
+            if (std::sscanf(item->d_name, "%20" SCNu64 ".%3s", &first, extension) == 2 && std::strcmp(extension, "idx") == 0)
+                found.push_back(first);
+        }
+        ::closedir(dir);
+    }
+    std::sort(found.begin(), found.end());
+    for (auto first : found)
+    {
+        if (!loadSegment(first))
+            return false;
+    }
+
+    // an empty last segment still names the next sequence
+    if (!segments.empty())
+        sequence = std::max(sequence, segments.back().first - 1);
+    if (segments.empty() && !startSegment(sequence + 1))
+        return false;
+    trim();
+    dropSegments(oldestRetained());
+    loadSubscribers();
+    writer = std::thread([this] { write(); });
+
+    spdlog::info("[Store] {} clips ({} bytes) in {} segments, {} subscribers in {}", entries.size(), retainedBytes, segments.size(), subscribers.size(), directory);
+    return true;
+}
+
+bool ClipShareHubStore::loadSegment(std::uint64_t first)
+{
+    Segment segment;
+    segment.first = first;
+    segment.data = ::open(path(first, "seg").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    segment.index = ::open(path(first, "idx").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (segment.data < 0 || segment.index < 0)
+    {
+        spdlog::error("[Store] Cannot open segment {}: {}", first, std::strerror(errno));
+        closeSegment(segment);
+        return false;
+    }
+
+    struct stat data{};
+    struct stat index{};
+    ::fstat(segment.data, &data);
+    ::fstat(segment.index, &index);
+
+    // a crash may have left a torn record or a record without its data, both are dropped
+    std::vector<IndexRecord> records(static_cast<std::size_t>(index.st_size) / sizeof(IndexRecord));
+    if (!records.empty() && !readAll(segment.index, records.data(), records.size() * sizeof(IndexRecord), 0))
+        records.clear();
+    std::uint64_t valid = 0;
+    for (auto& record : records)
+    {
+        if (record.offset + record.length > static_cast<std::uint64_t>(data.st_size) || record.sequence <= sequence)
+            break;
+        entries.push_back(Entry{ record.sequence, record.source, record.offset, record.length, record.priority, first, nullptr });
+        retainedBytes += record.length;
+        sequence = record.sequence;
+        segment.last = record.sequence;
+        segment.size = record.offset + record.length;
+        ++valid;
+    }
+    segment.records = valid;
+    if (valid * sizeof(IndexRecord) != static_cast<std::uint64_t>(index.st_size) || segment.size != static_cast<std::uint64_t>(data.st_size))
+    {
+        spdlog::warn("[Store] Segment {} truncated to {} clips", first, valid);
+        if (::ftruncate(segment.index, static_cast<off_t>(valid * sizeof(IndexRecord))) < 0 || ::ftruncate(segment.data, static_cast<off_t>(segment.size)) < 0)
+            spdlog::warn("[Store] Cannot truncate segment {}: {}", first, std::strerror(errno));
+    }
+
+    segments.push_back(segment);
+    return true;
+}
+
+bool ClipShareHubStore::startSegment(std::uint64_t first)
+{
+    Segment segment;
+    segment.first = first;
+    segment.data = ::open(path(first, "seg").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    segment.index = ::open(path(first, "idx").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (segment.data < 0 || segment.index < 0)
+    {
+        spdlog::error("[Store] Cannot create segment {}: {}", first, std::strerror(errno));
+        closeSegment(segment);
+        return false;
+    }
+    segments.push_back(segment);
+    return true;
+}
+
+void ClipShareHubStore::closeSegment(Segment& segment)
+{
+    if (segment.data >= 0)
+        ::close(segment.data);
+    if (segment.index >= 0)
+        ::close(segment.index);
+    segment.data = segment.index = -1;
+}
+
+std::uint64_t ClipShareHubStore::append(std::uint64_t source, std::uint8_t priority, const std::uint8_t* payload, std::size_t size)
+{
+    // the copy is made before the lock, the loops only wait for each other on the bookkeeping
+    auto data = std::make_shared<const std::vector<std::uint8_t>>(payload, payload + size);
+    std::uint64_t next = 0;
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        next = ++sequence;
+        Entry entry{ next, source, 0, static_cast<std::uint32_t>(size), priority, 0, std::move(data) };
+        entries.push_back(entry);
+        writes.push_back(std::move(entry));
+        retainedBytes += size;
+        trim();
+    }
+    writeWake.notify_one();
+    return next;
+}
+
+void ClipShareHubStore::write()
+{
+    std::unique_lock<std::mutex> lock{ mutex };
+    while (true)
+    {
+        writeWake.wait(lock, [this] { return stopping || !writes.empty(); });
+        if (writes.empty())
+            return;
+        auto entry = std::move(writes.front());
+        writes.pop_front();
+        // trimmed before it got its turn
+        if (entries.empty() || entry.sequence < entries.front().sequence)
+            continue;
+        lock.unlock();
+
+        Entry written;
+        auto ok = writeEntry(entry, written);
+
+        lock.lock();
+        auto it = std::lower_bound(entries.begin(), entries.end(), entry.sequence, [](const Entry& item, std::uint64_t value) { return item.sequence < value; });
+        if (it != entries.end() && it->sequence == entry.sequence)
+        {
+            // a clip that cannot be written is not retained, the next ones may still be
+            if (ok)
+                *it = written;
+            else
+            {
+                retainedBytes -= it->length;
+                entries.erase(it);
+            }
+        }
+        auto oldest = oldestRetained();
+        lock.unlock();
+        dropSegments(oldest);
+        lock.lock();
+    }
+}
+
+bool ClipShareHubStore::writeEntry(const Entry& entry, Entry& written)
+{
+    auto size = entry.payload->size();
+    if (segments.back().size > 0 && segments.back().size + size > SegmentBytes && !startSegment(entry.sequence))
+        return false;
+
+    auto& segment = segments.back();
+    IndexRecord record{};
+    record.sequence = entry.sequence;
+    record.source = entry.source;
+    record.offset = segment.size;
+    record.length = static_cast<std::uint32_t>(size);
+    record.priority = entry.priority;
+
+    // data before index, a record never points past what was written
+    if (!writeAll(segment.data, entry.payload->data(), size) || !writeAll(segment.index, &record, sizeof(record)))
+    {
+        spdlog::error("[Store] Cannot write segment {}: {}", segment.first, std::strerror(errno));
+        // cut off whatever part made it, the next write starts at the same offsets
+        if (::ftruncate(segment.data, static_cast<off_t>(segment.size)) < 0 || ::ftruncate(segment.index, static_cast<off_t>(segment.records * sizeof(IndexRecord))) < 0)
+            spdlog::warn("[Store] Cannot truncate segment {}: {}", segment.first, std::strerror(errno));
+        return false;
+    }
+
+    segment.size += size;
+    ++segment.records;
+    segment.last = entry.sequence;
+    written = Entry{ entry.sequence, entry.source, record.offset, record.length, entry.priority, segment.first, nullptr };
+    return true;
+}
+
+std::uint64_t ClipShareHubStore::oldestRetained() const
+{
+    return entries.empty() ? sequence + 1 : entries.front().sequence;
+}
+
+void ClipShareHubStore::dropSegments(std::uint64_t oldest)
+{
+    // whole segments go once nothing in them is retained, never the one being appended to
+    while (segments.size() > 1 && segments.front().last < oldest)
+    {
+        closeSegment(segments.front());
+        ::unlink(path(segments.front().first, "seg").c_str());
+        ::unlink(path(segments.front().first, "idx").c_str());
+        segments.pop_front();
+    }
+}
+
+void ClipShareHubStore::trim()
+{
+    // the newest clip is kept whatever its size, it is the one a subscriber wants
+    while (entries.size() > 1 && (entries.size() > maxClips || (maxBytes > 0 && retainedBytes > maxBytes)))
+    {
+        retainedBytes -= entries.front().length;
+        entries.pop_front();
+    }
+    // nor are they written, a disk slower than the clips coming in must not queue their payloads without bound
+    while (!writes.empty() && writes.front().sequence < oldestRetained())
+        writes.pop_front();
+
+    auto& metrics = ClipShareMetrics::instance();
+    metrics.set("clipshare_hub_store_clips", {}, static_cast<double>(entries.size()));
+    metrics.set("clipshare_hub_store_bytes", {}, static_cast<double>(retainedBytes));
+}
+
+std::uint64_t ClipShareHubStore::subscribe(std::uint64_t node, std::uint64_t& end)
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto known = subscribers.count(node) > 0;
+    auto& state = subscriber(node);
+    if (!known)
+        state.cursor = sequence;
+    end = sequence;
+    return state.cursor;
+}
+
+std::vector<ClipShareHubStore::Clip> ClipShareHubStore::catchUp(std::uint64_t node, std::uint64_t after, std::uint64_t until, std::size_t maxBytes)
+{
+    // only the places are looked up under the lock, the reads do not hold up append()
+    std::vector<Entry> slice;
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        auto it = std::upper_bound(entries.begin(), entries.end(), after, [](std::uint64_t value, const Entry& entry) { return value < entry.sequence; });
+        std::size_t bytes = 0;
+        for (; it != entries.end() && it->sequence <= until && (slice.empty() || bytes + it->length <= maxBytes); ++it)
+        {
+            if (it->source == node)
+                continue;
+            slice.push_back(*it);
+            bytes += it->length;
+        }
+    }
+
+    // a segment trimmed meanwhile is gone, its clips are no longer retained anyway
+    std::vector<Clip> clips;
+    int fd = -1;
+    std::uint64_t open = 0;
+    for (auto& entry : slice)
+    {
+        if (entry.payload != nullptr)
+        {
+            clips.push_back(Clip{ entry.sequence, entry.priority, *entry.payload });
+            continue;
+        }
+        if (fd < 0 || open != entry.segment)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            open = entry.segment;
+            fd = ::open(path(entry.segment, "seg").c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        Clip clip;
+        clip.sequence = entry.sequence;
+        clip.priority = entry.priority;
+        clip.payload.resize(entry.length);
+        if (fd < 0 || !readAll(fd, clip.payload.data(), entry.length, entry.offset))
+        {
+            spdlog::warn("[Store] Cannot read clip {}: {}", entry.sequence, std::strerror(errno));
+            continue;
+        }
+        clips.push_back(std::move(clip));
+    }
+    if (fd >= 0)
+        ::close(fd);
+    ClipShareMetrics::instance().increment("clipshare_hub_catchup_clips_total", {}, static_cast<double>(clips.size()));
+    return clips;
+}
+
+void ClipShareHubStore::advance(std::uint64_t node, std::uint64_t delivered)
+{
+    std::lock_guard<std::mutex> lock{ mutex };
+    auto& state = subscriber(node);
+    if (delivered > state.cursor)
+        state.cursor = delivered;
+}
+
+ClipShareHubStore::Subscriber& ClipShareHubStore::subscriber(std::uint64_t node)
+{
+    dirty = true;
+    auto& state = subscribers[node];
+    state.lastSeen = wallMs();
+
+    // the longest absent subscriber is forgotten, it starts cold when it comes back
+    if (maxSubscribers > 0 && subscribers.size() > maxSubscribers)
+    {
+        auto oldest = std::min_element(subscribers.begin(), subscribers.end(),
+            [](const std::pair<const std::uint64_t, Subscriber>& a, const std::pair<const std::uint64_t, Subscriber>& b) { return a.second.lastSeen < b.second.lastSeen; });
+        subscribers.erase(oldest);
+    }
+    ClipShareMetrics::instance().set("clipshare_hub_store_subscribers", {}, static_cast<double>(subscribers.size()));
+    return subscribers[node];
+}
+
+void ClipShareHubStore::save()
+{
+    // a copy is written, the loops keep advancing cursors during the fsync
+    std::lock_guard<std::mutex> saving{ saveMutex };
+    std::map<std::uint64_t, Subscriber> cursors;
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        if (!dirty)
+            return;
+        cursors = subscribers;
+        dirty = false;
+    }
+
+    // written beside and renamed over, a crash leaves the old or the new file
+    auto file = directory + "/subscribers";
+    auto temporary = file + ".tmp";
+    auto out = std::fopen(temporary.c_str(), "w");
+    if (out == nullptr)
+    {
+        spdlog::error("[Store] Cannot write {}: {}", temporary, std::strerror(errno));
+        std::lock_guard<std::mutex> lock{ mutex };
+        dirty = true;
+        return;
+    }
+    for (auto& item : cursors)
+        std::fprintf(out, "%016" PRIx64 " %" PRIu64 " %" PRId64 "\n", item.first, item.second.cursor, item.second.lastSeen);
+    auto ok = std::fflush(out) == 0 && ::fsync(::fileno(out)) == 0;
+    std::fclose(out);
+    if (!ok || std::rename(temporary.c_str(), file.c_str()) < 0)
+    {
+        spdlog::error("[Store] Cannot write {}: {}", file, std::strerror(errno));
+        std::lock_guard<std::mutex> lock{ mutex };
+        dirty = true;
+    }
+}
+
+void ClipShareHubStore::loadSubscribers()
+{
+    auto in = std::fopen((directory + "/subscribers").c_str(), "r");
+    if (in == nullptr)
+        return;
+
+    std::uint64_t node = 0;
+    Subscriber state;
+    while (std::fscanf(in, "%" SCNx64 " %" SCNu64 " %" SCNd64, &node, &state.cursor, &state.lastSeen) == 3)
+    {
+        // the segments were lost or reset, the old cursors point past the end
+        state.cursor = std::min(state.cursor, sequence);
+        subscribers[node] = state;
+    }
+    std::fclose(in);
+
+    while (maxSubscribers > 0 && subscribers.size() > maxSubscribers)
+    {
+        auto oldest = std::min_element(subscribers.begin(), subscribers.end(),
+            [](const std::pair<const std::uint64_t, Subscriber>& a, const std::pair<const std::uint64_t, Subscriber>& b) { return a.second.lastSeen < b.second.lastSeen; });
+        subscribers.erase(oldest);
+    }
+    ClipShareMetrics::instance().set("clipshare_hub_store_subscribers", {}, static_cast<double>(subscribers.size()));
+}
+
+std::string ClipShareHubStore::path(std::uint64_t first, const char* extension) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020" PRIu64 ".%s", first, extension);
+    return directory + "/" + name;
+}
@@ -0,0 +1,121 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Disk backed store and forward queue of clipshare_hub.
+/// Every relayed clip is appended once to a segment file, its offset to the segment's index file.
+/// Subscribers (nodes that said Hello) only cost a cursor, the last clip written to them,
+/// and a reconnecting subscriber gets the retained clips after its cursor, except its own.
+/// Only the latest maxClips clips and maxBytes bytes are retained, older segments are deleted.
+/// Thread safe, all loops of the hub share one store. The files are written by a thread of the store,
+/// a clip is served from memory until it is on disk.
+/// </summary>
+class ClipShareHubStore
+{
+public:
+    static constexpr std::uint64_t SegmentBytes{ 8 << 20 };
+
+    struct Clip
+    {
+        std::uint64_t sequence{ 0 };
+        std::uint8_t priority{ 0 };
+        std::vector<std::uint8_t> payload;
+    };
+
+    ClipShareHubStore(const std::string& directory, std::size_t maxClips, std::size_t maxBytes, std::size_t maxSubscribers);
+    ~ClipShareHubStore();
+
+    // create the directory or load the segments and cursors left in it
+    bool open();
+
+    // store sequence of the clip, it is written to disk later
+    std::uint64_t append(std::uint64_t source, std::uint8_t priority, const std::uint8_t* payload, std::size_t size);
+
+    // the subscriber's cursor, end gets the last clip stored so far.
+    // A subscriber seen for the first time starts at the current end instead of with history.
+    std::uint64_t subscribe(std::uint64_t subscriber, std::uint64_t& end);
+
+    // retained clips after .. until, except the subscriber's own, oldest first: up to maxBytes, at least one.
+    // Read outside the lock, a caller takes it in slices
+    std::vector<Clip> catchUp(std::uint64_t subscriber, std::uint64_t after, std::uint64_t until, std::size_t maxBytes);
+
+    // sequence was written to the subscriber
+    void advance(std::uint64_t subscriber, std::uint64_t sequence);
+
+    // write the cursors if they changed, the segments are written by append().
+    // Blocks on fsync, not for an event loop
+    void save();
+
+private:
+    struct Entry
+    {
+        std::uint64_t sequence;
+        std::uint64_t source;
+        std::uint64_t offset;
+        std::uint32_t length;
+        std::uint8_t priority;
+        std::uint64_t segment;      // Segment::first of the segment holding it
+        std::shared_ptr<const std::vector<std::uint8_t>> payload;  // until the writer has it on disk
+    };
+
+    struct Segment
+    {
+        std::uint64_t first{ 0 };   // sequence of the first clip, also the file name
+        std::uint64_t last{ 0 };
+        std::uint64_t size{ 0 };
+        std::uint64_t records{ 0 };
+        int data{ -1 };
+        int index{ -1 };
+    };
+
+    struct Subscriber
+    {
+        std::uint64_t cursor{ 0 };
+        std::int64_t lastSeen{ 0 };     // ms since epoch
+    };
+
+    bool loadSegment(std::uint64_t first);
+    bool startSegment(std::uint64_t first);
+    void closeSegment(Segment&);
+    // the writer thread, the only one touching segments once the store is open
+    void write();
+    bool writeEntry(const Entry&, Entry& written);
+    // entries beyond the limits, mutex held
+    void trim();
+    // segments without a retained entry, on the writer thread
+    void dropSegments(std::uint64_t oldest);
+    // mutex held
+    std::uint64_t oldestRetained() const;
+    void loadSubscribers();
+    Subscriber& subscriber(std::uint64_t node);
+    std::string path(std::uint64_t first, const char* extension) const;
+
+    std::string directory;
+    std::size_t maxClips;
+    std::size_t maxBytes;
+    std::size_t maxSubscribers;
+
+    std::mutex mutex;
+    std::mutex saveMutex;               // one writer of the cursor file, taken before mutex
+    std::deque<Segment> segments;
+    std::deque<Entry> entries;
+    std::size_t retainedBytes{ 0 };
+    std::uint64_t sequence{ 0 };        // of the last clip appended
+    std::map<std::uint64_t, Subscriber> subscribers;
+    bool dirty{ false };
+
+    std::thread writer;
+    std::condition_variable writeWake;
+    std::deque<Entry> writes;           // appended, not on disk yet, trim() drops them with their entries
+    bool stopping{ false };
+};
@@ -1,29 +1,114 @@
-﻿#include "ClipShareWindow.h"
+﻿#include <QGuiApplication>
+#include <QCommandLineParser>
+#include "ClipShareWindow.h"
 #include "SingleApplication.h"
+#include "SingleInstance.h"
 #include <cpp-httplib/httplib.h>
 #include <ghc/filesystem.hpp>
 #include <fplus/fplus.hpp>
 #include <nlohmann/json.hpp>
-#include <spdlog/spdlog.h>
+#include "ClipShareLog.h"
+
+// `--headless` has to be known before any application object exists,
+// because the platform plugin is chosen by the constructor.
+static bool isHeadless(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (qstrcmp(argv[i], "--headless") == 0)
+            return true;
+    }
+    return false;
+}
+
+static ClipShareConfig parseConfig(const QCoreApplication& a)
+{
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption headlessOption{ "headless", "Run without any widget." };
+    QCommandLineOption configOption{ "config", "Load the configuration from a JSON file.", "file" };
+    QCommandLineOption recordOption{ "record", "Record clipboard changes to a file for clipshare_replay.", "file" };
+    QCommandLineOption logOption{ "log", "Log levels, e.g. \"info,heartbeat=warn\".", "levels" };
+    parser.addOptions({ headlessOption, configOption, recordOption, logOption });
+    parser.process(a);
+
+    ClipShareConfig config;
+    if (parser.isSet(configOption))
+    {
+        try {
+            config = ClipShareConfig::load(parser.value(configOption));
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            ClipShareLog::config().error("[Config] Invalid {}: {}", parser.value(configOption), e.what());
+        }
+    }
+    if (parser.isSet(recordOption))
+        config.recordFile = parser.value(recordOption);
+    if (parser.isSet(logOption))
+        config.logLevels = parser.value(logOption);
+
+    ClipShareLog::init(config);
+    return config;
+}
+
+// Run discovery and package server without any widget.
+// The clipboard still needs a QGuiApplication, the offscreen platform keeps it off the display.
+static int runHeadless(int argc, char* argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication a(argc, argv);
+    auto config = parseConfig(a);
+
+    ClipShareLog::application().info("[Application] CLIPSHARE initializing headless~");
+    SingleInstance instance{ QGuiApplication::applicationFilePath() };
+    if (instance.instanceRunning())
+    {
+        ClipShareLog::application().warn("[Application] Another application has running, bye~");
+        return 0;
+    }
+
+    int result = 0;
+    {
+        // gone before the log shuts down, its destructors still log
+        ClipShareService service{ config };
+        service.start();
+
+        ClipShareLog::application().info("[Application] Service crate.");
+        result = a.exec();
+    }
+    ClipShareLog::shutdown();
+    return result;
+}
 
 int main(int argc, char *argv[])
 {
-    SingleApplication a(argc, argv);
+    if (isHeadless(argc, argv))
+        return runHeadless(argc, argv);
 
-    spdlog::set_level(spdlog::level::trace);
+    SingleApplication a(argc, argv);
+    auto config = parseConfig(a);
 
-    spdlog::info("[Application] CLIPSHARE initializing~");
+    ClipShareLog::application().info("[Application] CLIPSHARE initializing~");
     if (a.instanceRunning())
     {
-        spdlog::warn("[Application] Another application has running, bye~");
+        ClipShareLog::application().warn("[Application] Another application has running, bye~");
         return 0;
     }
 
     a.setWindowIcon(QIcon{ ":/ClipShareWindow/res/icon/main.png" });
 
-    ClipShareWindow w;
-    // w.show();
+    int result = 0;
+    {
+        // gone before the log shuts down, its destructors still log
+        ClipShareWindow w{ config };
+        // w.show();
 
-	spdlog::info("[Application] Interface crate.");
-    return a.exec();
+        ClipShareLog::application().info("[Application] Interface crate.");
+        result = a.exec();
+    }
+    ClipShareLog::shutdown();
+    return result;
 }
@@ -0,0 +1,165 @@
+﻿#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ClipShareChunk.h"
+#include "ClipShareHub.h"
+#include "ClipShareHubStore.h"
+
+// No framework, a failed check prints where it is and the run exits non-zero for ctest.
+#define CHECK(expression) check((expression), #expression, __FILE__, __LINE__)
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool condition, const char* expression, const char* file, int line)
+    {
+        if (condition)
+            return;
+        ++failures;
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+    }
+
+    bool readControl(const std::string& text, std::uint64_t& node)
+    {
+        return ClipShareHub::readControl(reinterpret_cast<const std::uint8_t*>(text.data()), text.size(), node);
+    }
+
+    void testControl()
+    {
+        std::uint64_t node = 1;
+        CHECK(readControl(R"({"command":3,"node":42,"stream":0,"time":0})", node) && node == 42);
+        CHECK(readControl(R"({"command":1,"stream":0,"time":5})", node) && node == 0);
+        CHECK(readControl(R"({"command":2,"node":"x"})", node) && node == 0);
+
+        // closed instead of throwing on the loop
+        const char* malformed[]{
+            R"({"command":"x"})",
+            R"({"command":-3,"node":42})",
+            R"({"command":3.5,"node":42})",
+            R"({"command":3,"node":"42"})",
+            R"({"command":3,"node":-1})",
+            R"({"command":3,"node":[42]})",
+            R"({"command":3})",
+            R"({"command":3,"node":0})",
+            R"({"node":42})",
+            R"([3,42])",
+            R"("hello")",
+            R"({"command":3,"node":)",
+            "",
+            "\xff\xfe",
+        };
+        for (auto text : malformed)
+        {
+            node = 1;
+            CHECK(!readControl(text, node) && node == 0);
+        }
+    }
+
+    void testFrame()
+    {
+        std::string payload(ClipShareHub::ChunkSize * 2 + 5, 'x');
+        auto frame = ClipShareHub::makeFrame(7, 2, reinterpret_cast<const std::uint8_t*>(payload.data()), payload.size());
+        CHECK(frame->size() == payload.size() + 3 * ClipShareChunkHeader::Size);
+
+        std::size_t offset = 0;
+        std::size_t total = 0;
+        int chunks = 0;
+        while (offset + ClipShareChunkHeader::Size <= frame->size())
+        {
+            auto header = ClipShareChunkHeader::read(frame->data() + offset);
+            CHECK(header.stream == 7 && header.priority == 2);
+            CHECK(((header.flags & ClipShareChunkHeader::Begin) != 0) == (chunks == 0));
+            CHECK(((header.flags & ClipShareChunkHeader::End) != 0) == (chunks == 2));
+            offset += ClipShareChunkHeader::Size + header.length;
+            total += header.length;
+            ++chunks;
+        }
+        CHECK(chunks == 3 && offset == frame->size() && total == payload.size());
+
+        // an empty message is still one chunk with both flags
+        auto empty = ClipShareHub::makeFrame(8, 0, nullptr, 0);
+        CHECK(empty->size() == ClipShareChunkHeader::Size);
+        auto header = ClipShareChunkHeader::read(empty->data());
+        CHECK(header.length == 0 && header.flags == (ClipShareChunkHeader::Begin | ClipShareChunkHeader::End));
+    }
+
+    std::string clipText(std::uint64_t sequence)
+    {
+        return "clip " + std::to_string(sequence);
+    }
+
+    bool appendText(ClipShareHubStore& store, std::uint64_t source, const std::string& text)
+    {
+        return store.append(source, 0, reinterpret_cast<const std::uint8_t*>(text.data()), text.size()) > 0;
+    }
+
+    // the sequences of the clips node gets after after, -1 in place of one with the wrong payload
+    std::vector<long long> caughtUp(ClipShareHubStore& store, std::uint64_t node, std::uint64_t after)
+    {
+        std::uint64_t end = 0;
+        store.subscribe(node, end);
+        std::vector<long long> sequences;
+        for (auto& clip : store.catchUp(node, after, end, 1 << 20))
+        {
+            auto matches = std::string(clip.payload.begin(), clip.payload.end()) == clipText(clip.sequence);
+            sequences.push_back(matches ? static_cast<long long>(clip.sequence) : -1);
+        }
+        return sequences;
+    }
+
+    void testStore()
+    {
+        char pattern[]{ "/tmp/clipshare_hub_tests.XXXXXX" };
+        std::string directory = ::mkdtemp(pattern);
+        {
+            ClipShareHubStore store{ directory, 4, 0, 16 };
+            CHECK(store.open());
+            std::uint64_t end = 0;
+            store.subscribe(2, end);
+            for (std::uint64_t i = 1; i <= 10; ++i)
+                CHECK(appendText(store, i == 9 ? 2 : 1, clipText(i)));
+
+            // the latest 4 retained, the subscriber's own left out
+            CHECK(caughtUp(store, 2, 0) == std::vector<long long>({ 7, 8, 10 }));
+            CHECK(caughtUp(store, 2, 8) == std::vector<long long>({ 10 }));
+        }
+
+        // written on the way out and loaded again
+        {
+            ClipShareHubStore store{ directory, 4, 0, 16 };
+            CHECK(store.open());
+            CHECK(caughtUp(store, 3, 0) == std::vector<long long>({ 7, 8, 9, 10 }));
+        }
+
+        // a torn index record, as a crash leaves it, is cut off and the clips before it stay
+        {
+            auto index = directory + "/00000000000000000001.idx";
+            auto fd = ::open(index.c_str(), O_WRONLY | O_APPEND);
+            CHECK(fd >= 0 && ::write(fd, "torn", 4) == 4);
+            ::close(fd);
+
+            ClipShareHubStore store{ directory, 4, 0, 16 };
+            CHECK(store.open());
+            CHECK(caughtUp(store, 3, 0) == std::vector<long long>({ 7, 8, 9, 10 }));
+            CHECK(appendText(store, 1, clipText(11)));
+            CHECK(caughtUp(store, 3, 10) == std::vector<long long>({ 11 }));
+        }
+
+        static_cast<void>(std::system(("rm -rf " + directory).c_str()));
+    }
+}
+
+int main()
+{
+    testControl();
+    testFrame();
+    testStore();
+
+    if (failures > 0)
+        std::fprintf(stderr, "%d checks failed\n", failures);
+    return failures == 0 ? 0 : 1;
+}
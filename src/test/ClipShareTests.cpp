@@ -0,0 +1,599 @@
+﻿#include <QByteArray>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QRandomGenerator>
+#include <QSet>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ClipShareChunkStore.h"
+#include "ClipShareChunker.h"
+#include "ClipShareDelta.h"
+#include "ClipShareFileTransfer.h"
+#include "ClipShareFrame.h"
+#include "ClipSharePackage.h"
+#include "ClipShareReassembly.h"
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// No framework, a failed check prints where it is and the run exits non-zero for ctest.
+#define CHECK(expression) check((expression), #expression, __FILE__, __LINE__)
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool condition, const char* expression, const char* file, int line)
+    {
+        if (condition)
+            return;
+        ++failures;
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+    }
+
+    QByteArray randomBytes(int size, quint32 seed)
+    {
+        QRandomGenerator random{ seed };
+        QByteArray data(size, '\0');
+        random.fillRange(reinterpret_cast<quint32*>(data.data()), size / static_cast<int>(sizeof(quint32)));
+        return data;
+    }
+
+    QByteArray textLines(int lines)
+    {
+        QByteArray text;
+        for (int i = 0; i < lines; ++i)
+            text += "line " + QByteArray::number(i) + " of a text long enough to span blocks, " + QByteArray::number(i * 7919) + "\n";
+        return text;
+    }
+
+    std::vector<QByteArray> chunks(const QByteArray& data)
+    {
+        std::vector<QByteArray> result;
+        auto bytes = reinterpret_cast<const std::uint8_t*>(data.constData());
+        std::size_t offset = 0;
+        while (offset < static_cast<std::size_t>(data.size()))
+        {
+            auto length = ClipShareChunker::boundary(bytes + offset, data.size() - offset);
+            result.push_back(data.mid(static_cast<int>(offset), static_cast<int>(length)));
+            offset += length;
+        }
+        return result;
+    }
+
+    // bytes of edited in chunks that are not chunks of original
+    int changedBytes(const QByteArray& original, const QByteArray& edited)
+    {
+        QSet<QByteArray> known;
+        for (auto& chunk : chunks(original))
+            known.insert(chunk);
+        int changed = 0;
+        for (auto& chunk : chunks(edited))
+            changed += known.contains(chunk) ? 0 : chunk.size();
+        return changed;
+    }
+
+    bool roundTrip(const QByteArray& base, const QByteArray& target)
+    {
+        auto delta = ClipShareDelta::encode(base, target);
+        QByteArray applied;
+        return !delta.isEmpty() && ClipShareDelta::apply(base, delta, applied, target.size()) && applied == target;
+    }
+
+    void testDelta()
+    {
+        auto base = textLines(2000);
+        auto middle = base.indexOf("line 1000 ");
+
+        auto inserted = base;
+        inserted.insert(middle, "an inserted line\n");
+        CHECK(roundTrip(base, inserted));
+        CHECK(ClipShareDelta::encode(base, inserted).size() < inserted.size() / 20);
+
+        auto removed = base;
+        removed.remove(middle, 200);
+        CHECK(roundTrip(base, removed));
+        CHECK(roundTrip(base, "prefix " + base));
+        CHECK(roundTrip(base, base + "suffix"));
+        CHECK(roundTrip(base, base));
+
+        // nothing in common, sent in full instead
+        CHECK(ClipShareDelta::encode(base, randomBytes(base.size(), 1)).isEmpty());
+        // shorter than one block
+        CHECK(ClipShareDelta::encode(base, "short").isEmpty());
+        CHECK(ClipShareDelta::encode({}, base).isEmpty());
+
+        auto delta = ClipShareDelta::encode(base, inserted);
+        QByteArray applied;
+        CHECK(!ClipShareDelta::apply(base, delta, applied, inserted.size() - 1));
+        CHECK(!ClipShareDelta::apply(base, delta.left(delta.size() - 1), applied, inserted.size()));
+        CHECK(!ClipShareDelta::apply(base.left(base.size() / 2), delta, applied, inserted.size()));
+        CHECK(!ClipShareDelta::apply(base, {}, applied, inserted.size()));
+
+        // target size 10, a copy of 10 bytes at offset 1000 of a 100 byte base
+        QByteArray outOfRange{ "\x0a\x15\xe8\x07" };
+        CHECK(!ClipShareDelta::apply(QByteArray(100, 'x'), outOfRange, applied, 100));
+    }
+
+    void testChunker()
+    {
+        auto data = randomBytes(4 << 20, 2);
+        auto bytes = reinterpret_cast<const std::uint8_t*>(data.constData());
+
+        CHECK(ClipShareChunker::boundary(bytes, 0) == 0);
+        CHECK(ClipShareChunker::boundary(bytes, ClipShareChunker::MinSize) == ClipShareChunker::MinSize);
+
+        auto original = chunks(data);
+        CHECK(original.size() > 16);
+        for (std::size_t i = 0; i + 1 < original.size(); ++i)
+        {
+            CHECK(static_cast<std::size_t>(original[i].size()) > ClipShareChunker::MinSize);
+            CHECK(static_cast<std::size_t>(original[i].size()) <= ClipShareChunker::MaxSize);
+        }
+
+        // cut points depend on the content from the chunk start only, a scan resumed at a boundary finds the same chunks
+        auto second = original[0].size();
+        CHECK(chunks(data.mid(second)).front() == original[1]);
+
+        // an edit moves the boundaries next to it, the normalized masks take a few chunks to fall back in step
+        auto inserted = data;
+        inserted.insert(1 << 20, randomBytes(100, 3));
+        CHECK(changedBytes(data, inserted) < 1 << 20);
+
+        auto removed = data;
+        removed.remove(2 << 20, 5000);
+        CHECK(changedBytes(data, removed) < 1 << 20);
+
+        auto prefixed = randomBytes(12344, 4) + data;
+        CHECK(changedBytes(data, prefixed) < 1 << 20);
+
+        // no cut point anywhere, chunks of MaxSize
+        QByteArray zeros(1 << 20, '\0');
+        for (auto& chunk : chunks(zeros))
+            CHECK(static_cast<std::size_t>(chunk.size()) == ClipShareChunker::MaxSize);
+    }
+
+#ifdef Q_OS_UNIX
+    // as ClipShareFileTransfer records and asks for files
+    std::vector<ClipShareChunk> recipeOf(const QByteArray& data)
+    {
+        std::vector<ClipShareChunk> recipe;
+        for (auto& chunk : chunks(data))
+        {
+            ClipShareChunk item;
+            auto hash = QCryptographicHash::hash(chunk, QCryptographicHash::Sha1);
+            std::memcpy(item.hash.data(), hash.constData(), item.hash.size());
+            item.length = static_cast<std::uint32_t>(chunk.size());
+            recipe.push_back(item);
+        }
+        return recipe;
+    }
+
+    bool writeFile(const QString& path, const QByteArray& data)
+    {
+        QFile file(path);
+        return file.open(QFile::WriteOnly | QFile::Truncate) && file.write(data) == data.size();
+    }
+
+    std::vector<ClipShareFileTransfer::Batch> reuseInto(ClipShareChunkStore& store, const QString& path, const QByteArray& target)
+    {
+        std::vector<ClipShareFileTransfer::Batch> batches;
+        auto file = ::open(QFile::encodeName(path).constData(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        CHECK(file >= 0 && ::ftruncate(file, target.size()) == 0);
+        ClipShareFileTransfer::reuseChunks(store, file, 7, recipeOf(target), batches);
+        ::close(file);
+        return batches;
+    }
+#endif
+
+    void testReuseChunks()
+    {
+#ifdef Q_OS_UNIX
+        QTemporaryDir directory;
+        CHECK(directory.isValid());
+        auto original = randomBytes(3 << 20, 5);
+        auto oldPath = directory.filePath("old");
+        CHECK(writeFile(oldPath, original));
+        ClipShareChunkStore store;
+        store.add(oldPath, recipeOf(original));
+
+        auto edited = original;
+        edited.insert(3 << 19, randomBytes(100, 6));
+
+        // the chunks the old file does not have, contiguous ones in one range
+        QSet<QByteArray> known;
+        for (auto& chunk : recipeOf(original))
+            known.insert(ClipShareChunkStore::key(chunk));
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> expected;
+        std::uint64_t offset = 0;
+        for (auto& chunk : recipeOf(edited))
+        {
+            if (!known.contains(ClipShareChunkStore::key(chunk)))
+            {
+                if (!expected.empty() && expected.back().first + expected.back().second == offset)
+                    expected.back().second += chunk.length;
+                else
+                    expected.push_back({ offset, chunk.length });
+            }
+            offset += chunk.length;
+        }
+        CHECK(!expected.empty());
+
+        auto newPath = directory.filePath("new");
+        auto batches = reuseInto(store, newPath, edited);
+        CHECK(batches.size() == expected.size());
+        for (std::size_t i = 0; i < batches.size() && i < expected.size(); ++i)
+        {
+            CHECK(batches[i].index == 7 && batches[i].count == 1);
+            CHECK(batches[i].offset == expected[i].first && batches[i].length == expected[i].second);
+        }
+
+        // everything outside the missing ranges was copied from the old file
+        QFile copy(newPath);
+        CHECK(copy.open(QFile::ReadOnly));
+        auto copied = copy.readAll();
+        for (auto& range : expected)
+            copied.replace(static_cast<int>(range.first), static_cast<int>(range.second), edited.mid(static_cast<int>(range.first), static_cast<int>(range.second)));
+        CHECK(copied == edited);
+
+        // the old file changed since, its chunks fail the hash and are forgotten, the whole file is asked for
+        CHECK(writeFile(oldPath, randomBytes(original.size(), 7)));
+        batches = reuseInto(store, newPath, edited);
+        CHECK(batches.size() == 1 && batches.front().offset == 0 && batches.front().length == static_cast<std::uint64_t>(edited.size()));
+        CHECK(store.size() == 0);
+#endif
+    }
+
+    ClipSharePackage formatsPackage()
+    {
+        ClipSharePackage package;
+        package.mimeFormats = QStringList{ "text/plain", "application/x-private", "text/plain;charset=utf-8", "text/html" };
+        package.mimeData = QByteArrayList{ "text", "private", "text", "<b>text</b>" };
+        return package;
+    }
+
+    void testPruneFormats()
+    {
+        auto package = formatsPackage();
+        CHECK(package.pruneFormats({ "text/html", "text/*" }) == 2);
+        CHECK(package.mimeFormats == QStringList({ "text/html", "text/plain" }));
+        CHECK(package.mimeData == QByteArrayList({ "<b>text</b>", "text" }));
+
+        // everything without a list, the same text twice still only once
+        package = formatsPackage();
+        CHECK(package.pruneFormats({}) == 1);
+        CHECK(package.mimeFormats == QStringList({ "text/plain", "application/x-private", "text/html" }));
+
+        // a different text in the charset variant is kept
+        package = formatsPackage();
+        package.mimeData[2] = "other";
+        CHECK(package.pruneFormats({ "TEXT/PLAIN*" }) == 2);
+        CHECK(package.mimeFormats == QStringList({ "text/plain", "text/plain;charset=utf-8" }));
+
+        package = formatsPackage();
+        package.mimeImageType = ClipSharePackage::DefaultMimeImageType;
+        package.mimeImageData = "png";
+        CHECK(package.pruneFormats({ "text/*" }) == 3);
+        CHECK(package.mimeImageType.isEmpty() && package.mimeImageData.isEmpty());
+
+        package = formatsPackage();
+        package.mimeImageType = ClipSharePackage::DefaultMimeImageType;
+        package.mimeImageData = "png";
+        CHECK(package.pruneFormats({ "image/*" }) == 4);
+        CHECK(package.mimeFormats.isEmpty() && package.mimeImageData == "png");
+    }
+
+    QByteArray chunk(quint32 stream, quint8 flags, const QByteArray& data)
+    {
+        ClipShareChunkHeader header;
+        header.stream = stream;
+        header.flags = flags;
+        header.length = static_cast<quint32>(data.size());
+        return ClipShareFrame::encodeHeader(header) + data;
+    }
+
+    void testFrame()
+    {
+        // a message read byte by byte comes out whole, once
+        QByteArray payload;
+        quint32 stream = 0;
+        auto encoded = ClipShareFrame::encode("hello frame", 3);
+        ClipShareFrame frame;
+        bool early = false;
+        for (int i = 0; i < encoded.size(); ++i)
+        {
+            early = early || frame.next(payload);
+            frame.append(encoded.mid(i, 1));
+        }
+        CHECK(!early);
+        CHECK(frame.next(payload, nullptr, &stream) && payload == "hello frame" && stream == 3);
+        CHECK(!frame.next(payload) && frame.pendingBytes() == 0);
+
+        // a header above maxPayload condemns the connection before its bytes arrive
+        ClipShareChunkHeader header;
+        header.stream = 1;
+        header.flags = ClipShareChunkHeader::Begin | ClipShareChunkHeader::End;
+        header.length = 1u << 30;
+        ClipShareFrame announced{ 1024 };
+        announced.append(ClipShareFrame::encodeHeader(header));
+        CHECK(!announced.next(payload) && announced.oversized());
+
+        // and so do chunks that only add up to more
+        ClipShareFrame growing{ 1024 };
+        growing.append(chunk(1, ClipShareChunkHeader::Begin, QByteArray(600, 'a')));
+        growing.append(chunk(1, 0, QByteArray(600, 'b')));
+        CHECK(!growing.next(payload) && growing.oversized());
+
+        ClipShareFrame opened;
+        for (quint32 i = 1; i <= ClipShareFrame::MaxOpenStreams + 1; ++i)
+            opened.append(chunk(i, ClipShareChunkHeader::Begin, "x"));
+        CHECK(!opened.next(payload) && opened.oversized());
+
+        // the end of a stream that never began is skipped, a cancelled one is dropped
+        ClipShareFrame skipping;
+        skipping.append(chunk(5, ClipShareChunkHeader::End, "lost"));
+        skipping.append(chunk(6, ClipShareChunkHeader::Begin, "gone"));
+        skipping.append(chunk(6, ClipShareChunkHeader::Cancel, {}));
+        skipping.append(chunk(6, ClipShareChunkHeader::End, "tail"));
+        skipping.append(ClipShareFrame::encode("whole", 7));
+        CHECK(skipping.next(payload, nullptr, &stream) && payload == "whole" && stream == 7);
+        CHECK(!skipping.next(payload) && !skipping.oversized());
+        CHECK(skipping.cancelledCount() == 1 && skipping.pendingBytes() == 0);
+    }
+
+    void testClipDatagram()
+    {
+        ClipShareClipDatagram fragment;
+        fragment.command = ClipShareClipDatagram::Fragment;
+        fragment.nodeId = 7;
+        fragment.sequence = 9;
+        fragment.index = 2;
+        fragment.count = 5;
+        fragment.data = "piece";
+
+        ClipShareClipDatagram nack;
+        nack.command = ClipShareClipDatagram::Nack;
+        nack.nodeId = 8;
+        nack.sequence = 9;
+        nack.missing = QVector<quint32>({ 1, 3 });
+
+        ClipShareClipDatagram have;
+        have.command = ClipShareClipDatagram::Have;
+        have.nodeId = 8;
+        have.sequence = 9;
+        have.origin = 7;
+
+        ClipShareClipDatagram clip;
+        clip.nodeId = 7;
+        clip.sequence = 10;
+        clip.package.sender = "host";
+        clip.package.mimeFormats = QStringList{ "text/plain" };
+        clip.package.mimeData = QByteArrayList{ QByteArray("text").toBase64() };
+
+        ClipShareClipDatagram decoded;
+        CHECK(ClipShareClipDatagram::decode(fragment.encode(), decoded) && decoded.command == ClipShareClipDatagram::Fragment);
+        CHECK(decoded.nodeId == 7 && decoded.sequence == 9 && decoded.index == 2 && decoded.count == 5 && decoded.data == "piece");
+        CHECK(ClipShareClipDatagram::decode(nack.encode(), decoded) && decoded.missing == nack.missing);
+        CHECK(ClipShareClipDatagram::decode(have.encode(), decoded) && decoded.origin == 7);
+        CHECK(ClipShareClipDatagram::decode(clip.encode(), decoded) && decoded.package.origin == 7 && decoded.package.sequence == 10);
+        CHECK(decoded.package.sender == "host" && decoded.package.mimeFormats == clip.package.mimeFormats && decoded.package.mimeData == clip.package.mimeData);
+
+        // no cut of a datagram decodes
+        for (auto& datagram : { fragment, nack, have, clip })
+        {
+            auto bytes = datagram.encode();
+            bool rejected = true;
+            for (int size = 0; size < bytes.size(); ++size)
+                rejected = rejected && !ClipShareClipDatagram::decode(bytes.left(size), decoded);
+            CHECK(rejected);
+        }
+
+        auto bytes = fragment.encode();
+        bytes[0] = static_cast<char>(bytes[0] ^ 1);
+        CHECK(!ClipShareClipDatagram::matches(bytes.constData(), bytes.size()) && !ClipShareClipDatagram::decode(bytes, decoded));
+
+        fragment.index = fragment.count;
+        CHECK(!ClipShareClipDatagram::decode(fragment.encode(), decoded));
+
+        // a Nack claiming more indices than it carries
+        nack.missing.clear();
+        bytes = nack.encode();
+        bytes[bytes.size() - 2] = static_cast<char>(0xff);
+        bytes[bytes.size() - 1] = static_cast<char>(0xff);
+        CHECK(!ClipShareClipDatagram::decode(bytes, decoded));
+
+        have.command = 99;
+        CHECK(!ClipShareClipDatagram::decode(have.encode(), decoded));
+    }
+
+    ClipShareClipDatagram fragmentOf(quint64 nodeId, quint64 sequence, quint32 index, quint32 count, int size)
+    {
+        ClipShareClipDatagram datagram;
+        datagram.command = ClipShareClipDatagram::Fragment;
+        datagram.nodeId = nodeId;
+        datagram.sequence = sequence;
+        datagram.index = index;
+        datagram.count = count;
+        datagram.data = QByteArray(size, static_cast<char>('a' + index));
+        return datagram;
+    }
+
+    void testReassembly()
+    {
+        const int size = ClipShareReassembly::FragmentSize;
+        auto message = randomBytes(3 * size + 100, 11);
+        QVector<ClipShareClipDatagram> fragments;
+        for (auto& datagram : ClipShareReassembly::fragment(42, 1, message))
+        {
+            ClipShareClipDatagram decoded;
+            CHECK(ClipShareClipDatagram::decode(datagram, decoded));
+            fragments.push_back(decoded);
+        }
+        CHECK(fragments.size() == 4);
+
+        // the last fragment first tells what is missing
+        ClipShareReassembly reassembly{ 1 << 20, 1 << 20 };
+        QByteArray payload;
+        QVector<quint32> missing;
+        CHECK(reassembly.add(fragments[3], 1, payload, missing) == ClipShareReassembly::Missing);
+        CHECK(missing == QVector<quint32>({ 0, 1, 2 }));
+        CHECK(reassembly.add(fragments[0], 2, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(reassembly.add(fragments[0], 2, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(reassembly.add(fragments[1], 3, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(reassembly.add(fragments[2], 4, payload, missing) == ClipShareReassembly::Complete);
+        CHECK(payload == message && reassembly.pendingBytes() == 0);
+
+        // fragments a decoder would not have let through
+        CHECK(reassembly.add(fragmentOf(1, 1, 0, 0, 1), 5, payload, missing) == ClipShareReassembly::Rejected);
+        CHECK(reassembly.add(fragmentOf(1, 1, 4, 4, 1), 5, payload, missing) == ClipShareReassembly::Rejected);
+        CHECK(reassembly.add(fragmentOf(1, 1, 0, 1, size + 1), 5, payload, missing) == ClipShareReassembly::Rejected);
+        CHECK(reassembly.add(fragmentOf(1, 1, 0, (1 << 20) / size + 2, 1), 5, payload, missing) == ClipShareReassembly::Rejected);
+        CHECK(reassembly.pendingBytes() == 0);
+
+        // without limits a count no QByteArray could hold is still refused
+        ClipShareReassembly unlimited;
+        CHECK(unlimited.add(fragmentOf(1, 1, 0, std::numeric_limits<quint32>::max(), 1), 5, payload, missing) == ClipShareReassembly::Rejected);
+        CHECK(unlimited.pendingBytes() == 0);
+
+        // a count that changes within a sequence starts the message over, an older sequence is refused
+        CHECK(reassembly.add(fragmentOf(2, 5, 0, 4, size), 6, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(reassembly.add(fragmentOf(2, 5, 0, 2, size), 7, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(reassembly.pendingBytes() == size);
+        CHECK(reassembly.add(fragmentOf(2, 4, 1, 2, size), 8, payload, missing) == ClipShareReassembly::Rejected);
+        CHECK(reassembly.add(fragmentOf(2, 5, 1, 2, 10), 9, payload, missing) == ClipShareReassembly::Complete);
+        CHECK(payload.size() == size + 10 && reassembly.pendingBytes() == 0);
+
+        // beyond maxPending the message that started first goes, a single one too large is refused
+        ClipShareReassembly budget{ 0, 2 * size };
+        CHECK(budget.add(fragmentOf(3, 1, 0, 4, size), 10, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(budget.add(fragmentOf(3, 1, 1, 4, size), 11, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(budget.add(fragmentOf(4, 1, 0, 4, size), 12, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(budget.pendingBytes() == size);
+        CHECK(budget.add(fragmentOf(4, 1, 1, 4, size), 13, payload, missing) == ClipShareReassembly::Incomplete);
+        CHECK(budget.add(fragmentOf(4, 1, 2, 4, size), 14, payload, missing) == ClipShareReassembly::Rejected);
+        CHECK(budget.pendingBytes() == 2 * size);
+    }
+
+    template <typename Package>
+    bool rejects(const char* json)
+    {
+        try {
+            Package::decode(QByteArray(json));
+        }
+        catch (const nlohmann::json::exception&)
+        {
+            return true;
+        }
+        return false;
+    }
+
+    bool rejectsManifest(const char* json)
+    {
+        try {
+            nlohmann::json::parse(json).get<std::vector<ClipShareFileEntry>>();
+        }
+        catch (const nlohmann::json::exception&)
+        {
+            return true;
+        }
+        return false;
+    }
+
+    void testControlPackages()
+    {
+        ClipShareRingPackage ring;
+        ring.kind = ClipShareRingPackage::Clip;
+        ring.stream = 3;
+        ring.offset = 100;
+        ring.length = 50;
+        auto decoded = ClipShareRingPackage::decode(ring.encode());
+        CHECK(decoded.kind == ClipShareRingPackage::Clip && decoded.stream == 3 && decoded.offset == 100 && decoded.length == 50);
+        CHECK(decoded.fits(150) && !decoded.fits(149));
+
+        // offset + length wrapping around does not land inside the ring
+        ring.offset = std::numeric_limits<std::uint64_t>::max() - 1;
+        ring.length = 4;
+        CHECK(!ring.fits(1 << 20));
+        ring.offset = 0;
+        ring.length = (1 << 20) + 1;
+        CHECK(!ring.fits(1 << 20));
+
+        CHECK(rejects<ClipShareRingPackage>("not json"));
+        CHECK(rejects<ClipShareRingPackage>("[5, 2]"));
+        CHECK(rejects<ClipShareRingPackage>("{\"command\":5,\"kind\":\"2\"}"));
+        CHECK(rejects<ClipShareRingPackage>("{\"key\":5}"));
+        CHECK(rejects<ClipShareRingPackage>("{\"size\":\"large\"}"));
+        // missing fields keep their defaults
+        decoded = ClipShareRingPackage::decode("{}");
+        CHECK(decoded.command == ClipShareControlPackage::Ring && decoded.kind == ClipShareRingPackage::Attach && decoded.key.empty());
+
+        CHECK(rejects<ClipShareControlPackage>("{\"command\":1"));
+        CHECK(rejects<ClipShareControlPackage>("{\"command\":\"1\"}"));
+        CHECK(rejects<ClipShareControlPackage>("{\"time\":null}"));
+        CHECK(rejects<ClipShareControlPackage>("\"Ack\""));
+        CHECK(ClipShareControlPackage::decode("{\"command\":2,\"stream\":4}").stream == 4);
+    }
+
+    void testFileRequests()
+    {
+        // manifest paths stay below the fetch directory
+        CHECK(ClipShareFileTransfer::safePath("a") && ClipShareFileTransfer::safePath("dir/file.txt") && ClipShareFileTransfer::safePath("..."));
+        for (auto& path : { std::string{}, std::string("/etc/passwd"), std::string(".."), std::string("."), std::string("../x"), std::string("a/../../x"),
+            std::string("a/./b"), std::string("a//b"), std::string("a/"), std::string("a\\b"), std::string("a\0b", 3) })
+        {
+            CHECK(!ClipShareFileTransfer::safePath(path));
+        }
+
+        CHECK(rejectsManifest("[{\"path\":\"a\",\"size\":\"1\"}]"));
+        CHECK(rejectsManifest("[{\"path\":1}]"));
+        CHECK(rejectsManifest("{\"path\":\"a\"}"));
+        CHECK(rejectsManifest("[{\"path\":\"a\",\"directory\":1}]"));
+        auto entries = nlohmann::json::parse("[{\"path\":\"a\",\"size\":3},{\"path\":\"d\",\"directory\":true}]").get<std::vector<ClipShareFileEntry>>();
+        CHECK(entries.size() == 2 && entries[0].size == 3 && !entries[0].directory && entries[1].directory);
+
+        ClipShareFileRequest request;
+        CHECK(ClipShareFileTransfer::validRequest(request));
+        request.kind = ClipShareFileRequest::Chunks;
+        CHECK(ClipShareFileTransfer::validRequest(request));
+        request.kind = ClipShareFileRequest::Files;
+        request.count = 1;
+        CHECK(ClipShareFileTransfer::validRequest(request));
+        request.count = ClipShareFileTransfer::BatchFiles;
+        CHECK(ClipShareFileTransfer::validRequest(request));
+        // a count that would have the server answer billions of headers
+        request.count = std::numeric_limits<std::uint32_t>::max();
+        CHECK(!ClipShareFileTransfer::validRequest(request));
+        request.count = 0;
+        CHECK(!ClipShareFileTransfer::validRequest(request));
+        request.count = 1;
+        request.kind = 3;
+        CHECK(!ClipShareFileTransfer::validRequest(request));
+        request.kind = ClipShareFileRequest::Files;
+        request.magic = ~ClipShareFileRequest::Magic;
+        CHECK(!ClipShareFileTransfer::validRequest(request));
+    }
+}
+
+int main()
+{
+    testDelta();
+    testChunker();
+    testReuseChunks();
+    testPruneFormats();
+    testFrame();
+    testClipDatagram();
+    testReassembly();
+    testControlPackages();
+    testFileRequests();
+
+    if (failures > 0)
+        std::fprintf(stderr, "%d checks failed\n", failures);
+    return failures == 0 ? 0 : 1;
+}
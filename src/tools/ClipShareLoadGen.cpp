@@ -0,0 +1,815 @@
+﻿#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QNetworkAccessManager>
+#include <QNetworkDatagram>
+#include <QNetworkReply>
+#include <QRandomGenerator>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QUdpSocket>
+#include <QUrl>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include "ClipShareBloomFilter.h"
+#include "ClipShareFrame.h"
+#include "ClipShareHistogram.h"
+#include "ClipSharePackage.h"
+
+#ifdef Q_OS_LINUX
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    /// <summary>
+    /// One kind of clip in the replayed mix
+    /// </summary>
+    struct Workload
+    {
+        QString type{ "text" };     // text / html / image
+        int size{ 256 };
+        int weight{ 1 };
+        ClipSharePackage package;   // encoded once, sent by every peer
+
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(Workload, type, size, weight);
+    };
+
+    struct LoadGenStats
+    {
+        quint64 clipsSent{ 0 };
+        quint64 bytesSent{ 0 };
+        quint64 clipsReceived{ 0 };
+        quint64 datagramsReceived{ 0 };         // of clipsReceived, over the fast path
+        quint64 bytesReceived{ 0 };
+        quint64 uplinks{ 0 };
+        quint64 downlinks{ 0 };
+        quint64 socketErrors{ 0 };
+        ClipShareHistogram receiveLatency;      // us, node -> virtual peer
+        ClipShareHistogram writeLatency;        // us, write() until the node drained it
+
+        // gossip mode, clips spread among the virtual peers and the node
+        struct GossipClip
+        {
+            qint64 sentAt{ 0 };
+            qint64 lastAt{ 0 };     // the latest first arrival at a virtual peer
+            int reached{ 0 };       // virtual peers other than the origin
+        };
+        std::map<std::pair<quint64, quint64>, GossipClip> gossipClips;     // by origin and sequence
+        quint64 gossipUsefulBytes{ 0 };         // clips received for the first time
+        quint64 gossipRedundantBytes{ 0 };      // clips received again
+        quint64 gossipControlBytes{ 0 };        // Have and Want datagrams
+        quint64 gossipDuplicates{ 0 };          // Haves of clips already known
+        quint64 gossipPulls{ 0 };
+    };
+
+    struct GossipMember
+    {
+        quint64 nodeId;
+        quint16 heartbeatPort;
+        quint16 packagePort;
+    };
+
+    struct LoadGenOptions
+    {
+        QHostAddress node{ QHostAddress::LocalHost };
+        quint16 heartbeatPort{ 41688 };
+        quint16 packagePort{ 41688 };
+        int heartbeatInterval{ 20000 };
+        double rate{ 10 };              // clips per second over all peers
+        int gossipFanout{ 0 };          // the peers gossip among themselves and with the node, 0 sends to the node
+        const std::vector<GossipMember>* mesh{ nullptr };
+    };
+
+    QByteArray makePayload(int size)
+    {
+        QByteArray payload(size, Qt::Uninitialized);
+        auto random = QRandomGenerator(static_cast<quint32>(size));
+        for (auto& c : payload)
+            c = static_cast<char>('a' + random.bounded(26));
+        return payload;
+    }
+
+    void preparePackage(Workload& workload)
+    {
+        auto payload = makePayload(workload.size);
+        auto& package = workload.package;
+        if (workload.type == "image")
+        {
+            package.mimeImageType = ClipSharePackage::DefaultMimeImageType;
+            package.mimeImageData = payload.toBase64();
+            package.mimeFormats.push_back("application/x-qt-image");
+            package.mimeData.push_back(QByteArray{});
+        }
+        else if (workload.type == "html")
+        {
+            auto html = "<html><body><p>" + payload + "</p></body></html>";
+            package.mimeFormats.push_back("text/html");
+            package.mimeData.push_back(html.toBase64());
+            package.mimeFormats.push_back("text/plain");
+            package.mimeData.push_back(payload.toBase64());
+        }
+        else
+        {
+            package.mimeFormats.push_back("text/plain");
+            package.mimeData.push_back(payload.toBase64());
+        }
+        package.sender = "clipshare_loadgen";
+    }
+
+    /// <summary>
+    /// A ClipShare node in miniature: heartbeat socket, package server for the
+    /// node to connect to, and an uplink replaying the workload to the node.
+    /// </summary>
+    class VirtualPeer : public QObject
+    {
+    public:
+        VirtualPeer(const LoadGenOptions& options, const std::vector<Workload>& workloads, LoadGenStats& stats, QObject* parent = Q_NULLPTR)
+            : QObject(parent)
+            , options{ options }
+            , workloads{ workloads }
+            , stats{ stats }
+            , nodeId{ QRandomGenerator::global()->generate64() }
+        {
+            for (auto& workload : workloads)
+                totalWeight += workload.weight;
+        }
+
+        bool start()
+        {
+            if (!server.listen(QHostAddress::LocalHost, 0) || !heartbeat.bind(QHostAddress::LocalHost, 0))
+                return false;
+
+            connect(&server, &QTcpServer::newConnection, this, [this] { acceptDownlinks(); });
+            connect(&heartbeat, &QUdpSocket::readyRead, this, [this] { readHeartbeats(); });
+
+            heartbeatTimer.setInterval(options.heartbeatInterval);
+            connect(&heartbeatTimer, &QTimer::timeout, this, [this] { sendHeartbeat(ClipShareHeartbeatPackage::Heartbeat, 0, 0, QHostAddress{}, 0); });
+            connect(&gossipTimer, &QTimer::timeout, this, [this]
+                {
+                    if (!gossipCache.empty())
+                        pushGossip(gossipCache.back(), 1);
+                });
+            if (options.gossipFanout > 0)
+                gossipTimer.start(1000);
+            heartbeatTimer.start();
+            sendHeartbeat(ClipShareHeartbeatPackage::Heartbeat, 0, 0, QHostAddress{}, 0);
+
+            connect(&uplink, &QTcpSocket::connected, this, [this]
+                {
+                    ++stats.uplinks;
+                    scheduleClip();
+                });
+            connect(&uplink, &QTcpSocket::bytesWritten, this, [this]
+                {
+                    // everything written so far reached the node's socket buffer
+                    if (uplink.bytesToWrite() != 0)
+                        return;
+                    auto now = ClipShareTrace::now();
+                    for (auto writtenAt : pendingWrites)
+                        stats.writeLatency.record((now - writtenAt) / 1000);
+                    pendingWrites.clear();
+                });
+            connect(&uplink, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, [this]
+                {
+                    ++stats.socketErrors;
+                    spdlog::debug("[LoadGen] {:016x} uplink: {}", nodeId, uplink.errorString());
+                });
+            uplink.connectToHost(options.node, options.packagePort);
+
+            clipTimer.setSingleShot(true);
+            connect(&clipTimer, &QTimer::timeout, this, [this]
+                {
+                    sendClip();
+                    scheduleClip();
+                });
+            return true;
+        }
+
+        void stop()
+        {
+            clipTimer.stop();
+            heartbeatTimer.stop();
+        }
+
+        GossipMember member() const
+        {
+            return GossipMember{ nodeId, heartbeat.localPort(), server.serverPort() };
+        }
+
+    private:
+        // exponential gaps, peers together send options.rate clips per second
+        void scheduleClip()
+        {
+            if (options.rate <= 0 || totalWeight == 0)
+                return;
+            auto peers = std::max(1, parent() ? parent()->children().size() : 1);
+            auto mean = 1000.0 * peers / options.rate;
+            auto gap = -std::log(1.0 - QRandomGenerator::global()->generateDouble()) * mean;
+            clipTimer.start(static_cast<int>(std::min(gap, 3600000.0)));
+        }
+
+        void sendClip()
+        {
+            if (uplink.state() != QAbstractSocket::ConnectedState)
+                return;
+
+            auto pick = QRandomGenerator::global()->bounded(totalWeight);
+            auto workload = workloads.begin();
+            while (pick >= workload->weight)
+                pick -= (workload++)->weight;
+
+            auto package = workload->package;
+            package.origin = nodeId;
+            package.sequence = ++sequence;
+            package.trace.stamp(ClipShareTrace::Capture);
+            package.trace.stamps[ClipShareTrace::Encode] = package.trace.stamps[ClipShareTrace::Capture];
+            package.trace.stamps[ClipShareTrace::Enqueue] = package.trace.stamps[ClipShareTrace::Capture];
+            package.trace.stamp(ClipShareTrace::Write);
+
+            if (options.gossipFanout > 0)
+            {
+                stats.gossipClips[{ nodeId, package.sequence }].sentAt = package.trace.stamps[ClipShareTrace::Capture];
+                ++stats.clipsSent;
+                gossipReceived(package);
+                return;
+            }
+
+            auto frame = ClipShareFrame::encode(package.encode());
+            uplink.write(frame);
+            pendingWrites.push_back(package.trace.stamps[ClipShareTrace::Write]);
+            ++stats.clipsSent;
+            stats.bytesSent += frame.size();
+        }
+
+        void sendHeartbeat(std::uint32_t command, qint64 originTime, qint64 receiveTime, const QHostAddress& address, quint16 port)
+        {
+            auto pkg = command == ClipShareHeartbeatPackage::Response ? ClipShareHeartbeatPackage_Response : ClipShareHeartbeatPackage_Heartbeat;
+            pkg.nodeId = nodeId;
+            pkg.packagePort = server.serverPort();
+            pkg.originTime = command == ClipShareHeartbeatPackage::Response ? originTime : ClipShareTrace::now();
+            pkg.receiveTime = receiveTime;
+            pkg.transmitTime = ClipShareTrace::now();
+            heartbeat.writeDatagram(reinterpret_cast<const char*>(&pkg), sizeof(pkg)
+                , address.isNull() ? options.node : address, port == 0 ? options.heartbeatPort : port);
+        }
+
+        void readHeartbeats()
+        {
+            while (heartbeat.hasPendingDatagrams())
+            {
+                auto datagram = heartbeat.receiveDatagram();
+                auto receivedAt = ClipShareTrace::now();
+
+                ClipShareClipDatagram gossip;
+                if (ClipShareClipDatagram::matches(datagram.data().constData(), datagram.data().size())
+                    && ClipShareClipDatagram::decode(datagram.data(), gossip)
+                    && (gossip.command == ClipShareClipDatagram::Have || gossip.command == ClipShareClipDatagram::Want))
+                {
+                    readGossip(gossip, datagram.senderAddress(), datagram.senderPort(), receivedAt);
+                    continue;
+                }
+
+                // fast path clips from the node, acknowledged so it does not retry
+                ClipShareClipDatagram clip;
+                if (ClipShareClipDatagram::matches(datagram.data().constData(), datagram.data().size())
+                    && ClipShareClipDatagram::decode(datagram.data(), clip) && clip.command == ClipShareClipDatagram::Clip)
+                {
+                    ++stats.clipsReceived;
+                    ++stats.datagramsReceived;
+                    stats.bytesReceived += datagram.data().size();
+                    if (clip.package.trace.has(ClipShareTrace::Capture))
+                        stats.receiveLatency.record((receivedAt - clip.package.trace.stamps[ClipShareTrace::Capture]) / 1000);
+
+                    ClipShareClipDatagram ack;
+                    ack.command = ClipShareClipDatagram::Ack;
+                    ack.nodeId = nodeId;
+                    ack.sequence = clip.sequence;
+                    heartbeat.writeDatagram(ack.encode(), datagram.senderAddress(), datagram.senderPort());
+                    continue;
+                }
+
+                ClipShareHeartbeatPackage pkg;
+                if (!ClipShareHeartbeatPackage::parse(datagram.data(), pkg) || !pkg.valid())
+                    continue;
+                nodeNodeId = pkg.nodeId;
+                if (pkg.command == ClipShareHeartbeatPackage::Heartbeat)
+                    sendHeartbeat(ClipShareHeartbeatPackage::Response, pkg.originTime, receivedAt, datagram.senderAddress(), datagram.senderPort());
+            }
+        }
+
+        void acceptDownlinks()
+        {
+            while (server.hasPendingConnections())
+            {
+                auto conn = server.nextPendingConnection();
+                ++stats.downlinks;
+                auto frame = std::make_shared<ClipShareFrame>();
+                connect(conn, &QTcpSocket::disconnected, conn, &QObject::deleteLater);
+                connect(conn, &QTcpSocket::readyRead, this, [this, conn, frame]
+                    {
+                        auto receivedAt = ClipShareTrace::now();
+                        auto data = conn->readAll();
+                        stats.bytesReceived += data.size();
+                        frame->append(data, receivedAt);
+                        QByteArray payload;
+                        quint32 stream = 0;
+                        while (frame->next(payload, nullptr, &stream))
+                        {
+                            // the node's keepalive pings
+                            if (stream == ClipShareChunkHeader::ControlStream)
+                                continue;
+
+                            try {
+                                auto package = ClipSharePackage::decode(payload);
+                                ++stats.clipsReceived;
+                                // same host, one monotonic clock
+                                if (package.trace.has(ClipShareTrace::Capture))
+                                    stats.receiveLatency.record((receivedAt - package.trace.stamps[ClipShareTrace::Capture]) / 1000);
+
+                                if (options.gossipFanout > 0)
+                                {
+                                    if (seen.contains(ClipShareBloomFilter::key(package.origin, package.sequence)))
+                                        stats.gossipRedundantBytes += payload.size();
+                                    else
+                                    {
+                                        stats.gossipUsefulBytes += payload.size();
+                                        auto clip = stats.gossipClips.find({ package.origin, package.sequence });
+                                        if (clip != stats.gossipClips.end() && package.origin != nodeId)
+                                        {
+                                            ++clip->second.reached;
+                                            clip->second.lastAt = std::max(clip->second.lastAt, receivedAt);
+                                        }
+                                        gossipReceived(package);
+                                    }
+                                }
+
+                                // acknowledged like a real peer, feeds the node's delivery summary
+                                ClipShareControlPackage ack;
+                                ack.command = ClipShareControlPackage::Ack;
+                                ack.stream = stream;
+                                ack.time = ClipShareTrace::now();
+                                conn->write(ClipShareFrame::encode(ack.encode(), ClipShareChunkHeader::ControlStream));
+                            }
+                            catch (const nlohmann::json::exception&)
+                            {
+                                ++stats.socketErrors;
+                            }
+                        }
+                    });
+            }
+        }
+
+        void gossipReceived(const ClipSharePackage& package)
+        {
+            auto key = ClipShareBloomFilter::key(package.origin, package.sequence);
+            wanted.remove(key);
+            if (!seen.testAndInsert(key))
+                return;
+            gossipCache.push_back(package);
+            if (gossipCache.size() > 16)
+                gossipCache.erase(gossipCache.begin());
+            pushGossip(package, options.gossipFanout);
+        }
+
+        // Have to fanout random members of the mesh, the node is the last one
+        void pushGossip(const ClipSharePackage& package, int fanout)
+        {
+            ClipShareClipDatagram have;
+            have.command = ClipShareClipDatagram::Have;
+            have.nodeId = nodeId;
+            have.origin = package.origin;
+            have.sequence = package.sequence;
+            auto bytes = have.encode();
+
+            auto& mesh = *options.mesh;
+            auto members = static_cast<int>(mesh.size()) + 1;
+            auto random = QRandomGenerator::global();
+            for (int pushed = 0, attempts = 0; pushed < fanout && attempts < 4 * fanout; ++attempts)
+            {
+                auto pick = static_cast<int>(random->bounded(members));
+                if (pick == members - 1)
+                    heartbeat.writeDatagram(bytes, options.node, options.heartbeatPort);
+                else if (mesh[pick].nodeId != nodeId && mesh[pick].nodeId != package.origin)
+                    heartbeat.writeDatagram(bytes, QHostAddress::LocalHost, mesh[pick].heartbeatPort);
+                else
+                    continue;
+                stats.gossipControlBytes += bytes.size();
+                ++pushed;
+            }
+        }
+
+        void readGossip(const ClipShareClipDatagram& datagram, const QHostAddress& sender, quint16 senderPort, qint64 receivedAt)
+        {
+            if (datagram.command == ClipShareClipDatagram::Want)
+            {
+                for (auto& package : gossipCache)
+                {
+                    if (package.origin != datagram.origin || package.sequence != datagram.sequence)
+                        continue;
+                    auto conn = datagram.nodeId == nodeNodeId ? &uplink : link(datagram.nodeId);
+                    if (conn != nullptr)
+                    {
+                        auto frame = ClipShareFrame::encode(package.encode());
+                        conn->write(frame);
+                        stats.bytesSent += frame.size();
+                        ++stats.gossipPulls;
+                    }
+                    break;
+                }
+                return;
+            }
+
+            auto key = ClipShareBloomFilter::key(datagram.origin, datagram.sequence);
+            auto pending = wanted.find(key);
+            if (seen.contains(key) || (pending != wanted.end() && *pending > receivedAt))
+            {
+                ++stats.gossipDuplicates;
+                return;
+            }
+            wanted.insert(key, receivedAt + 500000000);
+
+            ClipShareClipDatagram want;
+            want.command = ClipShareClipDatagram::Want;
+            want.nodeId = nodeId;
+            want.origin = datagram.origin;
+            want.sequence = datagram.sequence;
+            auto bytes = want.encode();
+            heartbeat.writeDatagram(bytes, sender, senderPort);
+            stats.gossipControlBytes += bytes.size();
+        }
+
+        // connection to another virtual peer's package server, for the clips it pulls from us
+        QTcpSocket* link(quint64 member)
+        {
+            if (auto conn = links.value(member))
+                return conn;
+            for (auto& candidate : *options.mesh)
+            {
+                if (candidate.nodeId != member)
+                    continue;
+                auto conn = new QTcpSocket(this);
+                // acknowledgements only
+                connect(conn, &QTcpSocket::readyRead, conn, [conn] { conn->readAll(); });
+                conn->connectToHost(QHostAddress::LocalHost, candidate.packagePort);
+                links.insert(member, conn);
+                return conn;
+            }
+            return nullptr;
+        }
+
+        const LoadGenOptions& options;
+        const std::vector<Workload>& workloads;
+        LoadGenStats& stats;
+        quint64 nodeId;
+        quint64 nodeNodeId{ 0 };    // of the node under test, from its heartbeat responses
+        quint64 sequence{ 0 };
+        int totalWeight{ 0 };
+
+        ClipShareBloomFilter seen;
+        std::vector<ClipSharePackage> gossipCache;
+        QHash<quint64, qint64> wanted;
+        QMap<quint64, QTcpSocket*> links;
+
+        QUdpSocket heartbeat{ this };
+        QTcpServer server{ this };
+        QTcpSocket uplink{ this };
+        QTimer heartbeatTimer{ this };
+        QTimer clipTimer{ this };
+        QTimer gossipTimer{ this };
+        std::vector<qint64> pendingWrites;
+    };
+
+    /// <summary>
+    /// CPU and resident memory of the node under test, from /proc
+    /// </summary>
+    class NodeSampler
+    {
+    public:
+        explicit NodeSampler(qint64 pid)
+            : pid{ pid }
+        {
+        }
+
+        void sample()
+        {
+#ifdef Q_OS_LINUX
+            QFile stat(QString("/proc/%1/stat").arg(pid));
+            if (stat.open(QFile::ReadOnly))
+            {
+                // fields after the parenthesized command name, utime and stime are 14 and 15
+                auto line = stat.readAll();
+                auto fields = line.mid(line.lastIndexOf(')') + 2).split(' ');
+                if (fields.size() > 13)
+                {
+                    auto ticks = fields[11].toLongLong() + fields[12].toLongLong();
+                    if (clock.isValid())
+                    {
+                        auto elapsed = clock.restart();
+                        if (elapsed > 0)
+                            cpuSamples.push_back(100.0 * (ticks - lastTicks) / sysconf(_SC_CLK_TCK) / (elapsed / 1000.0));
+                    }
+                    else
+                        clock.start();
+                    lastTicks = ticks;
+                }
+            }
+
+            QFile status(QString("/proc/%1/status").arg(pid));
+            if (status.open(QFile::ReadOnly))
+            {
+                for (auto& line : status.readAll().split('\n'))
+                {
+                    if (line.startsWith("VmRSS:"))
+                        maxRssKb = std::max(maxRssKb, line.mid(6).trimmed().split(' ').front().toLongLong());
+                }
+            }
+#endif
+        }
+
+        nlohmann::json report() const
+        {
+            if (cpuSamples.empty())
+                return nullptr;
+            double sum = 0;
+            for (auto cpu : cpuSamples)
+                sum += cpu;
+            return {
+                { "pid", pid },
+                { "cpuPercentMean", sum / cpuSamples.size() },
+                { "cpuPercentMax", *std::max_element(cpuSamples.begin(), cpuSamples.end()) },
+                { "rssMaxMb", maxRssKb / 1024.0 },
+            };
+        }
+
+    private:
+        qint64 pid;
+        QElapsedTimer clock;
+        qint64 lastTicks{ 0 };
+        qint64 maxRssKb{ 0 };
+        std::vector<double> cpuSamples;
+    };
+
+    nlohmann::json histogramReport(const ClipShareHistogram& histogram)
+    {
+        return {
+            { "count", histogram.count() },
+            { "p50Ms", histogram.percentile(50) / 1000.0 },
+            { "p99Ms", histogram.percentile(99) / 1000.0 },
+            { "p999Ms", histogram.percentile(99.9) / 1000.0 },
+            { "maxMs", histogram.max() / 1000.0 },
+        };
+    }
+
+    // the node's own copy-to-paste latency, one summary per virtual peer on /metrics
+    nlohmann::json scrapeNodeLatency(const QString& url)
+    {
+        QNetworkAccessManager manager;
+        QEventLoop loop;
+        auto reply = manager.get(QNetworkRequest{ QUrl{ url } });
+        QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+        QTimer::singleShot(5000, &loop, &QEventLoop::quit);
+        loop.exec();
+
+        std::map<std::string, std::vector<double>> quantiles;
+        for (auto& line : reply->readAll().split('\n'))
+        {
+            if (!line.startsWith("clipshare_clip_latency_microseconds{") || !line.contains("stage=\"applied\""))
+                continue;
+            auto quantileAt = line.indexOf("quantile=\"");
+            if (quantileAt < 0)
+                continue;
+            auto quantile = line.mid(quantileAt + 10, line.indexOf('"', quantileAt + 10) - quantileAt - 10);
+            quantiles[quantile.toStdString()].push_back(line.mid(line.lastIndexOf(' ') + 1).toDouble() / 1000.0);
+        }
+        reply->deleteLater();
+
+        nlohmann::json report;
+        for (auto& quantile : quantiles)
+        {
+            auto& values = quantile.second;
+            std::sort(values.begin(), values.end());
+            report[quantile.first] = {
+                { "peers", values.size() },
+                { "medianMs", values[values.size() / 2] },
+                { "maxMs", values.back() },
+            };
+        }
+        return report;
+    }
+
+    void raiseFileLimit()
+    {
+#ifdef Q_OS_LINUX
+        rlimit limit{};
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+#endif
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication a(argc, argv);
+    spdlog::set_level(spdlog::level::info);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Spins up virtual ClipShare peers on loopback against one node");
+    parser.addHelpOption();
+    QCommandLineOption peersOption{ "peers", "Number of virtual peers.", "count", "100" };
+    QCommandLineOption nodeOption{ "node", "Address of the node under test.", "host", "127.0.0.1" };
+    QCommandLineOption heartbeatPortOption{ "heartbeat-port", "Heartbeat port of the node.", "port", "41688" };
+    QCommandLineOption packagePortOption{ "package-port", "Package port of the node.", "port", "41688" };
+    QCommandLineOption heartbeatIntervalOption{ "heartbeat-interval", "Heartbeat interval of every peer.", "ms", "20000" };
+    QCommandLineOption rateOption{ "rate", "Clips per second sent by all peers together.", "clips", "10" };
+    QCommandLineOption durationOption{ "duration", "Seconds to run.", "seconds", "60" };
+    QCommandLineOption workloadOption{ "workload", "JSON array of {type, size, weight} clips to replay.", "file" };
+    QCommandLineOption pidOption{ "node-pid", "Sample CPU and memory of this process (Linux).", "pid" };
+    QCommandLineOption metricsOption{ "metrics-url", "Scrape the node latency from its /metrics at the end.", "url" };
+    QCommandLineOption outputOption{ "output", "Write the JSON report to a file instead of stdout.", "file" };
+    QCommandLineOption gossipOption{ "gossip", "Gossip clips among the peers and the node with this fanout instead of sending them to the node.", "fanout", "0" };
+    parser.addOptions({ peersOption, nodeOption, heartbeatPortOption, packagePortOption, heartbeatIntervalOption
+        , rateOption, durationOption, workloadOption, pidOption, metricsOption, outputOption, gossipOption });
+    parser.process(a);
+
+    LoadGenOptions options;
+    options.node = QHostAddress{ parser.value(nodeOption) };
+    options.heartbeatPort = static_cast<quint16>(parser.value(heartbeatPortOption).toUInt());
+    options.packagePort = static_cast<quint16>(parser.value(packagePortOption).toUInt());
+    options.heartbeatInterval = parser.value(heartbeatIntervalOption).toInt();
+    options.rate = parser.value(rateOption).toDouble();
+    options.gossipFanout = parser.value(gossipOption).toInt();
+    std::vector<GossipMember> mesh;
+    options.mesh = &mesh;
+
+    std::vector<Workload> workloads;
+    if (parser.isSet(workloadOption))
+    {
+        QFile file(parser.value(workloadOption));
+        if (!file.open(QFile::ReadOnly))
+        {
+            spdlog::error("[LoadGen] Cannot open {}", parser.value(workloadOption));
+            return 1;
+        }
+        auto data = file.readAll();
+        try {
+            workloads = nlohmann::json::parse(data.constData(), data.constData() + data.size()).get<std::vector<Workload>>();
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            spdlog::error("[LoadGen] Invalid {}: {}", parser.value(workloadOption), e.what());
+            return 1;
+        }
+        // picked in proportion to their weights, see VirtualPeer::sendClip
+        qint64 totalWeight = 0;
+        for (auto& workload : workloads)
+        {
+            if (workload.weight <= 0)
+            {
+                spdlog::error("[LoadGen] Workload {} of {} needs a positive weight, not {}", workload.type, parser.value(workloadOption), workload.weight);
+                return 1;
+            }
+            totalWeight += workload.weight;
+        }
+        if (workloads.empty() || totalWeight > std::numeric_limits<int>::max())
+        {
+            spdlog::error("[LoadGen] {} needs at least one workload and a total weight below {}", parser.value(workloadOption), std::numeric_limits<int>::max());
+            return 1;
+        }
+    }
+    else
+    {
+        // mostly short text, some rich text, the odd screenshot
+        workloads.resize(3);
+        workloads[0].type = "text";
+        workloads[0].size = 256;
+        workloads[0].weight = 80;
+        workloads[1].type = "html";
+        workloads[1].size = 16 << 10;
+        workloads[1].weight = 15;
+        workloads[2].type = "image";
+        workloads[2].size = 2 << 20;
+        workloads[2].weight = 5;
+    }
+    for (auto& workload : workloads)
+        preparePackage(workload);
+
+    raiseFileLimit();
+
+    LoadGenStats stats;
+    QObject peers;
+    auto peerCount = parser.value(peersOption).toInt();
+    for (int i = 0; i < peerCount; ++i)
+    {
+        auto peer = new VirtualPeer(options, workloads, stats, &peers);
+        if (!peer->start())
+        {
+            spdlog::error("[LoadGen] Cannot start virtual peer {}", i);
+            return 1;
+        }
+        mesh.push_back(peer->member());
+    }
+    spdlog::info("[LoadGen] {} virtual peers against {}:{}", peerCount, options.node.toString(), options.packagePort);
+
+    std::unique_ptr<NodeSampler> sampler;
+    QTimer sampleTimer;
+    if (parser.isSet(pidOption))
+    {
+        sampler.reset(new NodeSampler(parser.value(pidOption).toLongLong()));
+        sampler->sample();
+        QObject::connect(&sampleTimer, &QTimer::timeout, [&] { sampler->sample(); });
+        sampleTimer.start(1000);
+    }
+
+    QElapsedTimer elapsed;
+    elapsed.start();
+    QTimer::singleShot(parser.value(durationOption).toInt() * 1000, &a, [&]
+        {
+            for (auto child : peers.children())
+                static_cast<VirtualPeer*>(child)->stop();
+            // let the last writes drain
+            QTimer::singleShot(2000, &a, &QCoreApplication::quit);
+        });
+    a.exec();
+
+    auto seconds = elapsed.elapsed() / 1000.0;
+    nlohmann::json report;
+    report["peers"] = peerCount;
+    report["seconds"] = seconds;
+    report["uplinks"] = stats.uplinks;
+    report["downlinks"] = stats.downlinks;
+    report["socketErrors"] = stats.socketErrors;
+    report["clipsSent"] = stats.clipsSent;
+    report["bytesSent"] = stats.bytesSent;
+    report["clipsPerSecond"] = stats.clipsSent / seconds;
+    report["clipsReceived"] = stats.clipsReceived;
+    report["datagramsReceived"] = stats.datagramsReceived;
+    report["bytesReceived"] = stats.bytesReceived;
+    report["writeLatency"] = histogramReport(stats.writeLatency);
+    report["receiveLatency"] = histogramReport(stats.receiveLatency);
+    if (options.gossipFanout > 0)
+    {
+        // converged once every other virtual peer had it, the node is not observed
+        ClipShareHistogram convergence;
+        quint64 converged = 0;
+        double coverage = 0;
+        for (auto& clip : stats.gossipClips)
+        {
+            coverage += peerCount > 1 ? static_cast<double>(clip.second.reached) / (peerCount - 1) : 1.0;
+            if (clip.second.reached >= peerCount - 1)
+            {
+                ++converged;
+                convergence.record((std::max(clip.second.lastAt, clip.second.sentAt) - clip.second.sentAt) / 1000);
+            }
+        }
+        report["gossip"] = {
+            { "fanout", options.gossipFanout },
+            { "clips", stats.gossipClips.size() },
+            { "converged", converged },
+            { "coverage", stats.gossipClips.empty() ? 0.0 : coverage / stats.gossipClips.size() },
+            { "convergence", histogramReport(convergence) },
+            { "usefulBytes", stats.gossipUsefulBytes },
+            { "redundantBytes", stats.gossipRedundantBytes },
+            { "controlBytes", stats.gossipControlBytes },
+            { "redundantByteRatio", stats.gossipUsefulBytes == 0 ? 0.0
+                : static_cast<double>(stats.gossipRedundantBytes + stats.gossipControlBytes) / stats.gossipUsefulBytes },
+            { "duplicateAnnouncements", stats.gossipDuplicates },
+            { "pulls", stats.gossipPulls },
+        };
+    }
+    if (sampler)
+        report["node"] = sampler->report();
+    if (parser.isSet(metricsOption))
+        report["nodeLatency"] = scrapeNodeLatency(parser.value(metricsOption));
+
+    auto text = QByteArray::fromStdString(report.dump(2));
+    if (parser.isSet(outputOption))
+    {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        {
+            spdlog::error("[LoadGen] Cannot write {}", parser.value(outputOption));
+            return 1;
+        }
+        file.write(text);
+    }
+    else
+    {
+        fwrite(text.constData(), 1, text.size(), stdout);
+        fputc('\n', stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+﻿#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QMimeData>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include "ClipShareClipboard.h"
+#include "ClipShareHistogram.h"
+#include "ClipShareLog.h"
+#include "ClipSharePackage.h"
+#include "ClipShareRecorder.h"
+#include "ClipShareService.h"
+
+namespace
+{
+    struct FormatStats
+    {
+        quint64 count{ 0 };
+        quint64 rawBytes{ 0 };
+        quint64 encodedBytes{ 0 };
+    };
+
+    struct ReplayStats
+    {
+        quint64 clips{ 0 };
+        quint64 rawBytes{ 0 };
+        quint64 frameBytes{ 0 };
+        quint64 imageBytes{ 0 };
+        ClipShareHistogram pipeline;    // us, dataChanged until the package was sent
+        std::map<std::string, FormatStats> formats;
+    };
+}
+
+int main(int argc, char* argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication a(argc, argv);
+    ClipShareLog::setLevels("warn");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays a clipboard recording through the ClipShare pipeline");
+    parser.addHelpOption();
+    parser.addPositionalArgument("recording", "File written with clipshare --record.");
+    QCommandLineOption speedOption{ "speed", "Replay speed relative to the recording, above 0; a large factor replays as fast as the event loop allows.", "factor", "1" };
+    QCommandLineOption loopOption{ "loop", "Replay the recording this many times.", "count", "1" };
+    QCommandLineOption sendOption{ "send", "Start the service and send every clip to the discovered peers." };
+    QCommandLineOption configOption{ "config", "Service configuration for --send.", "file" };
+    QCommandLineOption outputOption{ "output", "Write the JSON report to a file instead of stdout.", "file" };
+    parser.addOptions({ speedOption, loopOption, sendOption, configOption, outputOption });
+    parser.process(a);
+
+    if (parser.positionalArguments().isEmpty())
+        parser.showHelp(1);
+
+    bool ok = false;
+    auto recording = ClipShareRecorder::load(parser.positionalArguments().front(), &ok);
+    if (!ok)
+        return 1;
+
+    // the clips are injected and sent from the event loop, there is no pace without one
+    auto speed = parser.value(speedOption).toDouble(&ok);
+    if (!ok || !(speed > 0))
+    {
+        spdlog::error("[Replay] --speed needs a factor above 0, not {}", parser.value(speedOption));
+        return 1;
+    }
+    auto loops = qMax(1, parser.value(loopOption).toInt());
+    QVector<ClipShareSnapshot> snapshots;
+    for (int loop = 0; loop < loops; ++loop)
+    {
+        auto offset = snapshots.isEmpty() ? 0 : snapshots.back().elapsed + 1;
+        for (auto snapshot : recording)
+        {
+            snapshot.elapsed += offset;
+            snapshots.push_back(snapshot);
+        }
+    }
+
+    ClipShareConfig config;
+    if (parser.isSet(configOption))
+    {
+        try {
+            config = ClipShareConfig::load(parser.value(configOption));
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            spdlog::error("[Replay] Invalid {}: {}", parser.value(configOption), e.what());
+            return 1;
+        }
+    }
+    config.recordFile.clear();
+
+    ReplayStats stats;
+    qint64 injectedAt = 0;
+    ClipShareVirtualClipboard clipboard;
+
+    // connected before the service, runs before it handles the change
+    QObject::connect(&clipboard, &ClipShareClipboard::dataChanged, [&] { injectedAt = ClipShareTrace::now(); });
+
+    ClipShareService service{ config, &clipboard };
+    if (parser.isSet(sendOption) && !service.start())
+        return 1;
+
+    // connected after the service, runs once the package has been sent
+    QObject::connect(&clipboard, &ClipShareClipboard::dataChanged, [&]
+        {
+            stats.pipeline.record((ClipShareTrace::now() - injectedAt) / 1000);
+            ++stats.clips;
+
+            // sizes are measured again outside of the timed path
+            auto mimeData = clipboard.mimeData();
+            ClipSharePackage package;
+            package.encodeMimeData(mimeData);
+            stats.frameBytes += package.encode().size();
+            stats.imageBytes += package.mimeImageData.size();
+            for (int i = 0; i < package.mimeFormats.size(); ++i)
+            {
+                auto raw = mimeData->data(package.mimeFormats[i]).size();
+                auto& format = stats.formats[package.mimeFormats[i].toStdString()];
+                ++format.count;
+                format.rawBytes += raw;
+                format.encodedBytes += package.mimeData[i].size();
+                stats.rawBytes += raw;
+            }
+        });
+
+    QObject::connect(&clipboard, &ClipShareVirtualClipboard::finished, &a, &QCoreApplication::quit);
+    clipboard.play(snapshots, 0, 0, speed);
+    a.exec();
+
+    nlohmann::json report;
+    report["recording"] = parser.positionalArguments().front();
+    report["snapshots"] = recording.size();
+    report["clips"] = stats.clips;
+    report["speed"] = speed;
+    report["rawBytes"] = stats.rawBytes;
+    report["frameBytes"] = stats.frameBytes;
+    report["imageBytes"] = stats.imageBytes;
+    report["expansion"] = stats.rawBytes == 0 ? 0.0 : static_cast<double>(stats.frameBytes) / stats.rawBytes;
+    report["pipeline"] = {
+        { "p50Ms", stats.pipeline.percentile(50) / 1000.0 },
+        { "p99Ms", stats.pipeline.percentile(99) / 1000.0 },
+        { "p999Ms", stats.pipeline.percentile(99.9) / 1000.0 },
+        { "maxMs", stats.pipeline.max() / 1000.0 },
+        { "meanMs", stats.pipeline.mean() / 1000.0 },
+    };
+    for (auto& format : stats.formats)
+    {
+        report["formats"][format.first] = {
+            { "count", format.second.count },
+            { "rawBytes", format.second.rawBytes },
+            { "encodedBytes", format.second.encodedBytes },
+        };
+    }
+
+    auto text = QByteArray::fromStdString(report.dump(2));
+    if (parser.isSet(outputOption))
+    {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        {
+            spdlog::error("[Replay] Cannot write {}", parser.value(outputOption));
+            return 1;
+        }
+        file.write(text);
+    }
+    else
+    {
+        fwrite(text.constData(), 1, text.size(), stdout);
+        fputc('\n', stdout);
+    }
+    return 0;
+}